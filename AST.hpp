@@ -0,0 +1,496 @@
+#ifndef _AST_HPP_
+#define _AST_HPP_
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "Util.hpp"
+#include "Token.hpp"
+
+// *********
+// * ARENA *
+// *********
+
+// Bump-pointer allocator. Nothing is freed on its own: reset() rewinds to
+// the first block and keeps every block for reuse, so a tree is dropped in
+// one step. Destructors never run, so only trivially destructible objects
+// belong here.
+struct Arena {
+    enum {
+        BLOCK_BYTES = 64 * 1024,
+    };
+
+    struct Block {
+        uint8_t* base;
+        size_t size;
+    };
+
+    std::vector<Block> blocks;
+    size_t current;
+    uint8_t* next;
+    uint8_t* limit;
+
+    Arena(): current(0), next(nullptr), limit(nullptr)
+    {
+    }
+
+    ~Arena()
+    {
+        for (Block& block : blocks)
+            free(block.base);
+    }
+
+    void* alloc(size_t bytes, size_t align = alignof(void*))
+    {
+        uint8_t* p = (uint8_t*) (((uintptr_t) next + align - 1) & ~(uintptr_t) (align - 1));
+
+        if (!next || p + bytes > limit)
+            p = grow(bytes + align, align);
+
+        next = p + bytes;
+        return p;
+    }
+
+    template <typename T, typename... Args>
+    T* make(Args&&... args)
+    {
+        return new (alloc(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+    }
+
+    template <typename T>
+    T* array(size_t count)
+    {
+        return (T*) alloc(sizeof(T) * count, alignof(T));
+    }
+
+    void reset()
+    {
+        current = 0;
+        next = blocks.empty() ? nullptr : blocks[0].base;
+        limit = blocks.empty() ? nullptr : blocks[0].base + blocks[0].size;
+    }
+
+    size_t reservedBytes() const
+    {
+        size_t bytes = 0;
+
+        for (Block const& block : blocks)
+            bytes += block.size;
+
+        return bytes;
+    }
+
+private:
+    // Moves to the next kept block big enough for bytes, or adds one.
+    // Kept blocks too small for this request are skipped until reset.
+    uint8_t* grow(size_t bytes, size_t align)
+    {
+        size_t i = next ? current + 1 : current;
+
+        while (i < blocks.size() && blocks[i].size < bytes)
+            ++i;
+
+        if (i == blocks.size())
+        {
+            Block block;
+            block.size = std::max<size_t>(bytes, BLOCK_BYTES);
+            block.base = (uint8_t*) malloc(block.size);
+
+            if (!block.base)
+                die("Out of memory for the arena!");
+
+            blocks.push_back(block);
+        }
+
+        current = i;
+        limit = blocks[i].base + blocks[i].size;
+        return (uint8_t*) (((uintptr_t) blocks[i].base + align - 1) & ~(uintptr_t) (align - 1));
+    }
+
+    Arena(Arena const&);
+    Arena& operator=(Arena const&);
+};
+
+// ***********
+// * SYMBOLS *
+// ***********
+
+// An interned string: equal texts share one Symbol, so they compare by
+// pointer. The text is NUL-terminated.
+struct Symbol {
+    uint32_t hash;
+    uint32_t length;
+    char text[1];
+};
+
+// Open-addressed set of the symbols in an arena; the texts live in the
+// arena, only the slots are kept here.
+struct InternTable {
+    Arena& arena;
+    std::vector<Symbol*> slots;
+    size_t count;
+
+    InternTable(Arena& pArena): arena(pArena), slots(256), count(0)
+    {
+    }
+
+    static uint32_t hash(char const* start, char const* end)
+    {
+        uint32_t h = 2166136261u;
+
+        for (char const* p = start; p < end; ++p)
+            h = (h ^ (uint8_t) *p) * 16777619u;
+
+        return h;
+    }
+
+    Symbol const* intern(char const* start, char const* end)
+    {
+        uint32_t h = hash(start, end);
+        uint32_t length = end - start;
+        size_t mask = slots.size() - 1;
+
+        for (size_t i = h & mask;; i = (i + 1) & mask)
+        {
+            Symbol* sym = slots[i];
+
+            if (!sym)
+                break;
+
+            if (sym->hash == h && sym->length == length && memcmp(sym->text, start, length) == 0)
+                return sym;
+        }
+
+        Symbol* sym = (Symbol*) arena.alloc(offsetof(Symbol, text) + length + 1, alignof(Symbol));
+        sym->hash = h;
+        sym->length = length;
+        memcpy(sym->text, start, length);
+        sym->text[length] = 0;
+
+        if (2 * (count + 1) > slots.size())
+            rehash(2 * slots.size());
+
+        insert(sym);
+        ++count;
+        return sym;
+    }
+
+    // Forgets every symbol; called when the arena holding them is reset.
+    void clear()
+    {
+        std::fill(slots.begin(), slots.end(), nullptr);
+        count = 0;
+    }
+
+private:
+    void insert(Symbol* sym)
+    {
+        size_t mask = slots.size() - 1;
+        size_t i = sym->hash & mask;
+
+        while (slots[i])
+            i = (i + 1) & mask;
+
+        slots[i] = sym;
+    }
+
+    void rehash(size_t size)
+    {
+        std::vector<Symbol*> old(size);
+        old.swap(slots);
+
+        for (Symbol* sym : old)
+            if (sym)
+                insert(sym);
+    }
+};
+
+// *********
+// * NODES *
+// *********
+
+/*
+ * expr = (list | atom)
+ * list = '(' expr* ')'
+ * atom = name | literal
+*/
+
+struct ASTNode {
+    enum Type {
+        LIST, ATOM,
+    };
+
+    Type type;
+
+    ASTNode(Type type_): type(type_)
+    {
+    }
+
+    void print() const;
+};
+
+// The children sit in one contiguous array in the arena.
+struct List: public ASTNode {
+    ASTNode* const* nodes;
+    uint32_t count;
+
+    List(ASTNode* const* nodes_, uint32_t count_): ASTNode(ASTNode::LIST), nodes(nodes_), count(count_)
+    {
+    }
+
+    void print() const
+    {
+        printf("(");
+
+        for (uint32_t i = 0; i < count; ++i)
+        {
+            nodes[i]->print();
+            printf(" ");
+        }
+
+        printf(")");
+    }
+};
+
+struct Atom: public ASTNode {
+    Token::Type tokenType;
+    Symbol const* symbol;
+
+    Atom(Token::Type tokenType_, Symbol const* symbol_): ASTNode(ASTNode::ATOM), tokenType(tokenType_),
+            symbol(symbol_)
+    {
+    }
+
+    char const* text() const
+    {
+        return symbol->text;
+    }
+
+    void print() const
+    {
+        printf("%s", text());
+    }
+};
+
+inline void ASTNode::print() const
+{
+    if (type == LIST)
+        static_cast<List const*>(this)->print();
+    else
+        static_cast<Atom const*>(this)->print();
+}
+
+// Owns every node and symbol of the trees built in it. reset() drops them
+// all at once.
+struct ASTArena {
+    Arena arena;
+    InternTable symbols;
+
+    ASTArena(): symbols(arena)
+    {
+    }
+
+    List* list(ASTNode* const* nodes, size_t count)
+    {
+        ASTNode** copy = arena.array<ASTNode*>(count);
+        std::copy(nodes, nodes + count, copy);
+        return arena.make<List>(copy, count);
+    }
+
+    Atom* atom(TokenView const& tok)
+    {
+        return arena.make<Atom>(tok.type, symbols.intern(tok.start, tok.end));
+    }
+
+    void reset()
+    {
+        arena.reset();
+        symbols.clear();
+    }
+};
+
+// **********
+// * PARSER *
+// **********
+
+struct CompilationError: public std::exception {
+    char msgBuff[512];
+
+    CompilationError(std::string const& msg)
+    {
+        copyToBuff<512>(msgBuff, msg);
+    }
+
+    const char* what() const noexcept
+    {
+        return msgBuff;
+    }
+};
+
+struct Parser {
+    typedef std::vector<TokenView>::const_iterator TokenIter;
+
+    TokenIter cursor;
+    ASTArena& ast;
+    // Children of the lists still open, innermost last.
+    std::vector<ASTNode*> pending;
+    // Where each open list's children start in pending, innermost last.
+    std::vector<size_t> open;
+
+    Parser(TokenIter start, ASTArena& pAst): cursor(start), ast(pAst)
+    {
+    }
+
+    // **********
+    // * Errors *
+    // **********
+
+    void expectedTokenError(Token::Type tok)
+    {
+        throw CompilationError("Expected '" + Token::typeName(tok) + "'");
+    }
+
+    void unexpectedTokenError(TokenView const& tok)
+    {
+        if(tok.type == Token::INVALID)
+            throw CompilationError("Unexpected '" + tok.text() + "'");
+        else
+            throw CompilationError("Unexpected '" + Token::typeName(tok.type) + "'");
+    }
+
+    // ********
+    // * Util *
+    // ********
+
+    bool end()
+    {
+        return cursor->type == Token::END_OF_INPUT;
+    }
+
+    Token::Type peek()
+    {
+        return cursor->type;
+    }
+
+    void readToken(Token::Type tok)
+    {
+        if(peek() != tok)
+            expectedTokenError(tok);
+        ++cursor;
+    }
+
+    Token::Type readToken()
+    {
+        return (cursor++)->type;
+    }
+
+    // *********
+    // * Rules *
+    // *********
+
+    static bool isAtom(Token::Type tokType)
+    {
+        return tokType != Token::CBR &&
+                tokType != Token::OBR &&
+                tokType != Token::END_OF_INPUT &&
+                tokType != Token::INVALID;
+    }
+
+    ASTNode* readAtom()
+    {
+        Token::Type tokType = peek();
+
+        if(!isAtom(tokType))
+            unexpectedTokenError(*cursor);
+
+        return ast.atom(*cursor++);
+    }
+
+    // Lists nest without recursion: an open bracket pushes a frame on
+    // open, a close bracket pops it into a List, and every finished node
+    // goes to the innermost open list until none is left. Only the two
+    // heap stacks grow with the nesting depth.
+    ASTNode* readExpr()
+    {
+        // A parse that threw may have left them dirty.
+        pending.clear();
+        open.clear();
+
+        for(;;)
+        {
+            ASTNode* node;
+
+            if(peek() == Token::OBR)
+            {
+                ++cursor;
+                open.push_back(pending.size());
+                continue;
+            }
+            else if(peek() == Token::CBR && !open.empty())
+            {
+                ++cursor;
+                size_t first = open.back();
+                open.pop_back();
+                node = ast.list(pending.data() + first, pending.size() - first);
+                pending.resize(first);
+            }
+            else
+            {
+                node = readAtom();
+            }
+
+            if(open.empty())
+                return node;
+
+            pending.push_back(node);
+        }
+    }
+};
+
+// The parser as it was before readExpr lost its recursion: same rules,
+// same errors, but native stack use grows with the nesting depth. Kept as
+// the reference for the differential parse test and the parse bench.
+struct RecursiveParser: public Parser {
+    RecursiveParser(TokenIter start, ASTArena& pAst): Parser(start, pAst)
+    {
+    }
+
+    ASTNode* readList()
+    {
+        readToken(Token::OBR);
+
+        size_t first = pending.size();
+
+        while(peek() != Token::CBR)
+        {
+            ASTNode* node = readExpr();
+            pending.push_back(node);
+        }
+
+        readToken(Token::CBR);
+
+        List* lst = ast.list(pending.data() + first, pending.size() - first);
+        pending.resize(first);
+        return lst;
+    }
+
+    ASTNode* readExpr()
+    {
+        switch(peek())
+        {
+            case Token::OBR:
+                return readList();
+            default:
+                return readAtom();
+        }
+    }
+};
+
+#endif
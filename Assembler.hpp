@@ -4,6 +4,7 @@
 #include <vector>
 #include <map>
 #include <string>
+#include <type_traits>
 
 #include "Util.hpp"
 #include "Opcode.hpp"
@@ -11,12 +12,13 @@
 
 struct AsmToken {
 	enum Type {
-		OPCODE, VALUE, ADDR, LABEL
+		OPCODE, VALUE, INT, ADDR, LABEL
 	};
 	
 	union Data {
 		Opcode opcode;
 		Value value;
+		int64_t i;
 		Addr addr;
 		char const* label;
 	};
@@ -34,6 +36,13 @@ struct AsmToken {
 		data.value = value;
 	}
 	
+	// Any integer literal, so neither 0 nor size_t expressions are ambiguous.
+	template <typename T, typename = typename std::enable_if<std::is_integral<T>::value>::type>
+	AsmToken(T i): type(INT)
+	{
+		data.i = i;
+	}
+	
 	AsmToken(Addr addr): type(ADDR)
 	{
 		data.addr = addr;
@@ -49,7 +58,7 @@ struct Assembler {
 	Program& prog;
 	std::vector<AsmToken> const& tokens;
 	int tokIndex;
-	std::map<std::string, Addr> labMap;
+	std::map<std::string, uint32_t> labMap;
 	
 	Assembler(Program& pProg, std::vector<AsmToken> const& pTokens): prog(pProg), tokens(pTokens), tokIndex(0)
 	{
@@ -57,7 +66,7 @@ struct Assembler {
 		{
 			if(tokens[tokIndex].type == AsmToken::LABEL)
 			{
-				labMap[tokens[tokIndex].data.label] = prog.cursor;
+				labMap[tokens[tokIndex].data.label] = prog.label();
 				++tokIndex;
 			}
 			else
@@ -70,6 +79,18 @@ struct Assembler {
             die(msg);
         }
         
+	// Label names keyed by code offset, for mapping profiles and traces
+	// back to the source.
+	std::map<uint32_t, std::string> labelsByOffset() const
+	{
+		std::map<uint32_t, std::string> labels;
+		
+		for(auto const& kv : labMap)
+			labels[kv.second] = kv.first;
+		
+		return labels;
+	}
+	
 	bool reachedEnd()
 	{
 		return tokIndex >= (int)tokens.size();
@@ -87,52 +108,96 @@ struct Assembler {
 	
 	Value parseValue()
 	{
-		if(tokens[tokIndex].type != AsmToken::VALUE)
+		AsmToken const& tok = tokens[tokIndex];
+		Value value = 0;
+		
+		if(tok.type == AsmToken::VALUE)
+			value = tok.data.value;
+		else if(tok.type == AsmToken::INT)
+			value = (Value)tok.data.i;
+		else
 			error("Expected value!");
 
-		Value value = tokens[tokIndex].data.value;
 		++tokIndex;
 		return value;
 	}
 	
-	Addr parseAddrOrLabel()
+	int64_t parseInt()
+	{
+		if(tokens[tokIndex].type != AsmToken::INT)
+			error("Expected integer!");
+
+		int64_t i = tokens[tokIndex].data.i;
+		++tokIndex;
+		return i;
+	}
+	
+	Addr parseAddr()
 	{
-		Addr addr = nullptr;
+		if(tokens[tokIndex].type != AsmToken::ADDR)
+			error("Expected address!");
+		
+		Addr addr = tokens[tokIndex].data.addr;
+		++tokIndex;
+		return addr;
+	}
+	
+	uint32_t parseLabel()
+	{
+		uint32_t offs = 0;
 		AsmToken const& tok = tokens[tokIndex];
 	
-		if(tok.type == AsmToken::ADDR)
-			addr = tokens[tokIndex].data.addr;
-		else if(tok.type == AsmToken::LABEL)
-		{
-			auto kv = labMap.find(tok.data.label);
-			
-			if(kv == labMap.end())
-				error("Unknown label!");
-			else
-				addr = kv->second;
-		}
+		if(tok.type != AsmToken::LABEL)
+			error("Expected label!");
 		
+		auto kv = labMap.find(tok.data.label);
+			
+		if(kv == labMap.end())
+			error("Unknown label!");
 		else
-			error("Expected address or label!");
+			offs = kv->second;
 		
 		++tokIndex;
-		return addr;
+		return offs;
+	}
+	
+	// Address loads given a label are assembled into their code-relative
+	// form so the bytecode stays position independent.
+	static Opcode labelForm(Opcode opcode)
+	{
+		switch(opcode)
+		{
+			case LOAD_ADDR_CONST: return LOAD_LABEL_CONST;
+			case ILOAD_ADDR_CONST: return ILOAD_LABEL_CONST;
+			default: return OPCODE_COUNT;
+		}
 	}
 	
 	void parseInstruction()
 	{
 		Opcode opcode = parseOpcode();
 	
-		switch(opcode)
+		switch(OPCODE_OPERANDS[opcode])
 		{
-			case LOAD_ADDR_CONST:
-				prog.write(opcode, parseAddrOrLabel());
+			case OPERAND_ADDR:
+				if(tokens[tokIndex].type == AsmToken::LABEL && labelForm(opcode) != OPCODE_COUNT)
+					prog.writeLabel(labelForm(opcode), parseLabel());
+				else
+					prog.write(opcode, parseAddr());
+				break;
+				
+			case OPERAND_LABEL:
+				prog.writeLabel(opcode, parseLabel());
 				break;
 		
-			case LOAD_VAL_CONST: case LOAD_STACK_OFFS_CONST: case PUSHB_CONST: case POPB_CONST:
+			case OPERAND_VALUE: case OPERAND_FLOAT:
 				prog.write(opcode, parseValue());
 				break;
 				
+			case OPERAND_INT: case OPERAND_I32: case OPERAND_I8:
+				prog.writeInt(opcode, parseInt());
+				break;
+				
 			default:
 				prog.write(opcode);
 				break;
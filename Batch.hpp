@@ -0,0 +1,116 @@
+#ifndef _BATCH_HPP_
+#define _BATCH_HPP_
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "Util.hpp"
+#include "VMTypes.hpp"
+#include "VM.hpp"
+#include "Host.hpp"
+#include "Jit.hpp"
+
+// Field `column` of record r sits at base + r * stride. A columnar buffer
+// has one column per array with the element size as stride; an array of
+// structs has one column per member, all with the struct size as stride.
+struct BatchColumn {
+    uint8_t const* base;
+    size_t stride;
+};
+
+// count records, each run with the address of each of its fields pushed
+// as an integer, in column order. If results is set, results[r] gets the
+// top operand record r leaves, or 0 if it leaves none.
+struct Batch {
+    enum {
+        MAX_COLUMNS = 8,
+    };
+
+    size_t count;
+    int columnCount;
+    BatchColumn columns[MAX_COLUMNS];
+    Slot* results;
+};
+
+// Runs one script over every record of a batch. The VMs are made once, one
+// per thread, and only reset between records, which costs a few pointer
+// stores: the gp stack keeps its committed pages and its old contents. A
+// script must halt on its own; one that leaves a host call pending stops
+// the batch.
+struct BatchRunner {
+    uint8_t* code;
+    uint8_t* entry;
+    Jit* jit;
+    std::vector<std::unique_ptr<VM> > vms;
+
+    // threadCount VMs are kept, and run() splits batches into that many
+    // contiguous ranges, the first on the calling thread. A jit, if given,
+    // must be for code; it is compiled here so the threads can share it.
+    BatchRunner(uint8_t* pCode, uint32_t pEntry = 0, unsigned threadCount = 1, Jit* pJit = nullptr,
+            HostTable const* hosts = nullptr, size_t gpStackBytes = GP_STACK_BYTES): code(pCode),
+            entry(pCode + pEntry), jit(pJit)
+    {
+        for (unsigned i = 0; i < std::max(1u, threadCount); ++i)
+        {
+            vms.push_back(std::unique_ptr<VM>(new VM(code, OP_STACK_DEPTH, gpStackBytes)));
+            vms.back()->hosts = hosts;
+        }
+
+#ifdef VM_HAS_JIT
+        if (jit && !jit->compiled())
+            jit->compile();
+#endif
+    }
+
+    void run(Batch const& batch)
+    {
+        if (batch.columnCount > Batch::MAX_COLUMNS)
+            die("Too many batch columns!");
+
+        size_t parts = std::min((size_t) vms.size(), batch.count);
+
+        if (parts <= 1)
+        {
+            runRange(*vms[0], batch, 0, batch.count);
+            return;
+        }
+
+        std::vector<std::thread> threads;
+
+        for (size_t i = 1; i < parts; ++i)
+            threads.push_back(std::thread(&BatchRunner::runRange, this, std::ref(*vms[i]), std::cref(batch),
+                    batch.count * i / parts, batch.count * (i + 1) / parts));
+
+        runRange(*vms[0], batch, 0, batch.count / parts);
+
+        for (std::thread& thread : threads)
+            thread.join();
+    }
+
+    void runRange(VM& vm, Batch const& batch, size_t first, size_t last)
+    {
+        for (size_t r = first; r < last; ++r)
+        {
+            vm.reset(entry);
+
+            for (int c = 0; c < batch.columnCount; ++c)
+                vm.opStack.top++->i = (intptr_t) (batch.columns[c].base + r * batch.columns[c].stride);
+
+            if ((jit ? jit->run(vm) : vm.run()) != RUN_HALTED)
+                die("Batch script did not halt!");
+
+            if (batch.results)
+            {
+                Slot res;
+                res.i = 0;
+                batch.results[r] = vm.opStack.size() ? vm.opStack.top[-1] : res;
+            }
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,58 @@
+#ifndef _BUDGET_HPP_
+#define _BUDGET_HPP_
+
+#include <chrono>
+#include <cstdint>
+
+#include "Trace.hpp"
+
+// Back edges between two reads of the clock for a time budget.
+#define BUDGET_CLOCK_INTERVAL 64
+
+// Hooks that suspend a run once it has spent an instruction or a time
+// budget. Both are checked on backward jumps only, so a run overshoots by
+// at most one loop iteration and code without loops always reaches HALT.
+// Refill the budget and call VM::run again to resume.
+struct Budget: public NoHooks {
+    static bool const canSuspend = true;
+
+    int64_t instructions;
+    bool timed;
+    std::chrono::steady_clock::time_point deadline;
+    unsigned edges;
+
+    Budget(int64_t pInstructions = INT64_MAX): instructions(pInstructions), timed(false), edges(0)
+    {
+    }
+
+    void refill(int64_t pInstructions)
+    {
+        instructions = pInstructions;
+    }
+
+    // Also suspend once slice has passed from now.
+    void setTimeSlice(std::chrono::nanoseconds slice)
+    {
+        timed = true;
+        deadline = std::chrono::steady_clock::now() + slice;
+        edges = 0;
+    }
+
+    void step(uint8_t const*)
+    {
+        --instructions;
+    }
+
+    bool backEdge(uint8_t const*)
+    {
+        if (instructions <= 0)
+            return false;
+
+        if (timed && ++edges % BUDGET_CLOCK_INTERVAL == 0 && std::chrono::steady_clock::now() >= deadline)
+            return false;
+
+        return true;
+    }
+};
+
+#endif
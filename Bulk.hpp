@@ -0,0 +1,615 @@
+#ifndef _BULK_HPP_
+#define _BULK_HPP_
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+
+#include "Util.hpp"
+#include "Opcode.hpp"
+#include "VMTypes.hpp"
+
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(VM_NO_SIMD)
+#define VM_HAS_SIMD
+#include <immintrin.h>
+
+#define BULK_TARGET_SSE4 __attribute__((target("sse4.1")))
+#define BULK_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+// Kernels behind the bulk opcodes: sum, min, max and dot product over
+// int32, float and double arrays. Each is built for plain C++, SSE4.1 and
+// AVX2, and bulkKernels() picks the best one the CPU supports on first
+// use.
+//
+// Float and double sums add in one fixed shape on every level: 32 float
+// or 16 double partial sums, folded pairwise, then the tail in order. So
+// results do not depend on the machine a script runs on, unless the build
+// lets the compiler contract multiplies and adds into FMAs. Integer sums
+// and products are 64-bit and wrap. The min of no elements is the largest
+// value of the type and the max the smallest; with NaNs in the input the
+// float and double results are unspecified.
+
+enum BulkLevel {
+    BULK_SCALAR, BULK_SSE4, BULK_AVX2,
+};
+
+struct BulkKernels {
+    char const* name;
+    int64_t (*sumInt)(int32_t const* src, size_t count);
+    int32_t (*minInt)(int32_t const* src, size_t count);
+    int32_t (*maxInt)(int32_t const* src, size_t count);
+    int64_t (*dotInt)(int32_t const* a, int32_t const* b, size_t count);
+    float (*sumFloat)(float const* src, size_t count);
+    float (*minFloat)(float const* src, size_t count);
+    float (*maxFloat)(float const* src, size_t count);
+    float (*dotFloat)(float const* a, float const* b, size_t count);
+    double (*sumDouble)(double const* src, size_t count);
+    double (*minDouble)(double const* src, size_t count);
+    double (*maxDouble)(double const* src, size_t count);
+    double (*dotDouble)(double const* a, double const* b, size_t count);
+};
+
+// Binds a level's kernel templates into a BulkKernels table.
+template <typename Level>
+BulkKernels bulkTable(char const* name)
+{
+    return BulkKernels{name,
+        &Level::template sumDotInt<false>, &Level::template extremeInt<false>,
+        &Level::template extremeInt<true>, &Level::template sumDotInt<true>,
+        &Level::template sumDotFloat<false>, &Level::template extremeFloat<false>,
+        &Level::template extremeFloat<true>, &Level::template sumDotFloat<true>,
+        &Level::template sumDotDouble<false>, &Level::template extremeDouble<false>,
+        &Level::template extremeDouble<true>, &Level::template sumDotDouble<true>,
+    };
+}
+
+// **********
+// * SCALAR *
+// **********
+
+struct ScalarBulk {
+    template <typename T>
+    static T extreme(bool max, T const* src, size_t count)
+    {
+        T m = max ? std::numeric_limits<T>::lowest() : std::numeric_limits<T>::max();
+
+        if (std::numeric_limits<T>::has_infinity)
+            m = max ? -std::numeric_limits<T>::infinity() : std::numeric_limits<T>::infinity();
+
+        for (size_t i = 0; i < count; ++i)
+            m = max ? (src[i] > m ? src[i] : m) : (src[i] < m ? src[i] : m);
+
+        return m;
+    }
+
+    // With b, the sum of a[i] * b[i].
+    template <bool DOT>
+    static int64_t sumDotInt(int32_t const* a, size_t count)
+    {
+        return sumDotInt<DOT>(a, a, count);
+    }
+
+    template <bool DOT>
+    static int64_t sumDotInt(int32_t const* a, int32_t const* b, size_t count)
+    {
+        uint64_t sum = 0;
+
+        for (size_t i = 0; i < count; ++i)
+            sum += DOT ? (uint64_t) ((int64_t) a[i] * b[i]) : (uint64_t) (int64_t) a[i];
+
+        return (int64_t) sum;
+    }
+
+    template <bool MAX>
+    static int32_t extremeInt(int32_t const* src, size_t count)
+    {
+        return extreme(MAX, src, count);
+    }
+
+    template <bool DOT>
+    static float sumDotFloat(float const* a, size_t count)
+    {
+        return sumDotFloat<DOT>(a, a, count);
+    }
+
+    template <bool DOT>
+    static float sumDotFloat(float const* a, float const* b, size_t count)
+    {
+        float part[32] = {};
+        size_t i = 0;
+
+        for (; i + 32 <= count; i += 32)
+            for (int j = 0; j < 32; ++j)
+                part[j] += DOT ? a[i + j] * b[i + j] : a[i + j];
+
+        float g[8];
+
+        for (int j = 0; j < 8; ++j)
+            g[j] = (part[j] + part[8 + j]) + (part[16 + j] + part[24 + j]);
+
+        float s0 = g[0] + g[4], s1 = g[1] + g[5], s2 = g[2] + g[6], s3 = g[3] + g[7];
+        float sum = (s0 + s2) + (s1 + s3);
+
+        for (; i < count; ++i)
+            sum += DOT ? a[i] * b[i] : a[i];
+
+        return sum;
+    }
+
+    template <bool MAX>
+    static float extremeFloat(float const* src, size_t count)
+    {
+        return extreme(MAX, src, count);
+    }
+
+    template <bool DOT>
+    static double sumDotDouble(double const* a, size_t count)
+    {
+        return sumDotDouble<DOT>(a, a, count);
+    }
+
+    template <bool DOT>
+    static double sumDotDouble(double const* a, double const* b, size_t count)
+    {
+        double part[16] = {};
+        size_t i = 0;
+
+        for (; i + 16 <= count; i += 16)
+            for (int j = 0; j < 16; ++j)
+                part[j] += DOT ? a[i + j] * b[i + j] : a[i + j];
+
+        double g[4];
+
+        for (int j = 0; j < 4; ++j)
+            g[j] = (part[j] + part[4 + j]) + (part[8 + j] + part[12 + j]);
+
+        double sum = (g[0] + g[2]) + (g[1] + g[3]);
+
+        for (; i < count; ++i)
+            sum += DOT ? a[i] * b[i] : a[i];
+
+        return sum;
+    }
+
+    template <bool MAX>
+    static double extremeDouble(double const* src, size_t count)
+    {
+        return extreme(MAX, src, count);
+    }
+};
+
+#ifdef VM_HAS_SIMD
+
+// ***********
+// * SSE 4.1 *
+// ***********
+
+struct Sse4Bulk {
+    template <bool DOT>
+    BULK_TARGET_SSE4 static int64_t sumDotInt(int32_t const* a, size_t count)
+    {
+        return sumDotInt<DOT>(a, a, count);
+    }
+
+    // pmuldq multiplies the even lanes, so the odd ones are shifted down
+    // for a second multiply.
+    template <bool DOT>
+    BULK_TARGET_SSE4 static int64_t sumDotInt(int32_t const* a, int32_t const* b, size_t count)
+    {
+        __m128i even = _mm_setzero_si128(), odd = _mm_setzero_si128();
+        size_t i = 0;
+
+        for (; i + 4 <= count; i += 4)
+        {
+            __m128i x = _mm_loadu_si128((__m128i const*) (a + i));
+
+            if (DOT)
+            {
+                __m128i y = _mm_loadu_si128((__m128i const*) (b + i));
+                even = _mm_add_epi64(even, _mm_mul_epi32(x, y));
+                odd = _mm_add_epi64(odd, _mm_mul_epi32(_mm_srli_epi64(x, 32), _mm_srli_epi64(y, 32)));
+            }
+            else
+            {
+                even = _mm_add_epi64(even, _mm_cvtepi32_epi64(x));
+                odd = _mm_add_epi64(odd, _mm_cvtepi32_epi64(_mm_srli_si128(x, 8)));
+            }
+        }
+
+        __m128i total = _mm_add_epi64(even, odd);
+        uint64_t sum = (uint64_t) _mm_cvtsi128_si64(total) + (uint64_t) _mm_extract_epi64(total, 1);
+        return (int64_t) sum + ScalarBulk::sumDotInt<DOT>(a + i, b + i, count - i);
+    }
+
+    template <bool MAX>
+    BULK_TARGET_SSE4 static int32_t extremeInt(int32_t const* src, size_t count)
+    {
+        __m128i m = _mm_set1_epi32(MAX ? INT32_MIN : INT32_MAX);
+        size_t i = 0;
+
+        for (; i + 4 <= count; i += 4)
+        {
+            __m128i x = _mm_loadu_si128((__m128i const*) (src + i));
+            m = MAX ? _mm_max_epi32(m, x) : _mm_min_epi32(m, x);
+        }
+
+        int32_t lanes[5];
+        _mm_storeu_si128((__m128i*) lanes, m);
+        lanes[4] = ScalarBulk::extremeInt<MAX>(src + i, count - i);
+        return ScalarBulk::extremeInt<MAX>(lanes, 5);
+    }
+
+    template <bool DOT>
+    BULK_TARGET_SSE4 static __m128 termFloat(float const* a, float const* b, size_t i)
+    {
+        return DOT ? _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)) : _mm_loadu_ps(a + i);
+    }
+
+    template <bool DOT>
+    BULK_TARGET_SSE4 static float sumDotFloat(float const* a, size_t count)
+    {
+        return sumDotFloat<DOT>(a, a, count);
+    }
+
+    // Partial sum k covers elements 4k..4k+3 of each block of 32.
+    template <bool DOT>
+    BULK_TARGET_SSE4 static float sumDotFloat(float const* a, float const* b, size_t count)
+    {
+        __m128 p0 = _mm_setzero_ps(), p1 = p0, p2 = p0, p3 = p0, p4 = p0, p5 = p0, p6 = p0, p7 = p0;
+        size_t i = 0;
+
+        for (; i + 32 <= count; i += 32)
+        {
+            p0 = _mm_add_ps(p0, termFloat<DOT>(a, b, i));
+            p1 = _mm_add_ps(p1, termFloat<DOT>(a, b, i + 4));
+            p2 = _mm_add_ps(p2, termFloat<DOT>(a, b, i + 8));
+            p3 = _mm_add_ps(p3, termFloat<DOT>(a, b, i + 12));
+            p4 = _mm_add_ps(p4, termFloat<DOT>(a, b, i + 16));
+            p5 = _mm_add_ps(p5, termFloat<DOT>(a, b, i + 20));
+            p6 = _mm_add_ps(p6, termFloat<DOT>(a, b, i + 24));
+            p7 = _mm_add_ps(p7, termFloat<DOT>(a, b, i + 28));
+        }
+
+        __m128 lo = _mm_add_ps(_mm_add_ps(p0, p2), _mm_add_ps(p4, p6));
+        __m128 hi = _mm_add_ps(_mm_add_ps(p1, p3), _mm_add_ps(p5, p7));
+        float sum = foldFloat(_mm_add_ps(lo, hi));
+
+        for (; i < count; ++i)
+            sum += DOT ? a[i] * b[i] : a[i];
+
+        return sum;
+    }
+
+    // (s0 + s2) + (s1 + s3)
+    BULK_TARGET_SSE4 static float foldFloat(__m128 s)
+    {
+        __m128 t = _mm_add_ps(s, _mm_movehl_ps(s, s));
+        return _mm_cvtss_f32(_mm_add_ss(t, _mm_shuffle_ps(t, t, 1)));
+    }
+
+    template <bool MAX>
+    BULK_TARGET_SSE4 static float extremeFloat(float const* src, size_t count)
+    {
+        __m128 m = _mm_set1_ps(MAX ? -std::numeric_limits<float>::infinity() : std::numeric_limits<float>::infinity());
+        size_t i = 0;
+
+        for (; i + 4 <= count; i += 4)
+            m = MAX ? _mm_max_ps(m, _mm_loadu_ps(src + i)) : _mm_min_ps(m, _mm_loadu_ps(src + i));
+
+        float lanes[5];
+        _mm_storeu_ps(lanes, m);
+        lanes[4] = ScalarBulk::extremeFloat<MAX>(src + i, count - i);
+        return ScalarBulk::extremeFloat<MAX>(lanes, 5);
+    }
+
+    template <bool DOT>
+    BULK_TARGET_SSE4 static __m128d termDouble(double const* a, double const* b, size_t i)
+    {
+        return DOT ? _mm_mul_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)) : _mm_loadu_pd(a + i);
+    }
+
+    template <bool DOT>
+    BULK_TARGET_SSE4 static double sumDotDouble(double const* a, size_t count)
+    {
+        return sumDotDouble<DOT>(a, a, count);
+    }
+
+    // Partial sum k covers elements 2k and 2k + 1 of each block of 16.
+    template <bool DOT>
+    BULK_TARGET_SSE4 static double sumDotDouble(double const* a, double const* b, size_t count)
+    {
+        __m128d p0 = _mm_setzero_pd(), p1 = p0, p2 = p0, p3 = p0, p4 = p0, p5 = p0, p6 = p0, p7 = p0;
+        size_t i = 0;
+
+        for (; i + 16 <= count; i += 16)
+        {
+            p0 = _mm_add_pd(p0, termDouble<DOT>(a, b, i));
+            p1 = _mm_add_pd(p1, termDouble<DOT>(a, b, i + 2));
+            p2 = _mm_add_pd(p2, termDouble<DOT>(a, b, i + 4));
+            p3 = _mm_add_pd(p3, termDouble<DOT>(a, b, i + 6));
+            p4 = _mm_add_pd(p4, termDouble<DOT>(a, b, i + 8));
+            p5 = _mm_add_pd(p5, termDouble<DOT>(a, b, i + 10));
+            p6 = _mm_add_pd(p6, termDouble<DOT>(a, b, i + 12));
+            p7 = _mm_add_pd(p7, termDouble<DOT>(a, b, i + 14));
+        }
+
+        __m128d lo = _mm_add_pd(_mm_add_pd(p0, p2), _mm_add_pd(p4, p6));
+        __m128d hi = _mm_add_pd(_mm_add_pd(p1, p3), _mm_add_pd(p5, p7));
+        double sum = foldDouble(_mm_add_pd(lo, hi));
+
+        for (; i < count; ++i)
+            sum += DOT ? a[i] * b[i] : a[i];
+
+        return sum;
+    }
+
+    BULK_TARGET_SSE4 static double foldDouble(__m128d s)
+    {
+        return _mm_cvtsd_f64(_mm_add_sd(s, _mm_unpackhi_pd(s, s)));
+    }
+
+    template <bool MAX>
+    BULK_TARGET_SSE4 static double extremeDouble(double const* src, size_t count)
+    {
+        __m128d m = _mm_set1_pd(MAX ? -std::numeric_limits<double>::infinity()
+                : std::numeric_limits<double>::infinity());
+        size_t i = 0;
+
+        for (; i + 2 <= count; i += 2)
+            m = MAX ? _mm_max_pd(m, _mm_loadu_pd(src + i)) : _mm_min_pd(m, _mm_loadu_pd(src + i));
+
+        double lanes[3];
+        _mm_storeu_pd(lanes, m);
+        lanes[2] = ScalarBulk::extremeDouble<MAX>(src + i, count - i);
+        return ScalarBulk::extremeDouble<MAX>(lanes, 3);
+    }
+};
+
+// ********
+// * AVX2 *
+// ********
+
+struct Avx2Bulk {
+    template <bool DOT>
+    BULK_TARGET_AVX2 static int64_t sumDotInt(int32_t const* a, size_t count)
+    {
+        return sumDotInt<DOT>(a, a, count);
+    }
+
+    template <bool DOT>
+    BULK_TARGET_AVX2 static int64_t sumDotInt(int32_t const* a, int32_t const* b, size_t count)
+    {
+        __m256i even = _mm256_setzero_si256(), odd = _mm256_setzero_si256();
+        size_t i = 0;
+
+        for (; i + 8 <= count; i += 8)
+        {
+            __m256i x = _mm256_loadu_si256((__m256i const*) (a + i));
+
+            if (DOT)
+            {
+                __m256i y = _mm256_loadu_si256((__m256i const*) (b + i));
+                even = _mm256_add_epi64(even, _mm256_mul_epi32(x, y));
+                odd = _mm256_add_epi64(odd, _mm256_mul_epi32(_mm256_srli_epi64(x, 32), _mm256_srli_epi64(y, 32)));
+            }
+            else
+            {
+                even = _mm256_add_epi64(even, _mm256_cvtepi32_epi64(_mm256_castsi256_si128(x)));
+                odd = _mm256_add_epi64(odd, _mm256_cvtepi32_epi64(_mm256_extracti128_si256(x, 1)));
+            }
+        }
+
+        __m256i total = _mm256_add_epi64(even, odd);
+        __m128i half = _mm_add_epi64(_mm256_castsi256_si128(total), _mm256_extracti128_si256(total, 1));
+        uint64_t sum = (uint64_t) _mm_cvtsi128_si64(half) + (uint64_t) _mm_extract_epi64(half, 1);
+        return (int64_t) sum + ScalarBulk::sumDotInt<DOT>(a + i, b + i, count - i);
+    }
+
+    template <bool MAX>
+    BULK_TARGET_AVX2 static int32_t extremeInt(int32_t const* src, size_t count)
+    {
+        __m256i m = _mm256_set1_epi32(MAX ? INT32_MIN : INT32_MAX);
+        size_t i = 0;
+
+        for (; i + 8 <= count; i += 8)
+        {
+            __m256i x = _mm256_loadu_si256((__m256i const*) (src + i));
+            m = MAX ? _mm256_max_epi32(m, x) : _mm256_min_epi32(m, x);
+        }
+
+        int32_t lanes[9];
+        _mm256_storeu_si256((__m256i*) lanes, m);
+        lanes[8] = ScalarBulk::extremeInt<MAX>(src + i, count - i);
+        return ScalarBulk::extremeInt<MAX>(lanes, 9);
+    }
+
+    template <bool DOT>
+    BULK_TARGET_AVX2 static __m256 termFloat(float const* a, float const* b, size_t i)
+    {
+        return DOT ? _mm256_mul_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i)) : _mm256_loadu_ps(a + i);
+    }
+
+    template <bool DOT>
+    BULK_TARGET_AVX2 static float sumDotFloat(float const* a, size_t count)
+    {
+        return sumDotFloat<DOT>(a, a, count);
+    }
+
+    // Partial sum k covers elements 8k..8k+7 of each block of 32, the same
+    // lanes as the SSE partial sums 2k and 2k + 1.
+    template <bool DOT>
+    BULK_TARGET_AVX2 static float sumDotFloat(float const* a, float const* b, size_t count)
+    {
+        __m256 p0 = _mm256_setzero_ps(), p1 = p0, p2 = p0, p3 = p0;
+        size_t i = 0;
+
+        for (; i + 32 <= count; i += 32)
+        {
+            p0 = _mm256_add_ps(p0, termFloat<DOT>(a, b, i));
+            p1 = _mm256_add_ps(p1, termFloat<DOT>(a, b, i + 8));
+            p2 = _mm256_add_ps(p2, termFloat<DOT>(a, b, i + 16));
+            p3 = _mm256_add_ps(p3, termFloat<DOT>(a, b, i + 24));
+        }
+
+        __m256 g = _mm256_add_ps(_mm256_add_ps(p0, p1), _mm256_add_ps(p2, p3));
+        __m128 s = _mm_add_ps(_mm256_castps256_ps128(g), _mm256_extractf128_ps(g, 1));
+        __m128 t = _mm_add_ps(s, _mm_movehl_ps(s, s));
+        float sum = _mm_cvtss_f32(_mm_add_ss(t, _mm_shuffle_ps(t, t, 1)));
+
+        for (; i < count; ++i)
+            sum += DOT ? a[i] * b[i] : a[i];
+
+        return sum;
+    }
+
+    template <bool MAX>
+    BULK_TARGET_AVX2 static float extremeFloat(float const* src, size_t count)
+    {
+        __m256 m = _mm256_set1_ps(MAX ? -std::numeric_limits<float>::infinity()
+                : std::numeric_limits<float>::infinity());
+        size_t i = 0;
+
+        for (; i + 8 <= count; i += 8)
+            m = MAX ? _mm256_max_ps(m, _mm256_loadu_ps(src + i)) : _mm256_min_ps(m, _mm256_loadu_ps(src + i));
+
+        float lanes[9];
+        _mm256_storeu_ps(lanes, m);
+        lanes[8] = ScalarBulk::extremeFloat<MAX>(src + i, count - i);
+        return ScalarBulk::extremeFloat<MAX>(lanes, 9);
+    }
+
+    template <bool DOT>
+    BULK_TARGET_AVX2 static __m256d termDouble(double const* a, double const* b, size_t i)
+    {
+        return DOT ? _mm256_mul_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)) : _mm256_loadu_pd(a + i);
+    }
+
+    template <bool DOT>
+    BULK_TARGET_AVX2 static double sumDotDouble(double const* a, size_t count)
+    {
+        return sumDotDouble<DOT>(a, a, count);
+    }
+
+    template <bool DOT>
+    BULK_TARGET_AVX2 static double sumDotDouble(double const* a, double const* b, size_t count)
+    {
+        __m256d p0 = _mm256_setzero_pd(), p1 = p0, p2 = p0, p3 = p0;
+        size_t i = 0;
+
+        for (; i + 16 <= count; i += 16)
+        {
+            p0 = _mm256_add_pd(p0, termDouble<DOT>(a, b, i));
+            p1 = _mm256_add_pd(p1, termDouble<DOT>(a, b, i + 4));
+            p2 = _mm256_add_pd(p2, termDouble<DOT>(a, b, i + 8));
+            p3 = _mm256_add_pd(p3, termDouble<DOT>(a, b, i + 12));
+        }
+
+        __m256d g = _mm256_add_pd(_mm256_add_pd(p0, p1), _mm256_add_pd(p2, p3));
+        __m128d s = _mm_add_pd(_mm256_castpd256_pd128(g), _mm256_extractf128_pd(g, 1));
+        double sum = _mm_cvtsd_f64(_mm_add_sd(s, _mm_unpackhi_pd(s, s)));
+
+        for (; i < count; ++i)
+            sum += DOT ? a[i] * b[i] : a[i];
+
+        return sum;
+    }
+
+    template <bool MAX>
+    BULK_TARGET_AVX2 static double extremeDouble(double const* src, size_t count)
+    {
+        __m256d m = _mm256_set1_pd(MAX ? -std::numeric_limits<double>::infinity()
+                : std::numeric_limits<double>::infinity());
+        size_t i = 0;
+
+        for (; i + 4 <= count; i += 4)
+            m = MAX ? _mm256_max_pd(m, _mm256_loadu_pd(src + i)) : _mm256_min_pd(m, _mm256_loadu_pd(src + i));
+
+        double lanes[5];
+        _mm256_storeu_pd(lanes, m);
+        lanes[4] = ScalarBulk::extremeDouble<MAX>(src + i, count - i);
+        return ScalarBulk::extremeDouble<MAX>(lanes, 5);
+    }
+};
+
+#endif
+
+// ************
+// * DISPATCH *
+// ************
+
+// The kernels for level, or null if this CPU or build lacks it.
+inline BulkKernels const* bulkKernelsFor(BulkLevel level)
+{
+    static BulkKernels const scalar = bulkTable<ScalarBulk>("scalar");
+#ifdef VM_HAS_SIMD
+    static BulkKernels const sse4 = bulkTable<Sse4Bulk>("sse4");
+    static BulkKernels const avx2 = bulkTable<Avx2Bulk>("avx2");
+    __builtin_cpu_init();
+
+    if (level == BULK_AVX2)
+        return __builtin_cpu_supports("avx2") ? &avx2 : nullptr;
+
+    if (level == BULK_SSE4)
+        return __builtin_cpu_supports("sse4.1") ? &sse4 : nullptr;
+#else
+    if (level != BULK_SCALAR)
+        return nullptr;
+#endif
+
+    return &scalar;
+}
+
+inline BulkKernels const& bulkKernels()
+{
+    static BulkKernels const* const best = bulkKernelsFor(BULK_AVX2) ? bulkKernelsFor(BULK_AVX2)
+            : bulkKernelsFor(BULK_SSE4) ? bulkKernelsFor(BULK_SSE4) : bulkKernelsFor(BULK_SCALAR);
+    return *best;
+}
+
+// ***********
+// * OPCODES *
+// ***********
+
+// Runs bulk opcode op on its operands, given in push order, and returns
+// the value it pushes, if any. Addresses and counts are integers.
+inline Slot bulkOp(int op, Slot const* args)
+{
+    BulkKernels const& k = bulkKernels();
+    Slot res;
+    res.i = 0;
+
+#define BULK_PTR(n, T) ((T const*) (intptr_t) args[n].i)
+#define BULK_COUNT(n) ((size_t) args[n].i)
+
+    switch (op)
+    {
+        case BLOCK_COPY: memmove((void*) (intptr_t) args[0].i, BULK_PTR(1, void), BULK_COUNT(2)); break;
+        case BLOCK_FILL: memset((void*) (intptr_t) args[0].i, (int) args[1].i, BULK_COUNT(2)); break;
+
+        case ISUM_INT: res.i = k.sumInt(BULK_PTR(0, int32_t), BULK_COUNT(1)); break;
+        case IMIN_INT: res.i = k.minInt(BULK_PTR(0, int32_t), BULK_COUNT(1)); break;
+        case IMAX_INT: res.i = k.maxInt(BULK_PTR(0, int32_t), BULK_COUNT(1)); break;
+        case IDOT_INT: res.i = k.dotInt(BULK_PTR(0, int32_t), BULK_PTR(1, int32_t), BULK_COUNT(2)); break;
+
+        case FSUM_FLOAT: res.f = k.sumFloat(BULK_PTR(0, float), BULK_COUNT(1)); break;
+        case FMIN_FLOAT: res.f = k.minFloat(BULK_PTR(0, float), BULK_COUNT(1)); break;
+        case FMAX_FLOAT: res.f = k.maxFloat(BULK_PTR(0, float), BULK_COUNT(1)); break;
+        case FDOT_FLOAT: res.f = k.dotFloat(BULK_PTR(0, float), BULK_PTR(1, float), BULK_COUNT(2)); break;
+
+        case DSUM_DOUBLE: res.d = k.sumDouble(BULK_PTR(0, double), BULK_COUNT(1)); break;
+        case DMIN_DOUBLE: res.d = k.minDouble(BULK_PTR(0, double), BULK_COUNT(1)); break;
+        case DMAX_DOUBLE: res.d = k.maxDouble(BULK_PTR(0, double), BULK_COUNT(1)); break;
+        case DDOT_DOUBLE: res.d = k.dotDouble(BULK_PTR(0, double), BULK_PTR(1, double), BULK_COUNT(2)); break;
+
+        default: die("Not a bulk opcode!");
+    }
+
+#undef BULK_PTR
+#undef BULK_COUNT
+
+    return res;
+}
+
+#endif
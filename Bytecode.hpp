@@ -0,0 +1,120 @@
+#ifndef _BYTECODE_HPP_
+#define _BYTECODE_HPP_
+
+#include <cstdint>
+#include <cstring>
+
+#include "Opcode.hpp"
+#include "VMTypes.hpp"
+
+// Instruction layout: one opcode byte, then the immediate (if any) at the
+// next address aligned to the immediate's own size. Jump targets are
+// LABEL offsets from the start of the code, and code always starts on an
+// 8-byte boundary, so bytecode can be copied, cached or mapped anywhere
+// without patching. Only ADDR immediates hold host pointers.
+
+inline int operandSize(OperandKind kind)
+{
+    switch (kind)
+    {
+        case OPERAND_NONE:
+            return 0;
+        case OPERAND_I8:
+            return 1;
+        case OPERAND_FLOAT: case OPERAND_I32: case OPERAND_LABEL:
+            return 4;
+        default:
+            return 8;
+    }
+}
+
+template <typename T>
+inline T* alignUp(T* ptr, size_t align)
+{
+    return (T*) (((uintptr_t) ptr + align - 1) & ~(uintptr_t) (align - 1));
+}
+
+inline uint8_t const* operandAddr(uint8_t const* ip, OperandKind kind)
+{
+    int size = operandSize(kind);
+    return size ? alignUp(ip + 1, size) : ip + 1;
+}
+
+inline uint8_t const* nextInstr(uint8_t const* ip)
+{
+    OperandKind kind = OPCODE_OPERANDS[*ip];
+    return operandAddr(ip, kind) + operandSize(kind);
+}
+
+// Immediates are handled in their widest view: VALUE in d, FLOAT in f,
+// ADDR in a and every integer kind, LABEL included, in i.
+
+inline Slot readOperand(uint8_t const* ip)
+{
+    OperandKind kind = OPCODE_OPERANDS[*ip];
+    uint8_t const* src = operandAddr(ip, kind);
+    Slot operand;
+    operand.i = 0;
+
+    switch (kind)
+    {
+        case OPERAND_NONE:
+            break;
+        case OPERAND_I8:
+            operand.i = *(int8_t const*) src;
+            break;
+        case OPERAND_I32:
+            operand.i = *(int32_t const*) src;
+            break;
+        case OPERAND_LABEL:
+            operand.i = *(uint32_t const*) src;
+            break;
+        case OPERAND_FLOAT:
+            operand.f = *(float const*) src;
+            break;
+        default:
+            operand = *(Slot const*) src;
+            break;
+    }
+
+    return operand;
+}
+
+// Writes the opcode at dest followed by its padded immediate and returns
+// the end of the instruction. Padding bytes are zeroed.
+inline uint8_t* writeInstr(uint8_t* dest, Opcode opcode, Slot operand)
+{
+    OperandKind kind = OPCODE_OPERANDS[opcode];
+    uint8_t* imm = (uint8_t*) operandAddr(dest, kind);
+
+    *dest = opcode;
+    memset(dest + 1, 0, imm - dest - 1);
+
+    switch (kind)
+    {
+        case OPERAND_NONE:
+            break;
+        case OPERAND_I8:
+            *(int8_t*) imm = (int8_t) operand.i;
+            break;
+        case OPERAND_I32:
+            *(int32_t*) imm = (int32_t) operand.i;
+            break;
+        case OPERAND_LABEL:
+            *(uint32_t*) imm = (uint32_t) operand.i;
+            break;
+        case OPERAND_FLOAT:
+            *(float*) imm = operand.f;
+            break;
+        default:
+            *(Slot*) imm = operand;
+            break;
+    }
+
+    return imm + operandSize(kind);
+}
+
+// The most padding plus immediate an instruction can take.
+#define MAX_INSTR_BYTES (2 * sizeof (Slot))
+
+#endif
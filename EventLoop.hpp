@@ -0,0 +1,129 @@
+#ifndef _EVENT_LOOP_HPP_
+#define _EVENT_LOOP_HPP_
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <vector>
+
+#include "VMTypes.hpp"
+#include "VM.hpp"
+#include "Budget.hpp"
+
+// Runs many VMs on one thread. A VM whose host call is pending is parked
+// instead of blocking the thread; whoever produces the result, on any
+// thread, hands it back through complete() and the VM is queued to go on
+// after the call. With a slice set, each turn also stops at the first back
+// edge past that many instructions, so one long script cannot starve the
+// others.
+struct EventLoop {
+    enum {
+        MAX_RESULTS = 4,
+    };
+
+    struct Completion {
+        VM* vm;
+        int count;
+        Slot results[MAX_RESULTS];
+    };
+
+    std::deque<VM*> ready;
+    size_t parked;
+    int64_t slice;
+    void (*halted)(VM& vm, void* user);
+    void* user;
+
+    std::mutex lock;
+    std::condition_variable wake;
+    std::vector<Completion> completed;
+
+    // slice 0 runs each VM until it halts or waits.
+    EventLoop(int64_t pSlice = 0): parked(0), slice(pSlice), halted(nullptr), user(nullptr)
+    {
+    }
+
+    // vm must be ready to run, e.g. just reset. Only from the loop thread.
+    void spawn(VM& vm)
+    {
+        ready.push_back(&vm);
+    }
+
+    // Finishes the pending host call of vm with at most MAX_RESULTS
+    // results, pushed in order. Safe from any thread, even before the host
+    // function has returned, once per pending call; the results reach the
+    // operand stack on the loop thread.
+    void complete(VM& vm, Slot const* results, int count)
+    {
+        if (count > MAX_RESULTS)
+            die("Too many host results!");
+
+        Completion done;
+        done.vm = &vm;
+        done.count = count;
+
+        for (int i = 0; i < count; ++i)
+            done.results[i] = results[i];
+
+        std::lock_guard<std::mutex> guard(lock);
+        completed.push_back(done);
+        wake.notify_one();
+    }
+
+    // Returns once every VM has halted.
+    void run()
+    {
+        Budget budget;
+
+        while (!ready.empty() || parked > 0)
+        {
+            takeCompleted();
+
+            VM& vm = *ready.front();
+            ready.pop_front();
+
+            RunStatus status;
+
+            if (slice > 0)
+            {
+                budget.refill(slice);
+                status = vm.run(budget);
+            }
+            else
+                status = vm.run();
+
+            if (status == RUN_HALTED)
+            {
+                if (halted)
+                    halted(vm, user);
+            }
+            else if (status == RUN_WAITING)
+                ++parked;
+            else
+                ready.push_back(&vm);
+        }
+    }
+
+    // Moves completed VMs to the ready queue, sleeping until there is one
+    // when nothing else can run.
+    void takeCompleted()
+    {
+        std::unique_lock<std::mutex> guard(lock);
+
+        if (ready.empty())
+            wake.wait(guard, [this] { return !completed.empty(); });
+
+        for (Completion const& done : completed)
+        {
+            for (int i = 0; i < done.count; ++i)
+                done.vm->opStack.push(done.results[i]);
+
+            ready.push_back(done.vm);
+        }
+
+        parked -= completed.size();
+        completed.clear();
+    }
+};
+
+#endif
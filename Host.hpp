@@ -0,0 +1,58 @@
+#ifndef _HOST_HPP_
+#define _HOST_HPP_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+struct VM;
+
+enum HostStatus {
+    HOST_DONE, HOST_PENDING,
+};
+
+// Native function behind CALL_HOST. It pops its arguments from and pushes
+// its results to vm.opStack. One that cannot answer yet returns
+// HOST_PENDING: the run then stops with RUN_WAITING, and once the results
+// have been pushed, running the VM again continues after the call.
+typedef HostStatus (*HostFunction)(VM& vm, void* user);
+
+// Host functions callable from bytecode, by index.
+struct HostTable {
+    struct Entry {
+        std::string name;
+        HostFunction fn;
+        void* user;
+    };
+
+    std::vector<Entry> entries;
+
+    // Returns the index to use as the CALL_HOST operand.
+    int32_t add(std::string const& name, HostFunction fn, void* user = nullptr)
+    {
+        entries.push_back(Entry{name, fn, user});
+        return (int32_t) entries.size() - 1;
+    }
+
+    // -1 if there is no function of that name.
+    int32_t find(std::string const& name) const
+    {
+        for (size_t i = 0; i < entries.size(); ++i)
+            if (entries[i].name == name)
+                return (int32_t) i;
+
+        return -1;
+    }
+
+    size_t size() const
+    {
+        return entries.size();
+    }
+
+    Entry const& operator[](size_t index) const
+    {
+        return entries[index];
+    }
+};
+
+#endif
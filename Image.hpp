@@ -0,0 +1,379 @@
+#ifndef _IMAGE_HPP_
+#define _IMAGE_HPP_
+
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "Opcode.hpp"
+#include "VMTypes.hpp"
+#include "Bytecode.hpp"
+#include "Memory.hpp"
+#include "Program.hpp"
+
+// On-disk bytecode image, in native byte order:
+//
+//   ImageHeader
+//   code      codeSize bytes, 8-aligned, followed by at least one HALT
+//   pool      constant data, each constant 8-aligned
+//   symbols   ImageSymbol[symbolCount]
+//   relocs    ImageReloc[relocCount]
+//   names     NUL-terminated symbol names
+//
+// Code is position independent except for ADDR immediates. Each of those
+// gets a relocation against a symbol that is either a constant in the
+// pool or a host object looked up by name when the image is loaded.
+
+#define IMAGE_MAGIC "ICBC"
+#define IMAGE_VERSION 1
+
+struct ImageHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t opcodeCount;
+    uint32_t codeOffs, codeSize;
+    uint32_t poolOffs, poolSize;
+    uint32_t symbolOffs, symbolCount;
+    uint32_t relocOffs, relocCount;
+    uint32_t namesOffs, namesSize;
+};
+
+struct ImageSymbol {
+    enum Kind {
+        HOST, CONSTANT,
+    };
+
+    uint32_t kind;
+    uint32_t nameOffs;
+    uint32_t poolOffs;
+    uint32_t size;
+};
+
+struct ImageReloc {
+    uint32_t codeOffs;
+    uint32_t symbol;
+    int64_t addend;
+};
+
+// Named memory the bytecode refers to by address. When writing an image
+// every ADDR immediate must fall inside one of these; constants are
+// copied into the image and host symbols are bound again at load time.
+struct SymbolTable {
+    struct Symbol {
+        std::string name;
+        uint8_t* addr;
+        size_t size;
+        bool constant;
+    };
+
+    std::vector<Symbol> symbols;
+
+    void addHost(std::string const& name, void* addr, size_t size = 0)
+    {
+        symbols.push_back(Symbol{name, (uint8_t*) addr, size, false});
+    }
+
+    void addConstant(std::string const& name, void const* addr, size_t size)
+    {
+        symbols.push_back(Symbol{name, (uint8_t*) addr, size, true});
+    }
+
+    Symbol const* find(std::string const& name) const
+    {
+        for (Symbol const& sym : symbols)
+            if (sym.name == name)
+                return &sym;
+
+        return nullptr;
+    }
+
+    // Finds the symbol an address points into. One past the end counts,
+    // so end pointers relocate too.
+    int resolve(uint8_t const* addr) const
+    {
+        for (size_t i = 0; i < symbols.size(); ++i)
+            if (addr >= symbols[i].addr && addr <= symbols[i].addr + symbols[i].size)
+                return (int) i;
+
+        return -1;
+    }
+};
+
+// *********
+// * WRITE *
+// *********
+
+inline void appendBytes(std::vector<uint8_t>& out, void const* bytes, size_t count)
+{
+    out.insert(out.end(), (uint8_t const*) bytes, (uint8_t const*) bytes + count);
+}
+
+inline void padTo8(std::vector<uint8_t>& out)
+{
+    out.resize((out.size() + 7) & ~size_t(7), 0);
+}
+
+// Serializes prog. Returns false with a message in error if an ADDR
+// immediate matches no symbol or the file cannot be written.
+inline bool writeImage(Program const& prog, SymbolTable const& symbols, char const* path, std::string& error)
+{
+    std::vector<ImageReloc> relocs;
+    std::vector<bool> used(symbols.symbols.size(), false);
+
+    for (uint8_t const* ip = prog.data; ip < prog.cursor; ip = nextInstr(ip))
+    {
+        if (OPCODE_OPERANDS[*ip] != OPERAND_ADDR)
+            continue;
+
+        uint8_t const* imm = operandAddr(ip, OPERAND_ADDR);
+        uint8_t const* addr = (uint8_t const*) *(Addr const*) imm;
+
+        if (addr == nullptr)
+            continue;
+
+        int sym = symbols.resolve(addr);
+
+        if (sym < 0)
+        {
+            error = "Unrelocatable address at offset " + std::to_string(ip - prog.data);
+            return false;
+        }
+
+        used[sym] = true;
+        relocs.push_back(ImageReloc{(uint32_t) (imm - prog.data), (uint32_t) sym, addr - symbols.symbols[sym].addr});
+    }
+
+    std::vector<uint8_t> out(sizeof (ImageHeader), 0);
+    ImageHeader header;
+    memcpy(header.magic, IMAGE_MAGIC, 4);
+    header.version = IMAGE_VERSION;
+    header.opcodeCount = OPCODE_COUNT;
+
+    padTo8(out);
+    header.codeOffs = out.size();
+    header.codeSize = prog.size();
+    appendBytes(out, prog.data, prog.size());
+    out.push_back(HALT);
+    padTo8(out);
+
+    std::vector<ImageSymbol> table;
+    std::string names;
+    header.poolOffs = out.size();
+
+    for (size_t i = 0; i < symbols.symbols.size(); ++i)
+    {
+        SymbolTable::Symbol const& sym = symbols.symbols[i];
+        ImageSymbol entry = {sym.constant ? ImageSymbol::CONSTANT : ImageSymbol::HOST, (uint32_t) names.size(), 0,
+            (uint32_t) sym.size};
+
+        if (sym.constant)
+        {
+            entry.poolOffs = out.size() - header.poolOffs;
+            appendBytes(out, sym.addr, sym.size);
+            padTo8(out);
+        }
+
+        names.append(sym.name.c_str(), sym.name.size() + 1);
+        table.push_back(entry);
+    }
+
+    header.poolSize = out.size() - header.poolOffs;
+
+    header.symbolOffs = out.size();
+    header.symbolCount = table.size();
+    appendBytes(out, table.data(), table.size() * sizeof (ImageSymbol));
+
+    header.relocOffs = out.size();
+    header.relocCount = relocs.size();
+    appendBytes(out, relocs.data(), relocs.size() * sizeof (ImageReloc));
+
+    header.namesOffs = out.size();
+    header.namesSize = names.size();
+    appendBytes(out, names.data(), names.size());
+
+    memcpy(out.data(), &header, sizeof header);
+
+    FILE* file = fopen(path, "wb");
+
+    if (!file)
+    {
+        error = std::string("Cannot create ") + path;
+        return false;
+    }
+
+    bool ok = fwrite(out.data(), 1, out.size(), file) == out.size();
+    ok = fclose(file) == 0 && ok;
+
+    if (!ok)
+        error = std::string("Cannot write ") + path;
+
+    return ok;
+}
+
+// ********
+// * LOAD *
+// ********
+
+// A bytecode image mapped straight from its file. Pages are shared with
+// the page cache until a relocation writes to them; once loaded the code
+// and pool are read-only. code() can be handed to a VM directly.
+struct Image {
+    uint8_t* mapping;
+    size_t mappingSize;
+    ImageHeader const* header;
+    std::string error;
+
+    Image(): mapping(nullptr), mappingSize(0), header(nullptr)
+    {
+    }
+
+    ~Image()
+    {
+        unload();
+    }
+
+    uint8_t* code() const
+    {
+        return mapping + header->codeOffs;
+    }
+
+    uint8_t* pool() const
+    {
+        return mapping + header->poolOffs;
+    }
+
+    // Maps path and binds host symbols against hostSymbols. Returns false
+    // with a message in error if the file is missing, malformed or needs
+    // a host symbol that is not provided.
+    bool load(char const* path, SymbolTable const& hostSymbols)
+    {
+        unload();
+
+        int fd = open(path, O_RDONLY);
+
+        if (fd < 0)
+            return fail(std::string("Cannot open ") + path);
+
+        struct stat st;
+
+        if (fstat(fd, &st) != 0 || st.st_size < (off_t) sizeof (ImageHeader))
+        {
+            close(fd);
+            return fail(std::string("Not an image: ") + path);
+        }
+
+        mappingSize = st.st_size;
+        void* mem = mmap(nullptr, mappingSize, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        close(fd);
+
+        if (mem == MAP_FAILED)
+            return fail(std::string("Cannot map ") + path);
+
+        mapping = (uint8_t*) mem;
+        header = (ImageHeader const*) mapping;
+
+        if (!validate() || !relocate(hostSymbols))
+            return false;
+
+        mprotect(mapping, mappingSize, PROT_READ);
+        return true;
+    }
+
+    void unload()
+    {
+        if (mapping)
+            munmap(mapping, mappingSize);
+
+        mapping = nullptr;
+        header = nullptr;
+    }
+
+private:
+    bool fail(std::string const& msg)
+    {
+        error = msg;
+        unload();
+        return false;
+    }
+
+    bool inFile(uint64_t offs, uint64_t bytes) const
+    {
+        return offs <= mappingSize && bytes <= mappingSize - offs;
+    }
+
+    bool validate()
+    {
+        if (memcmp(header->magic, IMAGE_MAGIC, 4) != 0)
+            return fail("Bad image magic");
+
+        if (header->version != IMAGE_VERSION || header->opcodeCount != OPCODE_COUNT)
+            return fail("Image built for another VM version");
+
+        if (header->codeOffs % 8 || header->poolOffs % 8 || !inFile(header->codeOffs, uint64_t(header->codeSize) + 1)
+                || code()[header->codeSize] != HALT || !inFile(header->poolOffs, header->poolSize)
+                || !inFile(header->symbolOffs, uint64_t(header->symbolCount) * sizeof (ImageSymbol))
+                || !inFile(header->relocOffs, uint64_t(header->relocCount) * sizeof (ImageReloc))
+                || !inFile(header->namesOffs, header->namesSize)
+                || (header->namesSize && mapping[header->namesOffs + header->namesSize - 1] != 0))
+            return fail("Truncated or corrupt image");
+
+        return true;
+    }
+
+    bool relocate(SymbolTable const& hostSymbols)
+    {
+        ImageSymbol const* symbols = (ImageSymbol const*) (mapping + header->symbolOffs);
+        ImageReloc const* relocs = (ImageReloc const*) (mapping + header->relocOffs);
+        char const* names = (char const*) (mapping + header->namesOffs);
+        std::vector<uint8_t*> bound(header->symbolCount);
+
+        for (uint32_t i = 0; i < header->symbolCount; ++i)
+        {
+            ImageSymbol const& sym = symbols[i];
+
+            if (sym.nameOffs >= header->namesSize)
+                return fail("Corrupt symbol table");
+
+            if (sym.kind == ImageSymbol::CONSTANT)
+            {
+                if (uint64_t(sym.poolOffs) + sym.size > header->poolSize)
+                    return fail("Corrupt symbol table");
+
+                bound[i] = pool() + sym.poolOffs;
+                continue;
+            }
+
+            SymbolTable::Symbol const* host = hostSymbols.find(names + sym.nameOffs);
+
+            if (!host)
+                return fail(std::string("Unresolved host symbol ") + (names + sym.nameOffs));
+
+            bound[i] = host->addr;
+        }
+
+        for (uint32_t i = 0; i < header->relocCount; ++i)
+        {
+            ImageReloc const& reloc = relocs[i];
+
+            if (reloc.symbol >= header->symbolCount || reloc.codeOffs % sizeof (Addr)
+                    || uint64_t(reloc.codeOffs) + sizeof (Addr) > header->codeSize)
+                return fail("Corrupt relocation");
+
+            *(Addr*) (code() + reloc.codeOffs) = bound[reloc.symbol] + reloc.addend;
+        }
+
+        return true;
+    }
+
+    Image(Image const&);
+    Image& operator=(Image const&);
+};
+
+#endif
@@ -0,0 +1,1127 @@
+#ifndef _JIT_HPP_
+#define _JIT_HPP_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <initializer_list>
+#include <mutex>
+#include <vector>
+
+#include <sys/mman.h>
+
+#include "Util.hpp"
+#include "Opcode.hpp"
+#include "VMTypes.hpp"
+#include "Bytecode.hpp"
+#include "Memory.hpp"
+#include "VM.hpp"
+
+// Baseline template JIT. Each bytecode instruction is expanded into a
+// fixed x86-64 sequence that does exactly what its handler in VM.hpp does
+// on a MemoryStack, using the same SSE conversions the compiler emits for
+// the handlers' casts, so results match the interpreter bit for bit.
+//
+// Generated code keeps the operand stack top in rbx, the general purpose
+// stack pointer in r12, the frame pointer in r13, the JitFrame in r14 and
+// the call stack top in r15. Jumps and calls to constant labels become
+// direct native jumps; computed jumps and returns go through a table
+// indexed by code offset. Anything the JIT cannot handle, such as a computed jump
+// into the middle of an instruction, leaves native code with the state
+// written back and the interpreter finishes the run.
+
+#if defined(__x86_64__) && !defined(VM_NO_JIT)
+#define VM_HAS_JIT
+#endif
+
+struct JitFrame {
+    Slot* top;
+    uint8_t* sp;
+    uint8_t* spLimit;
+    uint8_t* fp;
+    CallFrame* calls;
+    uint8_t* leafRet;
+};
+
+// Runs native code from entry until it halts or bails out. Returns the
+// bytecode ip to continue at, or null after HALT.
+typedef uint8_t* (*JitFunction)(JitFrame* frame, void const* entry);
+
+// *************
+// * ASSEMBLER *
+// *************
+
+struct X64Emitter {
+    enum Reg {
+        RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15,
+    };
+
+    enum Xmm {
+        XMM0, XMM1,
+    };
+
+    enum Cond {
+        CC_B = 0x2, CC_AE = 0x3, CC_E = 0x4, CC_NE = 0x5, CC_BE = 0x6, CC_A = 0x7, CC_S = 0x8, CC_P = 0xA,
+        CC_L = 0xC, CC_GE = 0xD, CC_LE = 0xE, CC_G = 0xF,
+    };
+
+    std::vector<uint8_t> buf;
+
+    size_t pos() const
+    {
+        return buf.size();
+    }
+
+    void byte(uint8_t b)
+    {
+        buf.push_back(b);
+    }
+
+    void imm32(int32_t v)
+    {
+        buf.insert(buf.end(), (uint8_t*) &v, (uint8_t*) &v + 4);
+    }
+
+    void imm64(uint64_t v)
+    {
+        buf.insert(buf.end(), (uint8_t*) &v, (uint8_t*) &v + 8);
+    }
+
+    void rex(bool w, int reg, int rm)
+    {
+        uint8_t r = 0x40 | (w << 3) | ((reg & 8) >> 1) | ((rm & 8) >> 3);
+
+        if (r != 0x40)
+            byte(r);
+    }
+
+    // [base + disp]; rsp/r12 need a SIB byte and rbp/r13 a displacement.
+    void modrmMem(int reg, int base, int32_t disp)
+    {
+        int mod = disp == 0 && (base & 7) != RBP ? 0 : disp == (int8_t) disp ? 1 : 2;
+        byte((mod << 6) | ((reg & 7) << 3) | (base & 7));
+
+        if ((base & 7) == RSP)
+            byte(0x24);
+
+        if (mod == 1)
+            byte((uint8_t) disp);
+        else if (mod == 2)
+            imm32(disp);
+    }
+
+    void mem(uint8_t prefix, bool w, std::initializer_list<uint8_t> opcode, int reg, int base, int32_t disp)
+    {
+        if (prefix)
+            byte(prefix);
+
+        rex(w, reg, base);
+
+        for (uint8_t b : opcode)
+            byte(b);
+
+        modrmMem(reg, base, disp);
+    }
+
+    void rr(uint8_t prefix, bool w, std::initializer_list<uint8_t> opcode, int reg, int rm)
+    {
+        if (prefix)
+            byte(prefix);
+
+        rex(w, reg, rm);
+
+        for (uint8_t b : opcode)
+            byte(b);
+
+        byte(0xC0 | ((reg & 7) << 3) | (rm & 7));
+    }
+
+    // Integer moves and ALU.
+
+    void load(bool w, int reg, int base, int32_t disp)
+    {
+        mem(0, w, {0x8B}, reg, base, disp);
+    }
+
+    void store(bool w, int base, int32_t disp, int reg)
+    {
+        mem(0, w, {0x89}, reg, base, disp);
+    }
+
+    // reg = [base + index * scale], scale 1, 2, 4 or 8; index is not rsp.
+    void loadIndexed(bool w, int reg, int base, int index, int scale)
+    {
+        int ss = scale == 8 ? 3 : scale == 4 ? 2 : scale == 2 ? 1 : 0;
+        // rbp/r13 as a base need a displacement, here a zero disp8.
+        int mod = (base & 7) == RBP ? 1 : 0;
+
+        byte(0x40 | (w << 3) | ((reg & 8) >> 1) | ((index & 8) >> 2) | ((base & 8) >> 3));
+        byte(0x8B);
+        byte((mod << 6) | ((reg & 7) << 3) | RSP);
+        byte((ss << 6) | ((index & 7) << 3) | (base & 7));
+
+        if (mod == 1)
+            byte(0);
+    }
+
+    void movImm(int reg, uint64_t v)
+    {
+        rex(true, 0, reg);
+        byte(0xB8 + (reg & 7));
+        imm64(v);
+    }
+
+    void lea(int reg, int base, int32_t disp)
+    {
+        mem(0, true, {0x8D}, reg, base, disp);
+    }
+
+    // /ext r/m, imm32 form of the 0x81 group: 0 add, 5 sub, 7 cmp.
+    void aluImm(int ext, int reg, int32_t v)
+    {
+        rex(true, 0, reg);
+        byte(0x81);
+        byte(0xC0 | (ext << 3) | (reg & 7));
+        imm32(v);
+    }
+
+    void test(int a, int b)
+    {
+        rr(0, true, {0x85}, b, a);
+    }
+
+    void push(int reg)
+    {
+        if (reg & 8)
+            byte(0x41);
+
+        byte(0x50 + (reg & 7));
+    }
+
+    void pop(int reg)
+    {
+        if (reg & 8)
+            byte(0x41);
+
+        byte(0x58 + (reg & 7));
+    }
+
+    // SSE.
+
+    void sse(uint8_t prefix, bool w, uint8_t op, int reg, int base, int32_t disp)
+    {
+        mem(prefix, w, {0x0F, op}, reg, base, disp);
+    }
+
+    void sseRR(uint8_t prefix, bool w, uint8_t op, int reg, int rm)
+    {
+        rr(prefix, w, {0x0F, op}, reg, rm);
+    }
+
+    // Control flow. Jumps return the position of their rel32 for patch().
+
+    size_t jcc(Cond cc)
+    {
+        byte(0x0F);
+        byte(0x80 + cc);
+        imm32(0);
+        return pos() - 4;
+    }
+
+    size_t jmp()
+    {
+        byte(0xE9);
+        imm32(0);
+        return pos() - 4;
+    }
+
+    void jmpReg(int reg)
+    {
+        rex(false, 0, reg);
+        byte(0xFF);
+        byte(0xE0 | (reg & 7));
+    }
+
+    void callReg(int reg)
+    {
+        rex(false, 0, reg);
+        byte(0xFF);
+        byte(0xD0 | (reg & 7));
+    }
+
+    void patch(size_t at, size_t target)
+    {
+        int32_t rel = (int32_t) (target - (at + 4));
+        memcpy(&buf[at], &rel, 4);
+    }
+
+    void bind(size_t at)
+    {
+        patch(at, pos());
+    }
+};
+
+// ************
+// * COMPILER *
+// ************
+
+struct JitCompiler: public X64Emitter {
+    uint8_t const* code;
+    size_t codeSize;
+    std::vector<int64_t> nativeOffs;
+    std::vector<std::pair<size_t, uint32_t> > labelFixups;
+    std::vector<size_t> exitFixups;
+    void* const* entryTable;
+
+    JitCompiler(uint8_t const* pCode, size_t pCodeSize, void* const* pEntryTable): code(pCode),
+            codeSize(pCodeSize), nativeOffs(pCodeSize + 1, -1), entryTable(pEntryTable)
+    {
+    }
+
+    // Slot i below the operand stack top; 1 is the top itself.
+    static int32_t slot(int i)
+    {
+        return -8 * i;
+    }
+
+    void drop(int n)
+    {
+        aluImm(5, RBX, 8 * n);
+    }
+
+    void grow()
+    {
+        aluImm(0, RBX, 8);
+    }
+
+    void pushRax()
+    {
+        store(true, RBX, 0, RAX);
+        grow();
+    }
+
+    void pushXmm0()
+    {
+        sse(0xF2, false, 0x11, XMM0, RBX, 0);
+        grow();
+    }
+
+    void pushBits(uint64_t bits)
+    {
+        movImm(RAX, bits);
+        pushRax();
+    }
+
+    void pushDouble(double d)
+    {
+        uint64_t bits;
+        memcpy(&bits, &d, sizeof bits);
+        pushBits(bits);
+    }
+
+    void loadDouble(int xmm, double d)
+    {
+        uint64_t bits;
+        memcpy(&bits, &d, sizeof bits);
+        movImm(RAX, bits);
+        sseRR(0x66, true, 0x6E, xmm, RAX);
+    }
+
+    // rax = (uint64_t) double at [base + disp]. Clobbers xmm0 and xmm1.
+    void doubleToU64(int base, int32_t disp)
+    {
+        sse(0xF2, false, 0x10, XMM0, base, disp);
+        loadDouble(XMM1, 9223372036854775808.0);
+        sseRR(0x66, false, 0x2F, XMM0, XMM1);
+        size_t big = jcc(CC_AE);
+        sseRR(0xF2, true, 0x2C, RAX, XMM0);
+        size_t done = jmp();
+        bind(big);
+        sseRR(0xF2, false, 0x5C, XMM0, XMM1);
+        sseRR(0xF2, true, 0x2C, RAX, XMM0);
+        rr(0, true, {0x0F, 0xBA}, 7, RAX);
+        byte(63);
+        bind(done);
+    }
+
+    // xmm0 = (double) (uint64_t) rax. Clobbers rcx.
+    void u64ToDouble()
+    {
+        test(RAX, RAX);
+        size_t big = jcc(CC_S);
+        sseRR(0xF2, true, 0x2A, XMM0, RAX);
+        size_t done = jmp();
+        bind(big);
+        rr(0, true, {0x8B}, RCX, RAX);
+        rr(0, true, {0xD1}, 5, RCX);
+        rr(0, false, {0x83}, 4, RAX);
+        byte(1);
+        rr(0, true, {0x0B}, RCX, RAX);
+        sseRR(0xF2, true, 0x2A, XMM0, RCX);
+        sseRR(0xF2, false, 0x58, XMM0, XMM0);
+        bind(done);
+    }
+
+    // Compares xmm0 against zero the way C++ does for the branch ops and
+    // returns the jumps taken when the condition holds. cmp is 0..5 for
+    // ==, !=, >, <, >=, <= as in the JE..JLET order.
+    std::vector<size_t> branchDouble(int cmp)
+    {
+        std::vector<size_t> taken;
+        sseRR(0x66, false, 0x57, XMM1, XMM1);
+
+        switch (cmp)
+        {
+            case 0:
+            {
+                sseRR(0x66, false, 0x2E, XMM0, XMM1);
+                size_t unordered = jcc(CC_P);
+                taken.push_back(jcc(CC_E));
+                bind(unordered);
+                break;
+            }
+            case 1:
+                sseRR(0x66, false, 0x2E, XMM0, XMM1);
+                taken.push_back(jcc(CC_P));
+                taken.push_back(jcc(CC_NE));
+                break;
+            case 2:
+                sseRR(0x66, false, 0x2E, XMM0, XMM1);
+                taken.push_back(jcc(CC_A));
+                break;
+            case 3:
+                sseRR(0x66, false, 0x2E, XMM1, XMM0);
+                taken.push_back(jcc(CC_A));
+                break;
+            case 4:
+                sseRR(0x66, false, 0x2E, XMM0, XMM1);
+                taken.push_back(jcc(CC_AE));
+                break;
+            default:
+                sseRR(0x66, false, 0x2E, XMM1, XMM0);
+                taken.push_back(jcc(CC_AE));
+                break;
+        }
+
+        return taken;
+    }
+
+    std::vector<size_t> branchInt(int cmp)
+    {
+        static Cond const conds[] = {CC_E, CC_NE, CC_G, CC_L, CC_GE, CC_LE};
+        test(RAX, RAX);
+        return std::vector<size_t>(1, jcc(conds[cmp]));
+    }
+
+    void toLabel(std::vector<size_t> const& jumps, uint32_t offs)
+    {
+        for (size_t at : jumps)
+            labelFixups.push_back(std::make_pair(at, offs));
+    }
+
+    // Leaves native code with rax as the bytecode ip.
+    void exitRax()
+    {
+        exitFixups.push_back(jmp());
+    }
+
+    void exitAt(uint8_t const* ip)
+    {
+        movImm(RAX, (uintptr_t) ip);
+        exitRax();
+    }
+
+    // Leaves native code after a push that moved sp past the committed gp
+    // stack, so Jit::run can grow it and come back at next.
+    void checkSpLimit(uint8_t const* next)
+    {
+        mem(0, true, {0x3B}, R12, R14, offsetof(JitFrame, spLimit));
+        size_t ok = jcc(CC_BE);
+        exitAt(next);
+        bind(ok);
+    }
+
+    // Jumps to the bytecode address in rax, or exits if it is not the
+    // start of a compiled instruction.
+    void dynamicJump()
+    {
+        movImm(RDX, (uintptr_t) code);
+        rr(0, true, {0x8B}, RCX, RAX);
+        rr(0, true, {0x2B}, RCX, RDX);
+        aluImm(7, RCX, (int32_t) codeSize + 1);
+        exitFixups.push_back(jcc(CC_AE));
+        movImm(RDX, (uintptr_t) entryTable);
+        loadIndexed(true, RDX, RDX, RCX, 8);
+        test(RDX, RDX);
+        exitFixups.push_back(jcc(CC_E));
+        jmpReg(RDX);
+    }
+
+    // Generic loads: the double on top is an address, replaced by the
+    // loaded value widened to double.
+    void loadTyped(Opcode op, int base, int32_t disp)
+    {
+        switch (op)
+        {
+            case LOAD_UCHAR:
+                mem(0, false, {0x0F, 0xB6}, RAX, base, disp);
+                sseRR(0xF2, false, 0x2A, XMM0, RAX);
+                break;
+            case LOAD_USHORT:
+                mem(0, false, {0x0F, 0xB7}, RAX, base, disp);
+                sseRR(0xF2, false, 0x2A, XMM0, RAX);
+                break;
+            case LOAD_CHAR:
+                mem(0, false, {0x0F, 0xBE}, RAX, base, disp);
+                sseRR(0xF2, false, 0x2A, XMM0, RAX);
+                break;
+            case LOAD_SHORT:
+                mem(0, false, {0x0F, 0xBF}, RAX, base, disp);
+                sseRR(0xF2, false, 0x2A, XMM0, RAX);
+                break;
+            case LOAD_UINT:
+                load(false, RAX, base, disp);
+                sseRR(0xF2, true, 0x2A, XMM0, RAX);
+                break;
+            case LOAD_INT:
+                sse(0xF2, false, 0x2A, XMM0, base, disp);
+                break;
+            case LOAD_LONG:
+                sse(0xF2, true, 0x2A, XMM0, base, disp);
+                break;
+            case LOAD_ULONG: case LOAD_ADDR:
+                load(true, RAX, base, disp);
+                u64ToDouble();
+                break;
+            case LOAD_FLOAT:
+                sse(0xF3, false, 0x5A, XMM0, base, disp);
+                break;
+            default:
+                sse(0xF2, false, 0x10, XMM0, base, disp);
+                break;
+        }
+    }
+
+    // Generic stores: converts the double at [rbx + src] and writes it to
+    // [base + disp]. base must not be rax or rcx.
+    void storeTyped(Opcode op, int32_t src, int base, int32_t disp)
+    {
+        switch (op)
+        {
+            case STORE_UCHAR: case STORE_CHAR:
+                sse(0xF2, false, 0x2C, RAX, RBX, src);
+                mem(0, false, {0x88}, RAX, base, disp);
+                break;
+            case STORE_USHORT: case STORE_SHORT:
+                sse(0xF2, false, 0x2C, RAX, RBX, src);
+                mem(0x66, false, {0x89}, RAX, base, disp);
+                break;
+            case STORE_INT:
+                sse(0xF2, false, 0x2C, RAX, RBX, src);
+                store(false, base, disp, RAX);
+                break;
+            case STORE_UINT:
+                sse(0xF2, true, 0x2C, RAX, RBX, src);
+                store(false, base, disp, RAX);
+                break;
+            case STORE_LONG:
+                sse(0xF2, true, 0x2C, RAX, RBX, src);
+                store(true, base, disp, RAX);
+                break;
+            case STORE_ULONG: case STORE_ADDR:
+                doubleToU64(RBX, src);
+                store(true, base, disp, RAX);
+                break;
+            case STORE_FLOAT:
+                sse(0xF2, false, 0x5A, XMM0, RBX, src);
+                sse(0xF3, false, 0x11, XMM0, base, disp);
+                break;
+            default:
+                sse(0xF2, false, 0x10, XMM0, RBX, src);
+                sse(0xF2, false, 0x11, XMM0, base, disp);
+                break;
+        }
+    }
+
+    // (int) a OP (int) b on the two top doubles, result as double.
+    void intBinary(Opcode op)
+    {
+        sse(0xF2, false, 0x2C, RCX, RBX, slot(1));
+        sse(0xF2, false, 0x2C, RAX, RBX, slot(2));
+
+        switch (op)
+        {
+            case BAND: rr(0, false, {0x23}, RAX, RCX); break;
+            case BOR: rr(0, false, {0x0B}, RAX, RCX); break;
+            case BXOR: rr(0, false, {0x33}, RAX, RCX); break;
+            case BSL: rr(0, false, {0xD3}, 4, RAX); break;
+            case BSR: rr(0, false, {0xD3}, 7, RAX); break;
+            default:
+                byte(0x99);
+                rr(0, false, {0xF7}, 7, RCX);
+                rr(0, false, {0x8B}, RAX, RDX);
+                break;
+        }
+
+        sseRR(0xF2, false, 0x2A, XMM0, RAX);
+        sse(0xF2, false, 0x11, XMM0, RBX, slot(2));
+        drop(1);
+    }
+
+    // Top two int64 slots: a OP b into a.
+    void int64Binary(Opcode op)
+    {
+        load(true, RAX, RBX, slot(2));
+
+        switch (op)
+        {
+            case IADD: mem(0, true, {0x03}, RAX, RBX, slot(1)); break;
+            case ISUB: mem(0, true, {0x2B}, RAX, RBX, slot(1)); break;
+            case IMUL: mem(0, true, {0x0F, 0xAF}, RAX, RBX, slot(1)); break;
+            case IAND: mem(0, true, {0x23}, RAX, RBX, slot(1)); break;
+            case IOR: mem(0, true, {0x0B}, RAX, RBX, slot(1)); break;
+            case IXOR: mem(0, true, {0x33}, RAX, RBX, slot(1)); break;
+            case ISHL: case ISHR:
+                load(true, RCX, RBX, slot(1));
+                rr(0, true, {0xD3}, op == ISHL ? 4 : 7, RAX);
+                break;
+            default:
+                byte(0x48);
+                byte(0x99);
+                mem(0, true, {0xF7}, 7, RBX, slot(1));
+
+                if (op == IMOD)
+                    rr(0, true, {0x8B}, RAX, RDX);
+                break;
+        }
+
+        store(true, RBX, slot(2), RAX);
+        drop(1);
+    }
+
+    // Top two doubles (prefix F2) or floats (F3): a OP b into a.
+    void sseBinary(uint8_t prefix, uint8_t op)
+    {
+        sse(prefix, false, 0x10, XMM0, RBX, slot(2));
+        sse(prefix, false, op, XMM0, RBX, slot(1));
+        sse(prefix, false, 0x11, XMM0, RBX, slot(2));
+        drop(1);
+    }
+
+    void constBinary(uint8_t op, double lit)
+    {
+        sse(0xF2, false, 0x10, XMM0, RBX, slot(1));
+        loadDouble(XMM1, lit);
+        sseRR(0xF2, false, op, XMM0, XMM1);
+        sse(0xF2, false, 0x11, XMM0, RBX, slot(1));
+    }
+
+    void compile(uint8_t const* ip)
+    {
+        Opcode op = Opcode(*ip);
+        Slot imm = readOperand(ip);
+        switch (op)
+        {
+            case HALT:
+                movImm(RAX, 0);
+                exitRax();
+                break;
+
+            case GOTO:
+                labelFixups.push_back(std::make_pair(jmp(), (uint32_t) imm.i));
+                break;
+
+            // Return addresses stay bytecode addresses, so the interpreter
+            // can take over in the middle of a call; returns go through the
+            // entry table.
+            case CALL:
+                movImm(RAX, (uintptr_t) nextInstr(ip));
+                store(true, R15, offsetof(CallFrame, ret), RAX);
+                store(true, R15, offsetof(CallFrame, fp), R13);
+                aluImm(0, R15, sizeof (CallFrame));
+                rr(0, true, {0x8B}, R13, R12);
+                labelFixups.push_back(std::make_pair(jmp(), (uint32_t) imm.i));
+                break;
+
+            case RET:
+                rr(0, true, {0x8B}, R12, R13);
+                aluImm(5, R15, sizeof (CallFrame));
+                load(true, RAX, R15, offsetof(CallFrame, ret));
+                load(true, R13, R15, offsetof(CallFrame, fp));
+                dynamicJump();
+                break;
+
+            case CALL_LEAF:
+                movImm(RAX, (uintptr_t) nextInstr(ip));
+                store(true, R14, offsetof(JitFrame, leafRet), RAX);
+                labelFixups.push_back(std::make_pair(jmp(), (uint32_t) imm.i));
+                break;
+
+            case RET_LEAF:
+                load(true, RAX, R14, offsetof(JitFrame, leafRet));
+                dynamicJump();
+                break;
+
+            case JMP:
+                doubleToU64(RBX, slot(1));
+                drop(1);
+                dynamicJump();
+                break;
+
+            case JE: case JNE: case JGT: case JLT: case JGET: case JLET:
+            {
+                sse(0xF2, false, 0x10, XMM0, RBX, slot(1));
+                std::vector<size_t> taken = branchDouble(op - JE);
+                drop(2);
+                size_t skip = jmp();
+
+                for (size_t at : taken)
+                    bind(at);
+
+                doubleToU64(RBX, slot(2));
+                drop(2);
+                dynamicJump();
+                bind(skip);
+                break;
+            }
+
+            case BAND: case BOR: case BXOR: case BSL: case BSR: case MOD:
+                intBinary(op);
+                break;
+
+            case BSL1: case BSR1:
+                sse(0xF2, false, 0x2C, RAX, RBX, slot(1));
+                rr(0, false, {0xD1}, op == BSL1 ? 4 : 7, RAX);
+                sseRR(0xF2, false, 0x2A, XMM0, RAX);
+                sse(0xF2, false, 0x11, XMM0, RBX, slot(1));
+                break;
+
+            case ADD: sseBinary(0xF2, 0x58); break;
+            case SUB: sseBinary(0xF2, 0x5C); break;
+            case MUL: sseBinary(0xF2, 0x59); break;
+            case DIV: sseBinary(0xF2, 0x5E); break;
+
+            case LOAD_UCHAR: case LOAD_USHORT: case LOAD_ULONG: case LOAD_UINT: case LOAD_CHAR:
+            case LOAD_SHORT: case LOAD_LONG: case LOAD_INT: case LOAD_FLOAT: case LOAD_DOUBLE: case LOAD_ADDR:
+                doubleToU64(RBX, slot(1));
+                loadTyped(op, RAX, 0);
+                sse(0xF2, false, 0x11, XMM0, RBX, slot(1));
+                break;
+
+            case LOAD_VAL_CONST:
+                pushDouble(imm.d);
+                break;
+
+            case LOAD_VAL_CONST8:
+                pushDouble((Value) imm.i);
+                break;
+
+            case LOAD_ADDR_CONST:
+                pushDouble((uintptr_t) imm.a);
+                break;
+
+            case LOAD_LABEL_CONST:
+                pushDouble((uintptr_t) (code + imm.i));
+                break;
+
+            case LOAD_STACK_OFFS_CONST:
+                lea(RAX, R12, (int32_t) imm.i);
+                u64ToDouble();
+                pushXmm0();
+                break;
+
+            case STORE_UCHAR: case STORE_USHORT: case STORE_ULONG: case STORE_UINT: case STORE_CHAR:
+            case STORE_SHORT: case STORE_LONG: case STORE_INT: case STORE_FLOAT: case STORE_DOUBLE: case STORE_ADDR:
+                doubleToU64(RBX, slot(1));
+                rr(0, true, {0x8B}, RDX, RAX);
+                storeTyped(op, slot(2), RDX, 0);
+                drop(2);
+                break;
+
+            case PUSHB_CONST:
+                aluImm(0, R12, (int32_t) imm.i);
+                checkSpLimit(nextInstr(ip));
+                break;
+
+            case POPB_CONST:
+                aluImm(5, R12, (int32_t) imm.i);
+                break;
+
+            case PUSHB: case POPB:
+                sse(0xF2, false, 0x2C, RAX, RBX, slot(1));
+                rr(0, true, {0x63}, RAX, RAX);
+                rr(0, true, {uint8_t(op == PUSHB ? 0x01 : 0x29)}, RAX, R12);
+                drop(1);
+
+                if (op == PUSHB)
+                    checkSpLimit(nextInstr(ip));
+
+                break;
+
+            case LOAD_LOCAL_INT: loadTyped(LOAD_INT, R12, (int32_t) imm.i); pushXmm0(); break;
+            case LOAD_LOCAL_FLOAT: loadTyped(LOAD_FLOAT, R12, (int32_t) imm.i); pushXmm0(); break;
+            case LOAD_LOCAL_DOUBLE: loadTyped(LOAD_DOUBLE, R12, (int32_t) imm.i); pushXmm0(); break;
+            case LOAD_LOCAL_ADDR: loadTyped(LOAD_ADDR, R12, (int32_t) imm.i); pushXmm0(); break;
+
+            case STORE_LOCAL_INT: storeTyped(STORE_INT, slot(1), R12, (int32_t) imm.i); drop(1); break;
+            case STORE_LOCAL_FLOAT: storeTyped(STORE_FLOAT, slot(1), R12, (int32_t) imm.i); drop(1); break;
+            case STORE_LOCAL_DOUBLE: storeTyped(STORE_DOUBLE, slot(1), R12, (int32_t) imm.i); drop(1); break;
+            case STORE_LOCAL_ADDR: storeTyped(STORE_ADDR, slot(1), R12, (int32_t) imm.i); drop(1); break;
+
+            case ADD_CONST: constBinary(0x58, imm.d); break;
+            case SUB_CONST: constBinary(0x5C, imm.d); break;
+            case MUL_CONST: constBinary(0x59, imm.d); break;
+            case ADD_CONST8: constBinary(0x58, (Value) imm.i); break;
+            case SUB_CONST8: constBinary(0x5C, (Value) imm.i); break;
+
+            case JE_CONST: case JNE_CONST: case JGT_CONST: case JLT_CONST: case JGET_CONST: case JLET_CONST:
+                sse(0xF2, false, 0x10, XMM0, RBX, slot(1));
+                drop(1);
+                toLabel(branchDouble(op - JE_CONST), (uint32_t) imm.i);
+                break;
+
+            case SUB_JE_CONST: case SUB_JNE_CONST: case SUB_JGT_CONST:
+            case SUB_JLT_CONST: case SUB_JGET_CONST: case SUB_JLET_CONST:
+                sse(0xF2, false, 0x10, XMM0, RBX, slot(2));
+                sse(0xF2, false, 0x5C, XMM0, RBX, slot(1));
+                drop(2);
+                toLabel(branchDouble(op - SUB_JE_CONST), (uint32_t) imm.i);
+                break;
+
+            case IJMP:
+                load(true, RAX, RBX, slot(1));
+                drop(1);
+                dynamicJump();
+                break;
+
+            case IJE_CONST: case IJNE_CONST: case IJGT_CONST: case IJLT_CONST: case IJGET_CONST: case IJLET_CONST:
+                load(true, RAX, RBX, slot(1));
+                drop(1);
+                toLabel(branchInt(op - IJE_CONST), (uint32_t) imm.i);
+                break;
+
+            case IADD: case ISUB: case IMUL: case IDIV: case IMOD:
+            case IAND: case IOR: case IXOR: case ISHL: case ISHR:
+                int64Binary(op);
+                break;
+
+            case FADD: sseBinary(0xF3, 0x58); break;
+            case FSUB: sseBinary(0xF3, 0x5C); break;
+            case FMUL: sseBinary(0xF3, 0x59); break;
+            case FDIV: sseBinary(0xF3, 0x5E); break;
+
+            case I2D:
+                sse(0xF2, true, 0x2A, XMM0, RBX, slot(1));
+                sse(0xF2, false, 0x11, XMM0, RBX, slot(1));
+                break;
+            case D2I:
+                sse(0xF2, true, 0x2C, RAX, RBX, slot(1));
+                store(true, RBX, slot(1), RAX);
+                break;
+            case F2D:
+                sse(0xF3, false, 0x5A, XMM0, RBX, slot(1));
+                sse(0xF2, false, 0x11, XMM0, RBX, slot(1));
+                break;
+            case D2F:
+                sse(0xF2, false, 0x5A, XMM0, RBX, slot(1));
+                sse(0xF3, false, 0x11, XMM0, RBX, slot(1));
+                break;
+            case I2F:
+                sse(0xF3, true, 0x2A, XMM0, RBX, slot(1));
+                sse(0xF3, false, 0x11, XMM0, RBX, slot(1));
+                break;
+            case F2I:
+                sse(0xF3, true, 0x2C, RAX, RBX, slot(1));
+                store(true, RBX, slot(1), RAX);
+                break;
+
+            case ILOAD_UCHAR: case ILOAD_USHORT: case ILOAD_ULONG: case ILOAD_UINT: case ILOAD_CHAR:
+            case ILOAD_SHORT: case ILOAD_LONG: case ILOAD_INT: case ILOAD_ADDR:
+            {
+                load(true, RAX, RBX, slot(1));
+
+                switch (op)
+                {
+                    case ILOAD_UCHAR: mem(0, false, {0x0F, 0xB6}, RAX, RAX, 0); break;
+                    case ILOAD_USHORT: mem(0, false, {0x0F, 0xB7}, RAX, RAX, 0); break;
+                    case ILOAD_CHAR: mem(0, true, {0x0F, 0xBE}, RAX, RAX, 0); break;
+                    case ILOAD_SHORT: mem(0, true, {0x0F, 0xBF}, RAX, RAX, 0); break;
+                    case ILOAD_UINT: load(false, RAX, RAX, 0); break;
+                    case ILOAD_INT: mem(0, true, {0x63}, RAX, RAX, 0); break;
+                    default: load(true, RAX, RAX, 0); break;
+                }
+
+                store(true, RBX, slot(1), RAX);
+                break;
+            }
+
+            case FLOAD_FLOAT: case DLOAD_DOUBLE:
+            {
+                uint8_t prefix = op == FLOAD_FLOAT ? 0xF3 : 0xF2;
+                load(true, RAX, RBX, slot(1));
+                sse(prefix, false, 0x10, XMM0, RAX, 0);
+                sse(prefix, false, 0x11, XMM0, RBX, slot(1));
+                break;
+            }
+
+            case ILOAD_CONST: case ILOAD_CONST32:
+                pushBits(imm.i);
+                break;
+
+            case ILOAD_ADDR_CONST:
+                pushBits((uintptr_t) imm.a);
+                break;
+
+            case ILOAD_LABEL_CONST:
+                pushBits((uintptr_t) (code + imm.i));
+                break;
+
+            case ILOAD_STACK_OFFS_CONST:
+                lea(RAX, R12, (int32_t) imm.i);
+                pushRax();
+                break;
+
+            case ILOAD_FRAME_OFFS_CONST:
+                lea(RAX, R13, (int32_t) imm.i);
+                pushRax();
+                break;
+
+            case ILOAD_FRAME_LONG:
+                load(true, RAX, R13, (int32_t) imm.i);
+                pushRax();
+                break;
+
+            case ISTORE_FRAME_LONG:
+                load(true, RAX, RBX, slot(1));
+                store(true, R13, (int32_t) imm.i, RAX);
+                drop(1);
+                break;
+
+            case FLOAD_CONST:
+            {
+                uint32_t bits;
+                memcpy(&bits, &imm.f, sizeof bits);
+                pushBits(bits);
+                break;
+            }
+
+            case ISTORE_UCHAR: case ISTORE_USHORT: case ISTORE_ULONG: case ISTORE_UINT: case ISTORE_CHAR:
+            case ISTORE_SHORT: case ISTORE_LONG: case ISTORE_INT: case ISTORE_ADDR:
+                load(true, RDX, RBX, slot(1));
+                load(true, RAX, RBX, slot(2));
+
+                switch (op)
+                {
+                    case ISTORE_UCHAR: case ISTORE_CHAR: mem(0, false, {0x88}, RAX, RDX, 0); break;
+                    case ISTORE_USHORT: case ISTORE_SHORT: mem(0x66, false, {0x89}, RAX, RDX, 0); break;
+                    case ISTORE_UINT: case ISTORE_INT: store(false, RDX, 0, RAX); break;
+                    default: store(true, RDX, 0, RAX); break;
+                }
+
+                drop(2);
+                break;
+
+            case FSTORE_FLOAT: case DSTORE_DOUBLE:
+            {
+                uint8_t prefix = op == FSTORE_FLOAT ? 0xF3 : 0xF2;
+                load(true, RDX, RBX, slot(1));
+                sse(prefix, false, 0x10, XMM0, RBX, slot(2));
+                sse(prefix, false, 0x11, XMM0, RDX, 0);
+                drop(2);
+                break;
+            }
+
+            // The prologue leaves rsp 16-byte aligned and every register
+            // the generated code keeps is callee-saved, so the kernels are
+            // called directly with the operands in place.
+            case BLOCK_COPY: case BLOCK_FILL:
+            case ISUM_INT: case IMIN_INT: case IMAX_INT: case IDOT_INT:
+            case FSUM_FLOAT: case FMIN_FLOAT: case FMAX_FLOAT: case FDOT_FLOAT:
+            case DSUM_DOUBLE: case DMIN_DOUBLE: case DMAX_DOUBLE: case DDOT_DOUBLE:
+            {
+                Slot (*fn)(int, Slot const*) = &bulkOp;
+                movImm(RDI, op);
+                lea(RSI, RBX, slot(OPCODE_POPS[op]));
+                movImm(RAX, (uintptr_t) fn);
+                callReg(RAX);
+                drop(OPCODE_POPS[op]);
+
+                if (OPCODE_PUSHES[op])
+                    pushRax();
+
+                break;
+            }
+
+            default:
+                // Not compiled: hand this instruction and everything after
+                // it to the interpreter.
+                exitAt(ip);
+                break;
+        }
+    }
+
+    // Emits the whole program. Returns the native offset of every
+    // instruction start, -1 elsewhere.
+    void compileAll()
+    {
+        // Prologue: entry(frame, target).
+        push(RBX);
+        push(R12);
+        push(R13);
+        push(R14);
+        push(R15);
+        rr(0, true, {0x8B}, R14, RDI);
+        load(true, RBX, R14, offsetof(JitFrame, top));
+        load(true, R12, R14, offsetof(JitFrame, sp));
+        load(true, R13, R14, offsetof(JitFrame, fp));
+        load(true, R15, R14, offsetof(JitFrame, calls));
+        jmpReg(RSI);
+
+        uint8_t const* end = code + codeSize;
+
+        for (uint8_t const* ip = code; ip <= end; ip = nextInstr(ip))
+        {
+            nativeOffs[ip - code] = pos();
+            compile(ip);
+        }
+
+        // Labels that are not instruction starts can only be reached by
+        // the interpreter.
+        for (auto const& fixup : labelFixups)
+        {
+            if (fixup.second <= codeSize && nativeOffs[fixup.second] >= 0)
+                patch(fixup.first, nativeOffs[fixup.second]);
+            else
+            {
+                bind(fixup.first);
+                exitAt(code + fixup.second);
+            }
+        }
+
+        // Epilogue, with the bytecode ip to continue at in rax.
+        for (size_t at : exitFixups)
+            bind(at);
+
+        store(true, R14, offsetof(JitFrame, top), RBX);
+        store(true, R14, offsetof(JitFrame, sp), R12);
+        store(true, R14, offsetof(JitFrame, fp), R13);
+        store(true, R14, offsetof(JitFrame, calls), R15);
+        pop(R15);
+        pop(R14);
+        pop(R13);
+        pop(R12);
+        pop(RBX);
+        byte(0xC3);
+    }
+};
+
+// *******
+// * JIT *
+// *******
+
+// Compiles a program on its first run, or on the run after `threshold`
+// interpreted ones, and runs it natively from then on. Runs with hooks, or
+// on hosts without the JIT, always use the interpreter. One Jit may be run
+// from several threads: the first to pass the threshold compiles under
+// lock, and the code is published only once entries is filled in.
+struct Jit {
+    uint8_t* code;
+    size_t codeSize;
+    int threshold;
+    std::atomic<int> runs;
+    std::atomic<uint8_t*> native;
+    size_t nativeSize;
+    std::vector<void*> entries;
+    std::mutex compileLock;
+
+    Jit(uint8_t* pCode, size_t pCodeSize, int pThreshold = 0): code(pCode), codeSize(pCodeSize),
+            threshold(pThreshold), runs(0), native(nullptr), nativeSize(0)
+    {
+    }
+
+    ~Jit()
+    {
+        if (native)
+            munmap(native.load(), nativeSize);
+    }
+
+    bool compiled() const
+    {
+        return native.load(std::memory_order_acquire) != nullptr;
+    }
+
+#ifdef VM_HAS_JIT
+    // Does nothing if another thread got there first.
+    void compile()
+    {
+        std::lock_guard<std::mutex> guard(compileLock);
+
+        if (compiled())
+            return;
+
+        entries.assign(codeSize + 1, nullptr);
+
+        JitCompiler compiler(code, codeSize, entries.data());
+        compiler.compileAll();
+
+        nativeSize = roundUpToPage(compiler.buf.size());
+        void* mem = mmap(nullptr, nativeSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+        if (mem == MAP_FAILED)
+            die("Failed to map JIT code!");
+
+        memcpy(mem, compiler.buf.data(), compiler.buf.size());
+
+        if (mprotect(mem, nativeSize, PROT_READ | PROT_EXEC) != 0)
+            die("Failed to protect JIT code!");
+
+        for (size_t offs = 0; offs <= codeSize; ++offs)
+            if (compiler.nativeOffs[offs] >= 0)
+                entries[offs] = (uint8_t*) mem + compiler.nativeOffs[offs];
+
+        native.store((uint8_t*) mem, std::memory_order_release);
+    }
+#endif
+
+    // Native entry for ip, or null when ip is outside this program or has
+    // no compiled code.
+    void* entryFor(uint8_t const* ip) const
+    {
+        return ip >= code && ip <= code + codeSize ? entries[ip - code] : nullptr;
+    }
+
+    // Host calls, anything else the compiler leaves out and a vm whose ip
+    // is not in this program continue in the interpreter.
+    RunStatus run(VM& vm)
+    {
+#ifdef VM_HAS_JIT
+        if (!compiled() && runs.fetch_add(1, std::memory_order_relaxed) >= threshold)
+            compile();
+
+        // Native code also returns when a push needs more gp stack; grow it
+        // and carry on natively.
+        void* entry;
+
+        while (compiled() && (entry = entryFor(vm.ip)))
+        {
+            JitFrame frame = {vm.opStack.top, vm.sp, vm.gpLimit, vm.fp, vm.callStack.top, vm.leafRet};
+            vm.ip = ((JitFunction) native.load(std::memory_order_relaxed))(&frame, entry);
+            vm.opStack.top = frame.top;
+            vm.sp = frame.sp;
+            vm.fp = frame.fp;
+            vm.callStack.top = frame.calls;
+            vm.leafRet = frame.leafRet;
+
+            if (vm.sp <= vm.gpLimit)
+                break;
+
+            vm.growGpStack();
+        }
+#endif
+
+        return vm.ip ? vm.run() : RUN_HALTED;
+    }
+};
+
+#endif
@@ -0,0 +1,294 @@
+#ifndef _MEMORY_HPP_
+#define _MEMORY_HPP_
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <vector>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "Util.hpp"
+
+inline size_t pageSize()
+{
+    static size_t const size = (size_t) sysconf(_SC_PAGESIZE);
+    return size;
+}
+
+inline size_t roundUpToPage(size_t bytes)
+{
+    return (bytes + pageSize() - 1) & ~(pageSize() - 1);
+}
+
+// Page-aligned anonymous mapping with an inaccessible guard page on each
+// side, so running off either end faults instead of corrupting memory.
+struct GuardedRegion {
+    uint8_t* mapping;
+    uint8_t* base;
+    size_t size;
+
+    GuardedRegion(size_t bytes): size(roundUpToPage(bytes))
+    {
+        size_t total = size + 2 * pageSize();
+        void* mem = mmap(nullptr, total, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+        if (mem == MAP_FAILED)
+            die("Failed to map guarded region!");
+
+        mapping = (uint8_t*) mem;
+        base = mapping + pageSize();
+
+        if (mprotect(base, size, PROT_READ | PROT_WRITE) != 0)
+            die("Failed to commit guarded region!");
+    }
+
+    ~GuardedRegion()
+    {
+        munmap(mapping, size + 2 * pageSize());
+    }
+
+    uint8_t* end() const
+    {
+        return base + size;
+    }
+
+private:
+    GuardedRegion(GuardedRegion const&);
+    GuardedRegion& operator=(GuardedRegion const&);
+};
+
+// Reserves address space up front and commits it on demand, so the base
+// address never moves while the usable part grows. Fresh pages read as
+// zero.
+struct ReservedRegion {
+    uint8_t* base;
+    size_t reserved;
+    size_t committed;
+
+    ReservedRegion(size_t bytes): reserved(roundUpToPage(bytes)), committed(0)
+    {
+        void* mem = mmap(nullptr, reserved, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+        if (mem == MAP_FAILED)
+            die("Failed to reserve region!");
+
+        base = (uint8_t*) mem;
+    }
+
+    ~ReservedRegion()
+    {
+        munmap(base, reserved);
+    }
+
+    // Makes at least the first `bytes` bytes usable. Returns false if that
+    // is more than was reserved.
+    bool commit(size_t bytes)
+    {
+        if (bytes <= committed)
+            return true;
+
+        if (bytes > reserved)
+            return false;
+
+        size_t target = roundUpToPage(bytes);
+
+        if (mprotect(base + committed, target - committed, PROT_READ | PROT_WRITE) != 0)
+            die("Failed to commit region!");
+
+        committed = target;
+        return true;
+    }
+
+private:
+    ReservedRegion(ReservedRegion const&);
+    ReservedRegion& operator=(ReservedRegion const&);
+};
+
+// Stack that reserves its whole size up front and commits pages only as
+// the stack grows into them. The page below base and everything past the
+// committed part stay inaccessible, so a stray access faults instead of
+// landing in someone else's memory.
+struct StackRegion {
+    uint8_t* mapping;
+    uint8_t* base;
+    size_t size;
+    size_t committed;
+
+    StackRegion(size_t bytes): size(roundUpToPage(bytes)), committed(0)
+    {
+        void* mem = mmap(nullptr, size + pageSize(), PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+        if (mem == MAP_FAILED)
+            die("Failed to reserve stack!");
+
+        mapping = (uint8_t*) mem;
+        base = mapping + pageSize();
+    }
+
+    ~StackRegion()
+    {
+        munmap(mapping, size + pageSize());
+    }
+
+    uint8_t* committedEnd() const
+    {
+        return base + committed;
+    }
+
+    // Commits everything below end. Returns false if end is past the
+    // reserved size.
+    bool commitTo(uint8_t* end)
+    {
+        if (end < base || end > base + size)
+            return false;
+
+        size_t target = roundUpToPage(end - base);
+
+        if (target <= committed)
+            return true;
+
+        if (mprotect(base + committed, target - committed, PROT_READ | PROT_WRITE) != 0)
+            die("Failed to commit stack!");
+
+        committed = target;
+        return true;
+    }
+
+    // Returns the pages past the first `keep` bytes to the system.
+    void decommitFrom(size_t keep)
+    {
+        keep = roundUpToPage(keep);
+
+        if (keep >= committed)
+            return;
+
+        void* mem = mmap(base + keep, committed - keep, PROT_NONE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+
+        if (mem == MAP_FAILED)
+            die("Failed to decommit stack!");
+
+        committed = keep;
+    }
+
+private:
+    StackRegion(StackRegion const&);
+    StackRegion& operator=(StackRegion const&);
+};
+
+// Recycles stacks between short-lived owners so they skip the mmap and
+// the first-touch page faults. Stacks are pooled by reserved size; a
+// released stack keeps its first `keepBytes` committed and at most
+// `maxFree` stacks of each size are kept. The fixed-size guarded regions
+// of the operand and call stacks are pooled the same way, whole.
+struct StackPool {
+    std::mutex lock;
+    std::map<size_t, std::vector<StackRegion*> > free;
+    std::map<size_t, std::vector<GuardedRegion*> > freeGuarded;
+    size_t keepBytes;
+    size_t maxFree;
+
+    StackPool(size_t pKeepBytes = 64 * 1024, size_t pMaxFree = 256): keepBytes(pKeepBytes), maxFree(pMaxFree)
+    {
+    }
+
+    ~StackPool()
+    {
+        for (auto& kv : free)
+            for (StackRegion* stack : kv.second)
+                delete stack;
+
+        for (auto& kv : freeGuarded)
+            for (GuardedRegion* region : kv.second)
+                delete region;
+    }
+
+    // The pool VMs draw from unless given another.
+    static StackPool& shared()
+    {
+        static StackPool pool;
+        return pool;
+    }
+
+    StackRegion* acquire(size_t bytes)
+    {
+        bytes = roundUpToPage(bytes);
+
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            std::vector<StackRegion*>& stacks = free[bytes];
+
+            if (!stacks.empty())
+            {
+                StackRegion* stack = stacks.back();
+                stacks.pop_back();
+                return stack;
+            }
+        }
+
+        return new StackRegion(bytes);
+    }
+
+    void release(StackRegion* stack)
+    {
+        stack->decommitFrom(keepBytes);
+
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            std::vector<StackRegion*>& stacks = free[stack->size];
+
+            if (stacks.size() < maxFree)
+            {
+                stacks.push_back(stack);
+                return;
+            }
+        }
+
+        delete stack;
+    }
+
+    GuardedRegion* acquireGuarded(size_t bytes)
+    {
+        bytes = roundUpToPage(bytes);
+
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            std::vector<GuardedRegion*>& regions = freeGuarded[bytes];
+
+            if (!regions.empty())
+            {
+                GuardedRegion* region = regions.back();
+                regions.pop_back();
+                return region;
+            }
+        }
+
+        return new GuardedRegion(bytes);
+    }
+
+    // The region comes back with its old contents.
+    void releaseGuarded(GuardedRegion* region)
+    {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            std::vector<GuardedRegion*>& regions = freeGuarded[region->size];
+
+            if (regions.size() < maxFree)
+            {
+                regions.push_back(region);
+                return;
+            }
+        }
+
+        delete region;
+    }
+
+private:
+    StackPool(StackPool const&);
+    StackPool& operator=(StackPool const&);
+};
+
+#endif
@@ -1,38 +1,163 @@
 #ifndef _OPCODE_HPP_
 #define _OPCODE_HPP_
 
-enum Opcode {
-    HALT, GOTO, JMP, JE, JNE, JGT, JLT, JGET, JLET,
-    BAND, BOR, BXOR, BSL1, BSR1, BSL, BSR,
-    ADD, SUB, MUL, DIV, MOD,
+// X(opcode, VM handler, immediate operand, values popped, values pushed)
+//
+// CALL_HOST leaves its operands to the host function, so its counts are 0.
+// Functions called with CALL and CALL_LEAF take and return values on the
+// operand stack as well.
+//
+// The bulk opcodes take integer addresses and counts, counts last:
+// BLOCK_COPY dest src bytes, BLOCK_FILL dest byte bytes, the reductions
+// src count and the dot products a b count. See Bulk.hpp.
+#define OPCODE_LIST(X) \
+    X(HALT, halt, NONE, 0, 0) X(GOTO, goto_, LABEL, 0, 0) X(JMP, jmp, NONE, 1, 0) \
+    X(JE, je, NONE, 2, 0) X(JNE, jne, NONE, 2, 0) X(JGT, jgt, NONE, 2, 0) X(JLT, jlt, NONE, 2, 0) \
+    X(JGET, jget, NONE, 2, 0) X(JLET, jlet, NONE, 2, 0) \
+    \
+    X(BAND, band, NONE, 2, 1) X(BOR, bor, NONE, 2, 1) X(BXOR, bxor, NONE, 2, 1) \
+    X(BSL1, bsl1, NONE, 1, 1) X(BSR1, bsr1, NONE, 1, 1) X(BSL, bsl, NONE, 2, 1) X(BSR, bsr, NONE, 2, 1) \
+    X(ADD, add, NONE, 2, 1) X(SUB, sub, NONE, 2, 1) X(MUL, mul, NONE, 2, 1) \
+    X(DIV, div, NONE, 2, 1) X(MOD, mod, NONE, 2, 1) \
+    \
+    X(LOAD_UCHAR, load_uchar, NONE, 1, 1) X(LOAD_USHORT, load_ushort, NONE, 1, 1) \
+    X(LOAD_ULONG, load_ulong, NONE, 1, 1) X(LOAD_UINT, load_uint, NONE, 1, 1) \
+    X(LOAD_CHAR, load_char, NONE, 1, 1) X(LOAD_SHORT, load_short, NONE, 1, 1) \
+    X(LOAD_LONG, load_long, NONE, 1, 1) X(LOAD_INT, load_int, NONE, 1, 1) \
+    X(LOAD_FLOAT, load_float, NONE, 1, 1) X(LOAD_DOUBLE, load_double, NONE, 1, 1) \
+    X(LOAD_ADDR, load_addr, NONE, 1, 1) \
+    X(LOAD_VAL_CONST, load_val_const, VALUE, 0, 1) X(LOAD_ADDR_CONST, load_addr_const, ADDR, 0, 1) \
+    X(LOAD_STACK_OFFS_CONST, load_stack_offs_const, I32, 0, 1) \
+    X(LOAD_VAL_CONST8, load_val_const8, I8, 0, 1) X(LOAD_LABEL_CONST, load_label_const, LABEL, 0, 1) \
+    \
+    X(STORE_UCHAR, store_uchar, NONE, 2, 0) X(STORE_USHORT, store_ushort, NONE, 2, 0) \
+    X(STORE_ULONG, store_ulong, NONE, 2, 0) X(STORE_UINT, store_uint, NONE, 2, 0) \
+    X(STORE_CHAR, store_char, NONE, 2, 0) X(STORE_SHORT, store_short, NONE, 2, 0) \
+    X(STORE_LONG, store_long, NONE, 2, 0) X(STORE_INT, store_int, NONE, 2, 0) \
+    X(STORE_FLOAT, store_float, NONE, 2, 0) X(STORE_DOUBLE, store_double, NONE, 2, 0) \
+    X(STORE_ADDR, store_addr, NONE, 2, 0) \
+    \
+    X(PUSHB_CONST, pushb_const, I32, 0, 0) X(POPB_CONST, popb_const, I32, 0, 0) \
+    X(PUSHB, pushb, NONE, 1, 0) X(POPB, popb, NONE, 1, 0) \
+    \
+    X(LOAD_LOCAL_INT, load_local_int, I32, 0, 1) X(LOAD_LOCAL_FLOAT, load_local_float, I32, 0, 1) \
+    X(LOAD_LOCAL_DOUBLE, load_local_double, I32, 0, 1) X(LOAD_LOCAL_ADDR, load_local_addr, I32, 0, 1) \
+    X(STORE_LOCAL_INT, store_local_int, I32, 1, 0) X(STORE_LOCAL_FLOAT, store_local_float, I32, 1, 0) \
+    X(STORE_LOCAL_DOUBLE, store_local_double, I32, 1, 0) X(STORE_LOCAL_ADDR, store_local_addr, I32, 1, 0) \
+    X(ADD_CONST, add_const, VALUE, 1, 1) X(SUB_CONST, sub_const, VALUE, 1, 1) \
+    X(MUL_CONST, mul_const, VALUE, 1, 1) X(ADD_CONST8, add_const8, I8, 1, 1) X(SUB_CONST8, sub_const8, I8, 1, 1) \
+    X(JE_CONST, je_const, LABEL, 1, 0) X(JNE_CONST, jne_const, LABEL, 1, 0) \
+    X(JGT_CONST, jgt_const, LABEL, 1, 0) X(JLT_CONST, jlt_const, LABEL, 1, 0) \
+    X(JGET_CONST, jget_const, LABEL, 1, 0) X(JLET_CONST, jlet_const, LABEL, 1, 0) \
+    X(SUB_JE_CONST, sub_je_const, LABEL, 2, 0) X(SUB_JNE_CONST, sub_jne_const, LABEL, 2, 0) \
+    X(SUB_JGT_CONST, sub_jgt_const, LABEL, 2, 0) X(SUB_JLT_CONST, sub_jlt_const, LABEL, 2, 0) \
+    X(SUB_JGET_CONST, sub_jget_const, LABEL, 2, 0) X(SUB_JLET_CONST, sub_jlet_const, LABEL, 2, 0) \
+    \
+    X(IJMP, ijmp, NONE, 1, 0) \
+    X(IJE_CONST, ije_const, LABEL, 1, 0) X(IJNE_CONST, ijne_const, LABEL, 1, 0) \
+    X(IJGT_CONST, ijgt_const, LABEL, 1, 0) X(IJLT_CONST, ijlt_const, LABEL, 1, 0) \
+    X(IJGET_CONST, ijget_const, LABEL, 1, 0) X(IJLET_CONST, ijlet_const, LABEL, 1, 0) \
+    \
+    X(IADD, iadd, NONE, 2, 1) X(ISUB, isub, NONE, 2, 1) X(IMUL, imul, NONE, 2, 1) \
+    X(IDIV, idiv, NONE, 2, 1) X(IMOD, imod, NONE, 2, 1) \
+    X(IAND, iand, NONE, 2, 1) X(IOR, ior, NONE, 2, 1) X(IXOR, ixor, NONE, 2, 1) \
+    X(ISHL, ishl, NONE, 2, 1) X(ISHR, ishr, NONE, 2, 1) \
+    X(FADD, fadd, NONE, 2, 1) X(FSUB, fsub, NONE, 2, 1) X(FMUL, fmul, NONE, 2, 1) X(FDIV, fdiv, NONE, 2, 1) \
+    \
+    X(I2D, i2d, NONE, 1, 1) X(D2I, d2i, NONE, 1, 1) X(F2D, f2d, NONE, 1, 1) \
+    X(D2F, d2f, NONE, 1, 1) X(I2F, i2f, NONE, 1, 1) X(F2I, f2i, NONE, 1, 1) \
+    \
+    X(ILOAD_UCHAR, iload_uchar, NONE, 1, 1) X(ILOAD_USHORT, iload_ushort, NONE, 1, 1) \
+    X(ILOAD_ULONG, iload_ulong, NONE, 1, 1) X(ILOAD_UINT, iload_uint, NONE, 1, 1) \
+    X(ILOAD_CHAR, iload_char, NONE, 1, 1) X(ILOAD_SHORT, iload_short, NONE, 1, 1) \
+    X(ILOAD_LONG, iload_long, NONE, 1, 1) X(ILOAD_INT, iload_int, NONE, 1, 1) \
+    X(ILOAD_ADDR, iload_addr, NONE, 1, 1) \
+    X(FLOAD_FLOAT, fload_float, NONE, 1, 1) X(DLOAD_DOUBLE, dload_double, NONE, 1, 1) \
+    X(ILOAD_CONST, iload_const, INT, 0, 1) X(ILOAD_CONST32, iload_const32, I32, 0, 1) \
+    X(ILOAD_ADDR_CONST, iload_addr_const, ADDR, 0, 1) X(ILOAD_LABEL_CONST, iload_label_const, LABEL, 0, 1) \
+    X(ILOAD_STACK_OFFS_CONST, iload_stack_offs_const, I32, 0, 1) X(FLOAD_CONST, fload_const, FLOAT, 0, 1) \
+    \
+    X(ISTORE_UCHAR, istore_uchar, NONE, 2, 0) X(ISTORE_USHORT, istore_ushort, NONE, 2, 0) \
+    X(ISTORE_ULONG, istore_ulong, NONE, 2, 0) X(ISTORE_UINT, istore_uint, NONE, 2, 0) \
+    X(ISTORE_CHAR, istore_char, NONE, 2, 0) X(ISTORE_SHORT, istore_short, NONE, 2, 0) \
+    X(ISTORE_LONG, istore_long, NONE, 2, 0) X(ISTORE_INT, istore_int, NONE, 2, 0) \
+    X(ISTORE_ADDR, istore_addr, NONE, 2, 0) \
+    X(FSTORE_FLOAT, fstore_float, NONE, 2, 0) X(DSTORE_DOUBLE, dstore_double, NONE, 2, 0) \
+    \
+    X(CALL_HOST, call_host, I32, 0, 0) \
+    X(CALL, call, LABEL, 0, 0) X(RET, ret, NONE, 0, 0) \
+    X(CALL_LEAF, call_leaf, LABEL, 0, 0) X(RET_LEAF, ret_leaf, NONE, 0, 0) \
+    X(ILOAD_FRAME_OFFS_CONST, iload_frame_offs_const, I32, 0, 1) \
+    X(ILOAD_FRAME_LONG, iload_frame_long, I32, 0, 1) X(ISTORE_FRAME_LONG, istore_frame_long, I32, 1, 0) \
+    \
+    X(BLOCK_COPY, block_copy, NONE, 3, 0) X(BLOCK_FILL, block_fill, NONE, 3, 0) \
+    X(ISUM_INT, isum_int, NONE, 2, 1) X(IMIN_INT, imin_int, NONE, 2, 1) \
+    X(IMAX_INT, imax_int, NONE, 2, 1) X(IDOT_INT, idot_int, NONE, 3, 1) \
+    X(FSUM_FLOAT, fsum_float, NONE, 2, 1) X(FMIN_FLOAT, fmin_float, NONE, 2, 1) \
+    X(FMAX_FLOAT, fmax_float, NONE, 2, 1) X(FDOT_FLOAT, fdot_float, NONE, 3, 1) \
+    X(DSUM_DOUBLE, dsum_double, NONE, 2, 1) X(DMIN_DOUBLE, dmin_double, NONE, 2, 1) \
+    X(DMAX_DOUBLE, dmax_double, NONE, 2, 1) X(DDOT_DOUBLE, ddot_double, NONE, 3, 1)
 
-    LOAD_UCHAR, LOAD_USHORT, LOAD_ULONG, LOAD_UINT,
-    LOAD_CHAR, LOAD_SHORT, LOAD_LONG, LOAD_INT,
-    LOAD_FLOAT, LOAD_DOUBLE, LOAD_ADDR,
-    LOAD_VAL_CONST, LOAD_ADDR_CONST, LOAD_STACK_OFFS_CONST,
+#define OPCODE_ENUM_ENTRY(op, handler, operand, pops, pushes) op,
+#define OPCODE_NAME_ENTRY(op, handler, operand, pops, pushes) #op,
+#define OPCODE_OPERAND_ENTRY(op, handler, operand, pops, pushes) OPERAND_##operand,
+#define OPCODE_POPS_ENTRY(op, handler, operand, pops, pushes) pops,
+#define OPCODE_PUSHES_ENTRY(op, handler, operand, pops, pushes) pushes,
 
-    STORE_UCHAR, STORE_USHORT, STORE_ULONG, STORE_UINT,
-    STORE_CHAR, STORE_SHORT, STORE_LONG, STORE_INT,
-    STORE_FLOAT, STORE_DOUBLE, STORE_ADDR,
+enum Opcode {
+    OPCODE_LIST(OPCODE_ENUM_ENTRY)
+    OPCODE_COUNT
+};
 
-    PUSHB_CONST, POPB_CONST, PUSHB, POPB
+// VALUE is a double, FLOAT a float, INT/I32/I8 signed integers of that
+// width, ADDR a host pointer and LABEL a 32-bit offset from the start of
+// the code.
+enum OperandKind {
+    OPERAND_NONE, OPERAND_VALUE, OPERAND_FLOAT, OPERAND_INT, OPERAND_I32, OPERAND_I8,
+    OPERAND_ADDR, OPERAND_LABEL
 };
 
-char const* OPCODE_NAMES[] = {
-    "HALT", "GOTO", "JMP", "JE", "JNE", "JGT", "JLT", "JGET", "JLET",
-    "BAND", "BOR", "BXOR", "BSL1", "BSR1", "BSL", "BSR",
-    "ADD", "SUB", "MUL", "DIV", "MOD",
+// GOTO and every conditional or computed jump.
+inline constexpr bool isBranchOpcode(int op)
+{
+    return op == GOTO || (op >= JMP && op <= JLET) || (op >= JE_CONST && op <= SUB_JLET_CONST)
+            || (op >= IJMP && op <= IJLET_CONST);
+}
+
+// CALL, RET and their leaf forms.
+inline constexpr bool isCallOpcode(int op)
+{
+    return op >= CALL && op <= RET_LEAF;
+}
+
+// Anything that can move ip other than to the next instruction, apart
+// from HALT and host calls.
+inline constexpr bool isJumpOpcode(int op)
+{
+    return isBranchOpcode(op) || isCallOpcode(op);
+}
 
-    "LOAD_UCHAR", "LOAD_USHORT", "LOAD_ULONG", "LOAD_UINT",
-    "LOAD_CHAR", "LOAD_SHORT", "LOAD_LONG", "LOAD_INT",
-    "LOAD_FLOAT", "LOAD_DOUBLE", "LOAD_ADDR",
-    "LOAD_VAL_CONST", "LOAD_ADDR_CONST", "LOAD_STACK_OFFS_CONST",
+// The tables are const so each translation unit gets its own internal
+// copy instead of a clashing definition, and threads can share them.
+char const* const OPCODE_NAMES[] = {
+    OPCODE_LIST(OPCODE_NAME_ENTRY)
+};
 
-    "STORE_UCHAR", "STORE_USHORT", "STORE_ULONG", "STORE_UINT",
-    "STORE_CHAR", "STORE_SHORT", "STORE_LONG", "STORE_INT",
-    "STORE_FLOAT", "STORE_DOUBLE", "STORE_ADDR",
+OperandKind const OPCODE_OPERANDS[] = {
+    OPCODE_LIST(OPCODE_OPERAND_ENTRY)
+};
 
-    "PUSHB_CONST", "POPB_CONST", "PUSHB", "POPB"
+int const OPCODE_POPS[] = {
+    OPCODE_LIST(OPCODE_POPS_ENTRY)
 };
 
+int const OPCODE_PUSHES[] = {
+    OPCODE_LIST(OPCODE_PUSHES_ENTRY)
+};
+
+inline constexpr bool isBulkOpcode(int op)
+{
+    return op >= BLOCK_COPY && op <= DDOT_DOUBLE;
+}
+
 #endif
\ No newline at end of file
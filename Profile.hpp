@@ -0,0 +1,204 @@
+#ifndef _PROFILE_HPP_
+#define _PROFILE_HPP_
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "Opcode.hpp"
+#include "Bytecode.hpp"
+#include "Trace.hpp"
+
+// Timestamp counter ticks on x86, steady_clock nanoseconds elsewhere.
+inline uint64_t profileClock()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+// Code offset to label name, e.g. from Assembler::labelsByOffset().
+typedef std::map<uint32_t, std::string> LabelMap;
+
+// Hooks that count executions and clock ticks per opcode and per
+// instruction address. The ticks between two steps are charged to the
+// earlier instruction. Like every hook it costs nothing unless a VM is
+// run with it.
+struct Profiler: public NoHooks {
+    struct Counter {
+        uint64_t count;
+        uint64_t ticks;
+    };
+
+    uint8_t const* code;
+    std::vector<Counter> opcodes;
+    std::vector<Counter> addresses;
+    uint8_t const* last;
+    uint64_t lastStamp;
+
+    // codeSize is Program::size(); the implicit HALT after it is counted
+    // too.
+    Profiler(uint8_t const* pCode, size_t codeSize): code(pCode), opcodes(OPCODE_COUNT, Counter{0, 0}),
+            addresses(codeSize + 1, Counter{0, 0}), last(nullptr), lastStamp(0)
+    {
+    }
+
+    void step(uint8_t const* ip)
+    {
+        uint64_t now = profileClock();
+
+        if (last)
+        {
+            opcodes[*last].ticks += now - lastStamp;
+            addresses[last - code].ticks += now - lastStamp;
+        }
+
+        ++opcodes[*ip].count;
+        ++addresses[ip - code].count;
+        last = ip;
+        lastStamp = now;
+    }
+
+    void clear()
+    {
+        std::fill(opcodes.begin(), opcodes.end(), Counter{0, 0});
+        std::fill(addresses.begin(), addresses.end(), Counter{0, 0});
+        last = nullptr;
+    }
+
+    // **********
+    // * BLOCKS *
+    // **********
+
+    struct Block {
+        uint32_t offs;
+        uint32_t end;
+        uint64_t count;
+        uint64_t ticks;
+    };
+
+    // Splits the code into basic blocks: a block starts at offset 0, at
+    // every jump or call target and after every jump, call and return.
+    // Its count is the count of its first instruction, its ticks the sum
+    // over its instructions.
+    std::vector<Block> blocks() const
+    {
+        size_t size = addresses.size() - 1;
+        std::vector<bool> leader(size + 1, false);
+        leader[0] = true;
+
+        for (uint8_t const* ip = code; ip < code + size; ip = nextInstr(ip))
+        {
+            Opcode op = Opcode(*ip);
+
+            if (OPCODE_OPERANDS[op] == OPERAND_LABEL && readOperand(ip).i <= (int64_t) size)
+                leader[readOperand(ip).i] = true;
+
+            if (isJumpOpcode(op) && nextInstr(ip) <= code + size)
+                leader[nextInstr(ip) - code] = true;
+        }
+
+        std::vector<Block> result;
+
+        for (uint8_t const* ip = code; ip <= code + size; ip = nextInstr(ip))
+        {
+            uint32_t offs = ip - code;
+
+            if (leader[offs] || result.empty())
+                result.push_back(Block{offs, offs, addresses[offs].count, 0});
+
+            result.back().end = nextInstr(ip) - code;
+            result.back().ticks += addresses[offs].ticks;
+        }
+
+        return result;
+    }
+
+    // The nearest label at or before offs, or "<entry>".
+    static std::string labelFor(LabelMap const& labels, uint32_t offs)
+    {
+        LabelMap::const_iterator it = labels.upper_bound(offs);
+
+        if (it == labels.begin())
+            return "<entry>";
+
+        --it;
+        return it->second;
+    }
+
+    // **********
+    // * EXPORT *
+    // **********
+
+    uint64_t totalTicks() const
+    {
+        uint64_t total = 0;
+
+        for (Counter const& c : opcodes)
+            total += c.ticks;
+
+        return total;
+    }
+
+    // One row per executed opcode, most expensive first.
+    void writeOpcodeTable(FILE* out) const
+    {
+        std::vector<int> order;
+        uint64_t total = totalTicks();
+
+        for (int op = 0; op < OPCODE_COUNT; ++op)
+            if (opcodes[op].count)
+                order.push_back(op);
+
+        std::sort(order.begin(), order.end(), [this](int a, int b) {
+            return opcodes[a].ticks > opcodes[b].ticks;
+        });
+
+        fprintf(out, "%-24s %12s %14s %10s %7s\n", "opcode", "count", "ticks", "ticks/op", "%");
+
+        for (int op : order)
+        {
+            Counter const& c = opcodes[op];
+            fprintf(out, "%-24s %12lu %14lu %10.1f %6.2f%%\n", OPCODE_NAMES[op], (unsigned long) c.count,
+                    (unsigned long) c.ticks, double(c.ticks) / c.count, total ? 100.0 * c.ticks / total : 0.0);
+        }
+    }
+
+    // One row per executed basic block, in code order.
+    void writeBlockTable(FILE* out, LabelMap const& labels = LabelMap()) const
+    {
+        fprintf(out, "%-8s %-8s %-16s %12s %14s\n", "offset", "end", "label", "hits", "ticks");
+
+        for (Block const& b : blocks())
+            if (b.count)
+                fprintf(out, "%-8u %-8u %-16s %12lu %14lu\n", b.offs, b.end, labelFor(labels, b.offs).c_str(),
+                        (unsigned long) b.count, (unsigned long) b.ticks);
+    }
+
+    // Folded stacks ("label;OPCODE ticks" per line) for flamegraph.pl and
+    // compatible viewers.
+    void writeFolded(FILE* out, LabelMap const& labels = LabelMap()) const
+    {
+        std::map<std::string, uint64_t> folded;
+
+        for (size_t offs = 0; offs < addresses.size(); ++offs)
+            if (addresses[offs].ticks)
+                folded[labelFor(labels, offs) + ";" + OPCODE_NAMES[code[offs]]] += addresses[offs].ticks;
+
+        for (auto const& kv : folded)
+            fprintf(out, "%s %lu\n", kv.first.c_str(), (unsigned long) kv.second);
+    }
+};
+
+#endif
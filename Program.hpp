@@ -1,44 +1,435 @@
 #ifndef _PROGRAM_HPP_
 #define _PROGRAM_HPP_
 
+#include <cstring>
+#include <mutex>
+#include <vector>
+
+#include "Util.hpp"
 #include "Opcode.hpp"
 #include "VMTypes.hpp"
+#include "Memory.hpp"
+#include "Bytecode.hpp"
+
+#define PEEPHOLE_WINDOW 16
+#define PROGRAM_RESERVE_BYTES (64 * 1024 * 1024)
+#define PROGRAM_COMMIT_STEP (64 * 1024)
+
+// Hands out code buffers and takes them back when a program dies, so
+// building many programs reuses the same mappings and warm pages instead
+// of allocating. Programs may be built and dropped on several threads at
+// once; the lock is only taken when a program starts or dies.
+struct CodeArena {
+	std::mutex lock;
+	std::vector<ReservedRegion*> freeRegions;
+
+	ReservedRegion* acquire()
+	{
+		{
+			std::lock_guard<std::mutex> guard(lock);
+
+			if(!freeRegions.empty())
+			{
+				ReservedRegion* region = freeRegions.back();
+				freeRegions.pop_back();
+				return region;
+			}
+		}
+
+		return new ReservedRegion(PROGRAM_RESERVE_BYTES);
+	}
+
+	// Only the used prefix is cleared, so an unwritten tail keeps reading
+	// as HALT for the next owner.
+	void release(ReservedRegion* region, size_t used)
+	{
+		memset(region->base, 0, used);
+		std::lock_guard<std::mutex> guard(lock);
+		freeRegions.push_back(region);
+	}
+
+	~CodeArena()
+	{
+		for(ReservedRegion* region : freeRegions)
+			delete region;
+	}
+
+	static CodeArena& global()
+	{
+		static CodeArena arena;
+		return arena;
+	}
+};
 
+// Bytecode is written into an arena buffer that grows in place. Bytes
+// past the cursor always read as zero (HALT). Labels are offsets from
+// data, see Bytecode.hpp for the encoding.
+//
+// Code is peephole-optimized as it is written: common instruction pairs
+// collapse into superinstructions and a pushed branch target followed by a
+// conditional jump becomes a branch with an immediate target. Only the
+// last PEEPHOLE_WINDOW instructions are considered, and never across a
+// label, so jump targets always stay on instruction boundaries.
 struct Program {
-	uint8_t data[3000];
+	struct Instr {
+		Opcode opcode;
+		Slot operand;
+		uint8_t* start;
+	};
+
+	CodeArena& arena;
+	ReservedRegion* region;
+	uint8_t* data;
 	uint8_t* cursor;
-	
+	uint8_t* limit;
+	bool peephole;
+	Instr window[PEEPHOLE_WINDOW];
+	int windowSize;
+
 	void write(Opcode opcode)
 	{
-		*cursor = opcode;
-		++cursor;
+		Slot none;
+		none.i = 0;
+		writeOperand(opcode, none);
 	}
-	
+
+	// Immediates are converted to whatever the opcode's operand kind is.
+	// An Addr written as a LABEL must point into this program's code.
 	void write(Opcode opcode, Value v)
 	{
-		*cursor = opcode;
-		++cursor;
-		*(Value*)cursor = v;
-		cursor += sizeof(Value);
+		Slot operand;
+
+		switch(OPCODE_OPERANDS[opcode])
+		{
+			case OPERAND_VALUE: operand.d = v; break;
+			case OPERAND_FLOAT: operand.f = (float)v; break;
+			case OPERAND_ADDR: operand.a = (Addr)(uintptr_t)v; break;
+			default: operand.i = (int64_t)v; break;
+		}
+
+		writeOperand(opcode, operand);
 	}
-	
+
 	void write(Opcode opcode, Addr addr)
 	{
-		Value v = (uintptr_t)addr;
-		
-		*cursor = opcode;
-		++cursor;
-		*(Value*)cursor = v;
-		cursor += sizeof(Value);
+		Slot operand;
+
+		switch(OPCODE_OPERANDS[opcode])
+		{
+			case OPERAND_VALUE: operand.d = (uintptr_t)addr; break;
+			case OPERAND_FLOAT: operand.f = (uintptr_t)addr; break;
+			case OPERAND_ADDR: operand.a = addr; break;
+			case OPERAND_LABEL: operand.i = (uint8_t*)addr - data; break;
+			default: operand.i = (intptr_t)addr; break;
+		}
+
+		writeOperand(opcode, operand);
+	}
+
+	void writeInt(Opcode opcode, int64_t i)
+	{
+		Slot operand;
+
+		switch(OPCODE_OPERANDS[opcode])
+		{
+			case OPERAND_VALUE: operand.d = (Value)i; break;
+			case OPERAND_FLOAT: operand.f = (float)i; break;
+			case OPERAND_ADDR: operand.a = (Addr)(intptr_t)i; break;
+			default: operand.i = i; break;
+		}
+
+		writeOperand(opcode, operand);
+	}
+
+	void writeLabel(Opcode opcode, uint32_t offs)
+	{
+		writeInt(opcode, offs);
+	}
+
+	void writeOperand(Opcode opcode, Slot operand)
+	{
+		emit(opcode, operand);
+
+		if(peephole)
+			optimize();
+	}
+
+	// Marks the cursor as a jump target and returns its offset.
+	uint32_t label()
+	{
+		windowSize = 0;
+		return (uint32_t)size();
 	}
-	
-	Program()
+
+	Program(CodeArena& pArena = CodeArena::global()): arena(pArena), peephole(true), windowSize(0)
 	{
-		for(int i = 0; i < 3000; ++i)
-			data[i] = 0;
-			
+		region = arena.acquire();
+		data = region->base;
 		cursor = data;
+		limit = data + region->committed;
+	}
+
+	~Program()
+	{
+		arena.release(region, cursor - data);
+	}
+
+	size_t size() const
+	{
+		return cursor - data;
 	}
+
+	// Makes room for at least `bytes` more bytes of code up front. There
+	// is always one spare byte so the code ends in an implicit HALT.
+	void reserve(size_t bytes)
+	{
+		if(cursor + bytes < limit)
+			return;
+
+		size_t wanted = size() + bytes + PROGRAM_COMMIT_STEP;
+
+		if(!region->commit(wanted) && !region->commit(size() + bytes + 1))
+			die("Program too large!");
+
+		limit = data + region->committed;
+	}
+
+	// Appends bytecode that was encoded for this position, e.g. with
+	// writeInstr, and whose labels are relative to data.
+	void append(uint8_t const* bytes, size_t count)
+	{
+		reserve(count);
+		memcpy(cursor, bytes, count);
+		cursor += count;
+		windowSize = 0;
+	}
+
+	// ************
+	// * Encoding *
+	// ************
+
+	// Some immediates have a narrower encoding under a sibling opcode. The
+	// window keeps the generic form so peephole rules need not care.
+	static bool isInt8(Value v)
+	{
+		if(!(v >= -128 && v <= 127))
+			return false;
+
+		Value narrow = (int8_t)v;
+		return memcmp(&narrow, &v, sizeof(Value)) == 0;
+	}
+
+	static Opcode compactOpcode(Opcode opcode, Slot operand)
+	{
+		switch(opcode)
+		{
+			case LOAD_VAL_CONST:
+				return isInt8(operand.d) ? LOAD_VAL_CONST8 : opcode;
+
+			case ADD_CONST:
+				return isInt8(operand.d) ? ADD_CONST8 : opcode;
+
+			case SUB_CONST:
+				return isInt8(operand.d) ? SUB_CONST8 : opcode;
+
+			case ILOAD_CONST:
+				return operand.i == (int32_t)operand.i ? ILOAD_CONST32 : opcode;
+
+			default:
+				return opcode;
+		}
+	}
+
+	static Slot compactOperand(Opcode compact, Slot operand)
+	{
+		if(compact == LOAD_VAL_CONST8 || compact == ADD_CONST8 || compact == SUB_CONST8)
+			operand.i = (int8_t)operand.d;
+
+		return operand;
+	}
+
+	static bool fitsOperand(OperandKind kind, Slot operand)
+	{
+		switch(kind)
+		{
+			case OPERAND_I8: return operand.i == (int8_t)operand.i;
+			case OPERAND_I32: return operand.i == (int32_t)operand.i;
+			case OPERAND_LABEL: return operand.i == (uint32_t)operand.i;
+			default: return true;
+		}
+	}
+
+	void emit(Opcode opcode, Slot operand)
+	{
+		reserve(MAX_INSTR_BYTES);
+
+		if(!fitsOperand(OPCODE_OPERANDS[opcode], operand))
+			die(std::string("Immediate out of range for ") + OPCODE_NAMES[opcode] + "!");
+
+		if(windowSize == PEEPHOLE_WINDOW)
+		{
+			memmove(window, window + 1, sizeof(Instr) * (PEEPHOLE_WINDOW - 1));
+			--windowSize;
+		}
+
+		Instr& instr = window[windowSize++];
+		instr.opcode = opcode;
+		instr.operand = operand;
+		instr.start = cursor;
+
+		Opcode encoded = compactOpcode(opcode, operand);
+		cursor = writeInstr(cursor, encoded, compactOperand(encoded, operand));
+	}
+
+	// Drops window entries from index first on, rewinding the cursor to
+	// where the first of them started. The dropped bytes are cleared so
+	// the unwritten tail still reads as HALT.
+	void rewind(int first)
+	{
+		memset(window[first].start, 0, cursor - window[first].start);
+		cursor = window[first].start;
+		windowSize = first;
+	}
+
+	// ************
+	// * Peephole *
+	// ************
+
+	void optimize()
+	{
+		while(fusePair() || fuseBranch())
+			;
+	}
+
+	static Opcode fusedOpcode(Opcode first, Opcode second)
+	{
+		switch(first)
+		{
+			case LOAD_STACK_OFFS_CONST:
+				switch(second)
+				{
+					case LOAD_INT: return LOAD_LOCAL_INT;
+					case LOAD_FLOAT: return LOAD_LOCAL_FLOAT;
+					case LOAD_DOUBLE: return LOAD_LOCAL_DOUBLE;
+					case LOAD_ADDR: return LOAD_LOCAL_ADDR;
+					case STORE_INT: return STORE_LOCAL_INT;
+					case STORE_FLOAT: return STORE_LOCAL_FLOAT;
+					case STORE_DOUBLE: return STORE_LOCAL_DOUBLE;
+					case STORE_ADDR: return STORE_LOCAL_ADDR;
+					default: return OPCODE_COUNT;
+				}
+
+			case LOAD_VAL_CONST:
+				switch(second)
+				{
+					case ADD: return ADD_CONST;
+					case SUB: return SUB_CONST;
+					case MUL: return MUL_CONST;
+					default: return OPCODE_COUNT;
+				}
+
+			case LOAD_LABEL_CONST:
+				return second == JMP ? GOTO : OPCODE_COUNT;
+
+			case ILOAD_LABEL_CONST:
+				return second == IJMP ? GOTO : OPCODE_COUNT;
+
+			case ILOAD_FRAME_OFFS_CONST:
+				switch(second)
+				{
+					case ILOAD_LONG: return ILOAD_FRAME_LONG;
+					case ISTORE_LONG: return ISTORE_FRAME_LONG;
+					default: return OPCODE_COUNT;
+				}
+
+			case SUB:
+				if(second >= JE_CONST && second <= JLET_CONST)
+					return Opcode(second - JE_CONST + SUB_JE_CONST);
+				return OPCODE_COUNT;
+
+			default:
+				return OPCODE_COUNT;
+		}
+	}
+
+	bool fusePair()
+	{
+		if(windowSize < 2)
+			return false;
+
+		Instr first = window[windowSize - 2];
+		Instr second = window[windowSize - 1];
+		Opcode fused = fusedOpcode(first.opcode, second.opcode);
+
+		if(fused == OPCODE_COUNT)
+			return false;
+
+		rewind(windowSize - 2);
+		emit(fused, OPCODE_OPERANDS[first.opcode] != OPERAND_NONE ? first.operand : second.operand);
+		return true;
+	}
+
+	static bool isControlFlow(Opcode opcode)
+	{
+		return opcode == HALT || opcode == CALL_HOST || isJumpOpcode(opcode);
+	}
+
+	// LOAD_LABEL_CONST target; <code leaving one value above it>; Jxx
+	// becomes <code>; Jxx_CONST target.
+	bool fuseBranch()
+	{
+		if(windowSize < 2)
+			return false;
+
+		Opcode branch = window[windowSize - 1].opcode;
+
+		if(branch < JE || branch > JLET)
+			return false;
+
+		for(int i = windowSize - 2; i >= 0 && !isControlFlow(window[i].opcode); --i)
+		{
+			if(window[i].opcode != LOAD_LABEL_CONST || !leavesOneValue(i + 1, windowSize - 1))
+				continue;
+
+			Instr between[PEEPHOLE_WINDOW];
+			int count = windowSize - 2 - i;
+			Slot target = window[i].operand;
+
+			memcpy(between, window + i + 1, sizeof(Instr) * count);
+			rewind(i);
+
+			for(int j = 0; j < count; ++j)
+				emit(between[j].opcode, between[j].operand);
+
+			emit(Opcode(branch - JE + JE_CONST), target);
+			return true;
+		}
+
+		return false;
+	}
+
+	// True if window[first, last) never pops below its starting depth and
+	// ends exactly one value above it.
+	bool leavesOneValue(int first, int last)
+	{
+		int height = 0;
+
+		for(int i = first; i < last; ++i)
+		{
+			height -= OPCODE_POPS[window[i].opcode];
+
+			if(height < 0)
+				return false;
+
+			height += OPCODE_PUSHES[window[i].opcode];
+		}
+
+		return height == 1;
+	}
+
+private:
+	Program(Program const&);
+	Program& operator=(Program const&);
 };
 
-#endif
\ No newline at end of file
+#endif
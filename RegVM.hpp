@@ -0,0 +1,1287 @@
+#ifndef _REGVM_HPP_
+#define _REGVM_HPP_
+
+#include <algorithm>
+#include <climits>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "Opcode.hpp"
+#include "VMTypes.hpp"
+#include "Bytecode.hpp"
+#include "Bulk.hpp"
+#include "VM.hpp"
+
+// Register machine variant of the VM. Instructions name their operands
+// directly, so constants, local addresses and stack shuffling cost no
+// dispatch of their own. Code for it is produced by RegTranslator from
+// ordinary stack bytecode and runs on the same VM state: the gp stack, sp
+// and, at HALT, whatever the stack code would have left on the operand
+// stack.
+//
+// Every function runs in a register frame of its own: r0 is sp, r1 fp,
+// then one register per operand stack position of the function, then its
+// constants. A call copies the arguments and constants into a new frame
+// above the caller's, and the return copies the results back.
+
+// X(opcode, handler)
+#define REG_OPCODE_LIST(X) \
+    X(R_HALT, halt) X(R_GOTO, goto_) X(R_MOV, mov) \
+    X(R_JE, je) X(R_JNE, jne) X(R_JGT, jgt) X(R_JLT, jlt) X(R_JGET, jget) X(R_JLET, jlet) \
+    X(R_SJE, sje) X(R_SJNE, sjne) X(R_SJGT, sjgt) X(R_SJLT, sjlt) X(R_SJGET, sjget) X(R_SJLET, sjlet) \
+    X(R_IJE, ije) X(R_IJNE, ijne) X(R_IJGT, ijgt) X(R_IJLT, ijlt) X(R_IJGET, ijget) X(R_IJLET, ijlet) \
+    \
+    X(R_BAND, band) X(R_BOR, bor) X(R_BXOR, bxor) X(R_BSL1, bsl1) X(R_BSR1, bsr1) X(R_BSL, bsl) X(R_BSR, bsr) \
+    X(R_ADD, add) X(R_SUB, sub) X(R_MUL, mul) X(R_DIV, div) X(R_MOD, mod) \
+    X(R_IADD, iadd) X(R_ISUB, isub) X(R_IMUL, imul) X(R_IDIV, idiv) X(R_IMOD, imod) \
+    X(R_IAND, iand) X(R_IOR, ior) X(R_IXOR, ixor) X(R_ISHL, ishl) X(R_ISHR, ishr) \
+    X(R_FADD, fadd) X(R_FSUB, fsub) X(R_FMUL, fmul) X(R_FDIV, fdiv) \
+    X(R_I2D, i2d) X(R_D2I, d2i) X(R_F2D, f2d) X(R_D2F, d2f) X(R_I2F, i2f) X(R_F2I, f2i) \
+    \
+    X(R_LD_UCHAR, ld<unsigned char>) X(R_LD_USHORT, ld<unsigned short>) X(R_LD_ULONG, ld<unsigned long>) \
+    X(R_LD_UINT, ld<unsigned int>) X(R_LD_CHAR, ld<char>) X(R_LD_SHORT, ld<short>) X(R_LD_LONG, ld<long>) \
+    X(R_LD_INT, ld<int>) X(R_LD_FLOAT, ld<float>) X(R_LD_DOUBLE, ld<double>) X(R_LD_ADDR, ld<uintptr_t>) \
+    X(R_ST_UCHAR, st<unsigned char>) X(R_ST_USHORT, st<unsigned short>) X(R_ST_ULONG, st<unsigned long>) \
+    X(R_ST_UINT, st<unsigned int>) X(R_ST_CHAR, st<char>) X(R_ST_SHORT, st<short>) X(R_ST_LONG, st<long>) \
+    X(R_ST_INT, st<int>) X(R_ST_FLOAT, st<float>) X(R_ST_DOUBLE, st<double>) X(R_ST_ADDR, st<uintptr_t>) \
+    X(R_ILD_UCHAR, ild<unsigned char>) X(R_ILD_USHORT, ild<unsigned short>) X(R_ILD_ULONG, ild<unsigned long>) \
+    X(R_ILD_UINT, ild<unsigned int>) X(R_ILD_CHAR, ild<char>) X(R_ILD_SHORT, ild<short>) X(R_ILD_LONG, ild<long>) \
+    X(R_ILD_INT, ild<int>) X(R_ILD_ADDR, ild<intptr_t>) X(R_FLD_FLOAT, fld) \
+    X(R_IST_UCHAR, ist<unsigned char>) X(R_IST_USHORT, ist<unsigned short>) X(R_IST_ULONG, ist<unsigned long>) \
+    X(R_IST_UINT, ist<unsigned int>) X(R_IST_CHAR, ist<char>) X(R_IST_SHORT, ist<short>) X(R_IST_LONG, ist<long>) \
+    X(R_IST_INT, ist<int>) X(R_IST_ADDR, ist<intptr_t>) X(R_FST_FLOAT, fst) \
+    \
+    X(R_LEA, lea) X(R_LEA_D, lea_d) X(R_D2U, d2u) X(R_PUSHB_CONST, pushb_const) X(R_PUSHB, pushb) X(R_POPB, popb) \
+    \
+    X(R_CALL, call) X(R_CALL_LEAF, call_leaf) X(R_RET, ret) X(R_RET_LEAF, ret_leaf) X(R_BULK, bulk)
+
+#define REG_OPCODE_ENUM_ENTRY(op, handler) op,
+#define REG_OPCODE_NAME_ENTRY(op, handler) #op,
+
+enum RegOpcode {
+    REG_OPCODE_LIST(REG_OPCODE_ENUM_ENTRY)
+    REG_OPCODE_COUNT
+};
+
+inline char const* regOpcodeName(int op)
+{
+    static char const* const names[] = {
+        REG_OPCODE_LIST(REG_OPCODE_NAME_ENTRY)
+    };
+
+    return names[op];
+}
+
+// Three-address instruction. Memory ops address [r[a] + imm] and store
+// r[b]; branches jump to instruction index imm; HALT leaves the imm
+// stack registers on the operand stack. Calls take the arguments from r[dst]
+// up, put the callee's frame a registers above the caller's and name the
+// callee in imm; returns hand back imm registers. Bulk ops take their
+// operands from r[a] up and run opcode imm.
+struct RegInstr {
+    uint16_t op;
+    uint16_t dst;
+    uint16_t a;
+    uint16_t b;
+    int32_t imm;
+};
+
+#define REG_SP 0
+#define REG_FP 1
+
+// A function of the register program. Its frame holds arity arguments at
+// the bottom of its stackRegs operand stack registers, and the constants
+// from constBegin on.
+struct RegFunction {
+    uint32_t entry;
+    int arity;
+    int stackRegs;
+    uint32_t constBegin;
+    uint32_t constCount;
+
+    int constBase() const
+    {
+        return 2 + stackRegs;
+    }
+
+    int registerCount() const
+    {
+        return constBase() + (int) constCount;
+    }
+};
+
+// functions[0] is where runs start.
+struct RegProgram {
+    std::vector<RegInstr> code;
+    std::vector<Slot> constants;
+    std::vector<RegFunction> functions;
+
+    void dump(FILE* out) const
+    {
+        for (size_t i = 0; i < code.size(); ++i)
+        {
+            RegInstr const& in = code[i];
+            fprintf(out, "%4zu %-12s r%u, r%u, r%u, %d\n", i, regOpcodeName(in.op), in.dst, in.a, in.b, in.imm);
+        }
+    }
+};
+
+// **************
+// * TRANSLATOR *
+// **************
+
+// Turns stack bytecode into register code. The code from entry and every
+// CALL or CALL_LEAF target is a function with a register frame of its own,
+// where operand stack position i, counted from the lowest argument the
+// function takes, maps to register 2 + i. Constants and sp- or fp-relative
+// addresses are kept as pending operands and folded into the instruction
+// that consumes them, and are only written to their stack register at jump
+// targets and before jumps and calls, where every path must agree on the
+// layout. A 64-bit reload right after a store reuses the stored register.
+// The code must start at entry with an empty operand stack, use only
+// constant jump targets, make no host calls and have the same stack depth
+// on every path into a label; a function must be called only with CALL and
+// return with RET, or only with CALL_LEAF and RET_LEAF, at one stack depth,
+// share no code with another and not HALT. Otherwise translate() fails and
+// the stack engines have to run it.
+struct RegTranslator {
+    struct Entry {
+        enum Kind {
+            REG, CONST, SP_VALUE, SP_INT, FP_INT,
+        };
+
+        Kind kind;
+        Slot value;
+        int32_t offs;
+    };
+
+    // What the depth walk finds out about a function. Depths are relative
+    // to its entry, so they go below zero where it takes arguments.
+    struct Function {
+        size_t start;
+        bool leaf;
+        int minDepth;
+        int maxDepth;
+        int retDepth;
+        // Calls into it, by index in calls, that wait for retDepth.
+        std::vector<size_t> waiting;
+        std::map<int64_t, int> constIndex;
+        std::vector<Slot> constants;
+    };
+
+    struct CallSite {
+        uint8_t const* ip;
+        int depth;
+        int caller;
+        int callee;
+    };
+
+    enum {
+        UNSEEN = INT_MIN,
+    };
+
+    uint8_t const* code;
+    size_t size;
+    size_t entry;
+    RegProgram& prog;
+    std::string error;
+
+    std::vector<int> depthAt;
+    std::vector<int> functionAt;
+    std::vector<bool> isLeader;
+    std::vector<int> regIndexAt;
+    std::vector<Function> functions;
+    std::map<size_t, int> functionStarting;
+    std::vector<CallSite> calls;
+    std::vector<std::pair<size_t, uint32_t> > fixups;
+    // Calls whose a needs the caller's final frame size.
+    std::vector<std::pair<size_t, int> > frameFixups;
+    std::vector<Entry> stack;
+    size_t lastStore;
+    // Function being translated.
+    int current;
+
+    RegTranslator(uint8_t const* pCode, size_t pSize, RegProgram& pProg, size_t pEntry = 0): code(pCode),
+            size(pSize), entry(pEntry), prog(pProg), depthAt(pSize + 1, UNSEEN), functionAt(pSize + 1, -1),
+            isLeader(pSize + 1, false), regIndexAt(pSize + 1, -1), lastStore(SIZE_MAX), current(0)
+    {
+    }
+
+    bool fail(std::string const& msg, uint8_t const* ip)
+    {
+        error = msg + " at offset " + std::to_string(ip - code);
+        return false;
+    }
+
+    static bool isSupported(Opcode op)
+    {
+        return !(op >= JMP && op <= JLET) && op != IJMP && op != LOAD_LABEL_CONST && op != ILOAD_LABEL_CONST
+                && op != CALL_HOST;
+    }
+
+    int arity(int fn) const
+    {
+        return -functions[fn].minDepth;
+    }
+
+    int stackRegs(int fn) const
+    {
+        return functions[fn].maxDepth + arity(fn);
+    }
+
+    int constBase(int fn) const
+    {
+        return 2 + stackRegs(fn);
+    }
+
+    // The function starting at offs, added on its first call.
+    int functionFor(size_t offs, bool leaf)
+    {
+        auto found = functionStarting.find(offs);
+
+        if (found != functionStarting.end())
+            return found->second;
+
+        Function fn;
+        fn.start = offs;
+        fn.leaf = leaf;
+        fn.minDepth = 0;
+        fn.maxDepth = 0;
+        fn.retDepth = UNSEEN;
+        functions.push_back(fn);
+        functionStarting[offs] = functions.size() - 1;
+        return functions.size() - 1;
+    }
+
+    // Queues offs in function fn with depth, or checks it against what an
+    // earlier path found.
+    bool reach(size_t offs, int depth, int fn, uint8_t const* from, std::vector<size_t>& work)
+    {
+        if (offs > size)
+            return fail("Code runs off the end", from);
+
+        if (depthAt[offs] == UNSEEN)
+        {
+            depthAt[offs] = depth;
+            functionAt[offs] = fn;
+            work.push_back(offs);
+        }
+        else if (functionAt[offs] != fn)
+            return fail("Code shared between functions", code + offs);
+        else if (depthAt[offs] != depth)
+            return fail("Stack depth differs between paths", code + offs);
+
+        return true;
+    }
+
+    // Stack depth on entry to every reachable instruction, and the function
+    // it belongs to. Unsupported opcodes are rejected in a linear pass
+    // first, so code the depth walk cannot follow is reported by what stops
+    // it. A call continues once the callee's first return gives its depth.
+    bool analyze()
+    {
+        std::vector<bool> isStart(size + 1, false);
+
+        for (uint8_t const* ip = code; ip <= code + size; ip = nextInstr(ip))
+        {
+            isStart[ip - code] = true;
+
+            if (!isSupported(Opcode(*ip)))
+                return fail(std::string("Cannot translate ") + OPCODE_NAMES[*ip], ip);
+        }
+
+        if (entry > size || !isStart[entry])
+            return fail("Entry is not an instruction", code + std::min(entry, size));
+
+        std::vector<size_t> work;
+        functionFor(entry, false);
+        isLeader[entry] = true;
+
+        if (!reach(entry, 0, 0, code + entry, work))
+            return false;
+
+        while (!work.empty())
+        {
+            uint8_t const* ip = code + work.back();
+            work.pop_back();
+
+            Opcode op = Opcode(*ip);
+            int depth = depthAt[ip - code];
+            int fn = functionAt[ip - code];
+            size_t next = nextInstr(ip) - code;
+
+            if (fn == 0 && depth < OPCODE_POPS[op])
+                return fail("Operand stack underflow", ip);
+
+            int after = depth - OPCODE_POPS[op] + OPCODE_PUSHES[op];
+            functions[fn].minDepth = std::min(functions[fn].minDepth, depth - OPCODE_POPS[op]);
+            functions[fn].maxDepth = std::max(functions[fn].maxDepth, depth + OPCODE_PUSHES[op]);
+
+            if (op == HALT)
+            {
+                if (fn != 0)
+                    return fail("HALT inside a function", ip);
+            }
+            else if (op == CALL || op == CALL_LEAF)
+            {
+                size_t target = readOperand(ip).i;
+
+                if (target > size || !isStart[target])
+                    return fail("Call into the middle of an instruction", ip);
+
+                int callee = functionFor(target, op == CALL_LEAF);
+
+                if (functions[callee].leaf != (op == CALL_LEAF))
+                    return fail("Function called with both CALL and CALL_LEAF", ip);
+
+                CallSite site = {ip, depth, fn, callee};
+                calls.push_back(site);
+                isLeader[target] = true;
+
+                if (next <= size)
+                    isLeader[next] = true;
+
+                if (!reach(target, 0, callee, ip, work))
+                    return false;
+
+                if (functions[callee].retDepth == UNSEEN)
+                    functions[callee].waiting.push_back(calls.size() - 1);
+                else if (!reach(next, depth + functions[callee].retDepth, fn, ip, work))
+                    return false;
+            }
+            else if (op == RET || op == RET_LEAF)
+            {
+                Function& f = functions[fn];
+
+                if (fn == 0)
+                    return fail("Return outside a function", ip);
+
+                if (f.leaf != (op == RET_LEAF))
+                    return fail("Return does not match the call", ip);
+
+                if (f.retDepth != UNSEEN && f.retDepth != depth)
+                    return fail("Stack depth differs between returns", ip);
+
+                if (f.retDepth == UNSEEN)
+                {
+                    f.retDepth = depth;
+
+                    for (size_t call : f.waiting)
+                    {
+                        CallSite const& site = calls[call];
+
+                        if (!reach(nextInstr(site.ip) - code, site.depth + depth, site.caller, site.ip, work))
+                            return false;
+                    }
+
+                    f.waiting.clear();
+                }
+            }
+            else
+            {
+                if (op != GOTO && !reach(next, after, fn, ip, work))
+                    return false;
+
+                // Only branches with a constant target get past isSupported.
+                if (isBranchOpcode(op))
+                {
+                    size_t target = readOperand(ip).i;
+
+                    if (target > size || !isStart[target])
+                        return fail("Jump into the middle of an instruction", ip);
+
+                    isLeader[target] = true;
+
+                    if (!reach(target, after, fn, ip, work))
+                        return false;
+                }
+            }
+        }
+
+        // The stack code lets a callee reach below its caller's values;
+        // separate frames do not.
+        for (CallSite const& site : calls)
+            if (site.depth + arity(site.caller) < arity(site.callee))
+                return fail("Call with fewer operands than the function takes", site.ip);
+
+        return true;
+    }
+
+    // Operands.
+
+    static uint16_t stackReg(int pos)
+    {
+        return 2 + pos;
+    }
+
+    uint16_t constReg(Slot value)
+    {
+        Function& fn = functions[current];
+        auto found = fn.constIndex.find(value.i);
+
+        if (found != fn.constIndex.end())
+            return constBase(current) + found->second;
+
+        fn.constIndex[value.i] = fn.constants.size();
+        fn.constants.push_back(value);
+        return constBase(current) + fn.constants.size() - 1;
+    }
+
+    uint16_t constInt(int64_t i)
+    {
+        Slot value;
+        value.i = i;
+        return constReg(value);
+    }
+
+    void emit(RegOpcode op, int dst, int a = 0, int b = 0, int32_t imm = 0)
+    {
+        RegInstr in = {(uint16_t) op, (uint16_t) dst, (uint16_t) a, (uint16_t) b, imm};
+        prog.code.push_back(in);
+    }
+
+    void materialize(int pos)
+    {
+        Entry& e = stack[pos];
+
+        switch (e.kind)
+        {
+            case Entry::CONST: emit(R_MOV, stackReg(pos), constReg(e.value)); break;
+            case Entry::SP_VALUE: emit(R_LEA_D, stackReg(pos), REG_SP, 0, e.offs); break;
+            case Entry::SP_INT: emit(R_LEA, stackReg(pos), REG_SP, 0, e.offs); break;
+            case Entry::FP_INT: emit(R_LEA, stackReg(pos), REG_FP, 0, e.offs); break;
+            default: break;
+        }
+
+        e.kind = Entry::REG;
+    }
+
+    void flush()
+    {
+        for (size_t pos = 0; pos < stack.size(); ++pos)
+            materialize(pos);
+    }
+
+    // Pending sp-relative addresses must be taken before sp moves.
+    void flushSp()
+    {
+        for (size_t pos = 0; pos < stack.size(); ++pos)
+            if (stack[pos].kind == Entry::SP_VALUE || stack[pos].kind == Entry::SP_INT)
+                materialize(pos);
+    }
+
+    // Register holding the value at pos, folding constants.
+    uint16_t use(int pos)
+    {
+        if (stack[pos].kind == Entry::CONST)
+            return constReg(stack[pos].value);
+
+        materialize(pos);
+        return stackReg(pos);
+    }
+
+    int top(int n = 1) const
+    {
+        return (int) stack.size() - n;
+    }
+
+    void pop(int n = 1)
+    {
+        stack.resize(stack.size() - n);
+    }
+
+    void push(Entry::Kind kind, Slot value = Slot(), int32_t offs = 0)
+    {
+        Entry e = {kind, value, offs};
+        stack.push_back(e);
+    }
+
+    void pushReg()
+    {
+        push(Entry::REG);
+    }
+
+    // Base register and displacement of the address at pos. Generic ops
+    // hold addresses as doubles, typed ones as integers.
+    void address(int pos, bool asDouble, uint16_t& base, int32_t& disp)
+    {
+        Entry const& e = stack[pos];
+        disp = 0;
+
+        if (e.kind == (asDouble ? Entry::SP_VALUE : Entry::SP_INT) || (!asDouble && e.kind == Entry::FP_INT))
+        {
+            base = e.kind == Entry::FP_INT ? REG_FP : REG_SP;
+            disp = e.offs;
+        }
+        else if (e.kind == Entry::CONST)
+            base = constInt(asDouble ? (intptr_t) (uintptr_t) e.value.d : e.value.i);
+        else if (asDouble)
+        {
+            emit(R_D2U, stackReg(pos), use(pos));
+            base = stackReg(pos);
+        }
+        else
+            base = use(pos);
+    }
+
+    void binary(RegOpcode op)
+    {
+        uint16_t b = use(top(1));
+        uint16_t a = use(top(2));
+        pop(2);
+        emit(op, stackReg(top(0)), a, b);
+        pushReg();
+    }
+
+    void binaryConst(RegOpcode op, Value lit)
+    {
+        Slot value;
+        value.d = lit;
+        uint16_t a = use(top(1));
+        pop();
+        emit(op, stackReg(top(0)), a, constReg(value));
+        pushReg();
+    }
+
+    void unary(RegOpcode op)
+    {
+        uint16_t a = use(top(1));
+        pop();
+        emit(op, stackReg(top(0)), a);
+        pushReg();
+    }
+
+    static RegOpcode storeFor(RegOpcode load)
+    {
+        switch (load)
+        {
+            case R_LD_DOUBLE: return R_ST_DOUBLE;
+            case R_ILD_ADDR: return R_IST_ADDR;
+            case R_ILD_LONG: return sizeof (long) == 8 ? R_IST_LONG : R_HALT;
+            case R_ILD_ULONG: return sizeof (long) == 8 ? R_IST_ULONG : R_HALT;
+            default: return R_HALT;
+        }
+    }
+
+    // Pushes the value just stored to [base + disp] instead of reloading
+    // it, if nothing ran since the store and the store and load round
+    // trip exactly.
+    bool forward(RegOpcode load, uint16_t base, int32_t disp)
+    {
+        if (lastStore == SIZE_MAX || lastStore + 1 != prog.code.size())
+            return false;
+
+        RegInstr const& st = prog.code[lastStore];
+
+        if (st.op != storeFor(load) || st.a != base || st.imm != disp)
+            return false;
+
+        if (st.b >= constBase(current))
+            constant(functions[current].constants[st.b - constBase(current)]);
+        else
+        {
+            if (st.b != stackReg(top(0)))
+                emit(R_MOV, stackReg(top(0)), st.b);
+
+            pushReg();
+        }
+
+        return true;
+    }
+
+    void load(RegOpcode op, bool asDouble)
+    {
+        uint16_t base;
+        int32_t disp;
+        address(top(1), asDouble, base, disp);
+        pop();
+
+        if (forward(op, base, disp))
+            return;
+
+        emit(op, stackReg(top(0)), base, 0, disp);
+        pushReg();
+    }
+
+    // A load from [sp + offs] or [fp + offs].
+    void loadLocal(RegOpcode op, uint16_t base, int32_t offs)
+    {
+        if (forward(op, base, offs))
+            return;
+
+        emit(op, stackReg(top(0)), base, 0, offs);
+        pushReg();
+    }
+
+    void store(RegOpcode op, bool asDouble)
+    {
+        uint16_t value = use(top(2));
+        uint16_t base;
+        int32_t disp;
+        address(top(1), asDouble, base, disp);
+        pop(2);
+        emit(op, 0, base, value, disp);
+        lastStore = prog.code.size() - 1;
+    }
+
+    void storeLocal(RegOpcode op, uint16_t base, int32_t offs)
+    {
+        uint16_t value = use(top(1));
+        pop();
+        emit(op, 0, base, value, offs);
+        lastStore = prog.code.size() - 1;
+    }
+
+    void branch(RegOpcode op, int operands, uint32_t target)
+    {
+        uint16_t b = operands == 2 ? use(top(1)) : 0;
+        uint16_t a = use(top(operands));
+        pop(operands);
+        flush();
+        fixups.push_back(std::make_pair(prog.code.size(), target));
+        emit(op, 0, a, b);
+    }
+
+    void constant(Slot value)
+    {
+        push(Entry::CONST, value);
+    }
+
+    // The callee's frame goes past all of the caller's registers, a count
+    // only known once the caller is translated.
+    void call(RegOpcode op, uint32_t target)
+    {
+        int callee = functionStarting[target];
+        flush();
+        frameFixups.push_back(std::make_pair(prog.code.size(), current));
+        emit(op, stackReg(top(arity(callee))), 0, 0, callee);
+    }
+
+    // Bulk ops read their operands from consecutive registers.
+    void bulk(Opcode op)
+    {
+        int operands = OPCODE_POPS[op];
+
+        for (int pos = top(operands); pos < top(0); ++pos)
+            materialize(pos);
+
+        pop(operands);
+        emit(R_BULK, stackReg(top(0)), stackReg(top(0)), 0, op);
+
+        if (OPCODE_PUSHES[op])
+            pushReg();
+    }
+
+    void translateInstr(uint8_t const* ip)
+    {
+        Opcode op = Opcode(*ip);
+        Slot imm = readOperand(ip);
+        Slot value;
+        value.i = 0;
+
+        switch (op)
+        {
+            case HALT:
+                flush();
+                emit(R_HALT, 0, 0, 0, stack.size());
+                break;
+
+            case GOTO:
+                flush();
+                fixups.push_back(std::make_pair(prog.code.size(), (uint32_t) imm.i));
+                emit(R_GOTO, 0);
+                break;
+
+            case BSL1: case BSR1:
+                unary(RegOpcode(R_BAND + (op - BAND)));
+                break;
+
+            case BAND: case BOR: case BXOR: case BSL: case BSR:
+            case ADD: case SUB: case MUL: case DIV: case MOD:
+                binary(RegOpcode(R_BAND + (op - BAND)));
+                break;
+
+            case LOAD_UCHAR: case LOAD_USHORT: case LOAD_ULONG: case LOAD_UINT: case LOAD_CHAR:
+            case LOAD_SHORT: case LOAD_LONG: case LOAD_INT: case LOAD_FLOAT: case LOAD_DOUBLE: case LOAD_ADDR:
+                load(RegOpcode(R_LD_UCHAR + (op - LOAD_UCHAR)), true);
+                break;
+
+            case LOAD_VAL_CONST:
+                constant(imm);
+                break;
+
+            case LOAD_VAL_CONST8:
+                value.d = (Value) imm.i;
+                constant(value);
+                break;
+
+            case LOAD_ADDR_CONST:
+                value.d = (uintptr_t) imm.a;
+                constant(value);
+                break;
+
+            case LOAD_STACK_OFFS_CONST:
+                push(Entry::SP_VALUE, value, (int32_t) imm.i);
+                break;
+
+            case STORE_UCHAR: case STORE_USHORT: case STORE_ULONG: case STORE_UINT: case STORE_CHAR:
+            case STORE_SHORT: case STORE_LONG: case STORE_INT: case STORE_FLOAT: case STORE_DOUBLE: case STORE_ADDR:
+                store(RegOpcode(R_ST_UCHAR + (op - STORE_UCHAR)), true);
+                break;
+
+            case PUSHB_CONST:
+                flushSp();
+                emit(R_PUSHB_CONST, REG_SP, REG_SP, 0, (int32_t) imm.i);
+                break;
+
+            case POPB_CONST:
+                flushSp();
+                emit(R_ISUB, REG_SP, REG_SP, constInt((int32_t) imm.i));
+                break;
+
+            case PUSHB: case POPB:
+            {
+                uint16_t bytes = use(top(1));
+                pop();
+                flushSp();
+                emit(op == PUSHB ? R_PUSHB : R_POPB, REG_SP, bytes);
+                break;
+            }
+
+            case LOAD_LOCAL_INT: case LOAD_LOCAL_FLOAT: case LOAD_LOCAL_DOUBLE: case LOAD_LOCAL_ADDR:
+            {
+                static RegOpcode const loads[] = {R_LD_INT, R_LD_FLOAT, R_LD_DOUBLE, R_LD_ADDR};
+                loadLocal(loads[op - LOAD_LOCAL_INT], REG_SP, (int32_t) imm.i);
+                break;
+            }
+
+            case STORE_LOCAL_INT: case STORE_LOCAL_FLOAT: case STORE_LOCAL_DOUBLE: case STORE_LOCAL_ADDR:
+            {
+                static RegOpcode const stores[] = {R_ST_INT, R_ST_FLOAT, R_ST_DOUBLE, R_ST_ADDR};
+                storeLocal(stores[op - STORE_LOCAL_INT], REG_SP, (int32_t) imm.i);
+                break;
+            }
+
+            case ADD_CONST: binaryConst(R_ADD, imm.d); break;
+            case SUB_CONST: binaryConst(R_SUB, imm.d); break;
+            case MUL_CONST: binaryConst(R_MUL, imm.d); break;
+            case ADD_CONST8: binaryConst(R_ADD, imm.i); break;
+            case SUB_CONST8: binaryConst(R_SUB, imm.i); break;
+
+            case JE_CONST: case JNE_CONST: case JGT_CONST: case JLT_CONST: case JGET_CONST: case JLET_CONST:
+                branch(RegOpcode(R_JE + (op - JE_CONST)), 1, imm.i);
+                break;
+
+            case SUB_JE_CONST: case SUB_JNE_CONST: case SUB_JGT_CONST:
+            case SUB_JLT_CONST: case SUB_JGET_CONST: case SUB_JLET_CONST:
+                branch(RegOpcode(R_SJE + (op - SUB_JE_CONST)), 2, imm.i);
+                break;
+
+            case IJE_CONST: case IJNE_CONST: case IJGT_CONST: case IJLT_CONST: case IJGET_CONST: case IJLET_CONST:
+                branch(RegOpcode(R_IJE + (op - IJE_CONST)), 1, imm.i);
+                break;
+
+            case IADD: case ISUB: case IMUL: case IDIV: case IMOD:
+            case IAND: case IOR: case IXOR: case ISHL: case ISHR:
+                binary(RegOpcode(R_IADD + (op - IADD)));
+                break;
+
+            case FADD: case FSUB: case FMUL: case FDIV:
+                binary(RegOpcode(R_FADD + (op - FADD)));
+                break;
+
+            case I2D: case D2I: case F2D: case D2F: case I2F: case F2I:
+                unary(RegOpcode(R_I2D + (op - I2D)));
+                break;
+
+            case ILOAD_UCHAR: case ILOAD_USHORT: case ILOAD_ULONG: case ILOAD_UINT: case ILOAD_CHAR:
+            case ILOAD_SHORT: case ILOAD_LONG: case ILOAD_INT: case ILOAD_ADDR: case FLOAD_FLOAT:
+                load(RegOpcode(R_ILD_UCHAR + (op - ILOAD_UCHAR)), false);
+                break;
+
+            case DLOAD_DOUBLE:
+                load(R_LD_DOUBLE, false);
+                break;
+
+            case ILOAD_CONST: case ILOAD_CONST32:
+                constant(imm);
+                break;
+
+            case ILOAD_ADDR_CONST:
+                value.i = (intptr_t) imm.a;
+                constant(value);
+                break;
+
+            case ILOAD_STACK_OFFS_CONST:
+                push(Entry::SP_INT, value, (int32_t) imm.i);
+                break;
+
+            case FLOAD_CONST:
+                value.f = imm.f;
+                constant(value);
+                break;
+
+            case ISTORE_UCHAR: case ISTORE_USHORT: case ISTORE_ULONG: case ISTORE_UINT: case ISTORE_CHAR:
+            case ISTORE_SHORT: case ISTORE_LONG: case ISTORE_INT: case ISTORE_ADDR: case FSTORE_FLOAT:
+                store(RegOpcode(R_IST_UCHAR + (op - ISTORE_UCHAR)), false);
+                break;
+
+            case DSTORE_DOUBLE:
+                store(R_ST_DOUBLE, false);
+                break;
+
+            case CALL: case CALL_LEAF:
+                call(op == CALL ? R_CALL : R_CALL_LEAF, imm.i);
+                break;
+
+            case RET: case RET_LEAF:
+                flush();
+                emit(op == RET ? R_RET : R_RET_LEAF, 0, 0, 0, stack.size());
+                break;
+
+            case ILOAD_FRAME_OFFS_CONST:
+                push(Entry::FP_INT, value, (int32_t) imm.i);
+                break;
+
+            case ILOAD_FRAME_LONG:
+                loadLocal(R_ILD_LONG, REG_FP, (int32_t) imm.i);
+                break;
+
+            case ISTORE_FRAME_LONG:
+                storeLocal(R_IST_LONG, REG_FP, (int32_t) imm.i);
+                break;
+
+            case BLOCK_COPY: case BLOCK_FILL: case ISUM_INT: case IMIN_INT: case IMAX_INT: case IDOT_INT:
+            case FSUM_FLOAT: case FMIN_FLOAT: case FMAX_FLOAT: case FDOT_FLOAT:
+            case DSUM_DOUBLE: case DMIN_DOUBLE: case DMAX_DOUBLE: case DDOT_DOUBLE:
+                bulk(op);
+                break;
+
+            default:
+                break;
+        }
+    }
+
+    bool translate()
+    {
+        if (!analyze())
+            return false;
+
+        bool fallsThrough = false;
+
+        for (uint8_t const* ip = code; ip <= code + size; ip = nextInstr(ip))
+        {
+            size_t offs = ip - code;
+
+            if (depthAt[offs] == UNSEEN)
+            {
+                fallsThrough = false;
+                continue;
+            }
+
+            if (isLeader[offs] || !fallsThrough)
+            {
+                if (fallsThrough)
+                    flush();
+
+                current = functionAt[offs];
+                stack.assign(depthAt[offs] + arity(current), Entry{Entry::REG, Slot(), 0});
+                lastStore = SIZE_MAX;
+            }
+
+            regIndexAt[offs] = prog.code.size();
+            translateInstr(ip);
+
+            Opcode op = Opcode(*ip);
+            fallsThrough = op != HALT && op != GOTO && !isCallOpcode(op);
+        }
+
+        for (auto const& fixup : fixups)
+            prog.code[fixup.first].imm = regIndexAt[fixup.second];
+
+        for (size_t fn = 0; fn < functions.size(); ++fn)
+        {
+            RegFunction out;
+            out.entry = regIndexAt[functions[fn].start];
+            out.arity = arity(fn);
+            out.stackRegs = stackRegs(fn);
+            out.constBegin = prog.constants.size();
+            out.constCount = functions[fn].constants.size();
+            prog.constants.insert(prog.constants.end(), functions[fn].constants.begin(),
+                    functions[fn].constants.end());
+            prog.functions.push_back(out);
+
+            if (out.registerCount() > 0xffff)
+                return fail("Too many registers", code + functions[fn].start);
+        }
+
+        for (auto const& fixup : frameFixups)
+            prog.code[fixup.first].a = prog.functions[fixup.second].registerCount();
+
+        return true;
+    }
+};
+
+// *************
+// * EXECUTION *
+// *************
+
+// Runs register code against vm. Like the stack engines, the state lives
+// in a local so the compiler can keep r and ip in registers.
+struct RegInterpreter {
+    // A caller waiting for its callee: where it resumes, where its frame
+    // starts in regs and the register the results go to.
+    struct Frame {
+        RegInstr const* ret;
+        size_t base;
+        uint16_t results;
+    };
+
+    std::vector<Slot> regs;
+    Slot* r;
+    RegInstr const* code;
+    RegInstr const* ip;
+    RegFunction const* functions;
+    Slot const* constants;
+    std::vector<Frame> frames;
+    int haltDepth;
+    VM& vm;
+    uint8_t* spLimit;
+
+    RegInterpreter(VM& pVm, RegProgram const& prog): regs(prog.functions[0].registerCount()), r(regs.data()),
+            code(prog.code.data()), ip(code + prog.functions[0].entry), functions(prog.functions.data()),
+            constants(prog.constants.data()), haltDepth(0), vm(pVm), spLimit(pVm.gpLimit)
+    {
+        RegFunction const& main = functions[0];
+        r[REG_SP].i = (intptr_t) pVm.sp;
+        r[REG_FP].i = (intptr_t) pVm.fp;
+        std::copy(constants + main.constBegin, constants + main.constBegin + main.constCount, r + main.constBase());
+    }
+
+    void save()
+    {
+        vm.sp = (uint8_t*) r[REG_SP].i;
+
+        for (int i = 0; i < haltDepth; ++i)
+            *vm.opStack.top++ = r[2 + i];
+
+        vm.ip = nullptr;
+    }
+
+#define REG_SWITCH_CASE(op, handler) \
+    case op: in.handler(i); break;
+
+    static void runSwitch(VM& vm, RegProgram const& prog)
+    {
+        RegInterpreter in(vm, prog);
+
+        while (in.ip)
+        {
+            RegInstr const& i = *in.ip++;
+
+            switch (i.op)
+            {
+                REG_OPCODE_LIST(REG_SWITCH_CASE)
+            }
+        }
+
+        in.save();
+    }
+
+#ifdef VM_HAS_THREADED_DISPATCH
+#define REG_THREADED_ADDR(op, handler) &&L_##op,
+
+#define REG_THREADED_BODY(opcode, handler) \
+    L_##opcode: { \
+        RegInstr const& i = *in.ip++; \
+        in.handler(i); \
+        if (opcode == R_HALT) goto done; \
+        goto *dispatchTable[in.ip->op]; \
+    }
+
+    static void runThreaded(VM& vm, RegProgram const& prog)
+    {
+        static void* const dispatchTable[REG_OPCODE_COUNT] = {
+            REG_OPCODE_LIST(REG_THREADED_ADDR)
+        };
+
+        RegInterpreter in(vm, prog);
+
+        goto *dispatchTable[in.ip->op];
+        REG_OPCODE_LIST(REG_THREADED_BODY)
+
+    done:
+        in.save();
+    }
+#endif
+
+    static void run(VM& vm, RegProgram const& prog)
+    {
+#ifdef VM_THREADED_DISPATCH
+        runThreaded(vm, prog);
+#else
+        runSwitch(vm, prog);
+#endif
+    }
+
+    // Handlers mirror the stack handlers in VM.hpp operand for operand.
+
+    void halt(RegInstr const& i)
+    {
+        haltDepth = i.imm;
+        ip = nullptr;
+    }
+
+    void goto_(RegInstr const& i)
+    {
+        ip = code + i.imm;
+    }
+
+    void mov(RegInstr const& i)
+    {
+        r[i.dst] = r[i.a];
+    }
+
+#define REG_BRANCH(name, cond) \
+    void name(RegInstr const& i) \
+    { \
+        if (cond) \
+            ip = code + i.imm; \
+    }
+
+    REG_BRANCH(je, r[i.a].d == 0)
+    REG_BRANCH(jne, r[i.a].d != 0)
+    REG_BRANCH(jgt, r[i.a].d > 0)
+    REG_BRANCH(jlt, r[i.a].d < 0)
+    REG_BRANCH(jget, r[i.a].d >= 0)
+    REG_BRANCH(jlet, r[i.a].d <= 0)
+    REG_BRANCH(sje, r[i.a].d - r[i.b].d == 0)
+    REG_BRANCH(sjne, r[i.a].d - r[i.b].d != 0)
+    REG_BRANCH(sjgt, r[i.a].d - r[i.b].d > 0)
+    REG_BRANCH(sjlt, r[i.a].d - r[i.b].d < 0)
+    REG_BRANCH(sjget, r[i.a].d - r[i.b].d >= 0)
+    REG_BRANCH(sjlet, r[i.a].d - r[i.b].d <= 0)
+    REG_BRANCH(ije, r[i.a].i == 0)
+    REG_BRANCH(ijne, r[i.a].i != 0)
+    REG_BRANCH(ijgt, r[i.a].i > 0)
+    REG_BRANCH(ijlt, r[i.a].i < 0)
+    REG_BRANCH(ijget, r[i.a].i >= 0)
+    REG_BRANCH(ijlet, r[i.a].i <= 0)
+
+#define REG_OP(name, view, expr) \
+    void name(RegInstr const& i) \
+    { \
+        r[i.dst].view = expr; \
+    }
+
+    REG_OP(band, d, (int) r[i.a].d & (int) r[i.b].d)
+    REG_OP(bor, d, (int) r[i.a].d | (int) r[i.b].d)
+    REG_OP(bxor, d, (int) r[i.a].d ^ (int) r[i.b].d)
+    REG_OP(bsl1, d, (int) r[i.a].d << 1)
+    REG_OP(bsr1, d, (int) r[i.a].d >> 1)
+    REG_OP(bsl, d, (int) r[i.a].d << (int) r[i.b].d)
+    REG_OP(bsr, d, (int) r[i.a].d >> (int) r[i.b].d)
+    REG_OP(add, d, r[i.a].d + r[i.b].d)
+    REG_OP(sub, d, r[i.a].d - r[i.b].d)
+    REG_OP(mul, d, r[i.a].d * r[i.b].d)
+    REG_OP(div, d, r[i.a].d / r[i.b].d)
+    REG_OP(mod, d, (int) r[i.a].d % (int) r[i.b].d)
+
+    REG_OP(iadd, i, r[i.a].i + r[i.b].i)
+    REG_OP(isub, i, r[i.a].i - r[i.b].i)
+    REG_OP(imul, i, r[i.a].i * r[i.b].i)
+    REG_OP(idiv, i, r[i.a].i / r[i.b].i)
+    REG_OP(imod, i, r[i.a].i % r[i.b].i)
+    REG_OP(iand, i, r[i.a].i & r[i.b].i)
+    REG_OP(ior, i, r[i.a].i | r[i.b].i)
+    REG_OP(ixor, i, r[i.a].i ^ r[i.b].i)
+    REG_OP(ishl, i, r[i.a].i << r[i.b].i)
+    REG_OP(ishr, i, r[i.a].i >> r[i.b].i)
+
+    REG_OP(fadd, f, r[i.a].f + r[i.b].f)
+    REG_OP(fsub, f, r[i.a].f - r[i.b].f)
+    REG_OP(fmul, f, r[i.a].f * r[i.b].f)
+    REG_OP(fdiv, f, r[i.a].f / r[i.b].f)
+
+    // Conversions keep the untouched bits of the source slot, as the
+    // stack versions do.
+#define REG_CONVERT(name, from, to, type) \
+    void name(RegInstr const& i) \
+    { \
+        Slot slot = r[i.a]; \
+        slot.to = (type) slot.from; \
+        r[i.dst] = slot; \
+    }
+
+    REG_CONVERT(i2d, i, d, double)
+    REG_CONVERT(d2i, d, i, int64_t)
+    REG_CONVERT(f2d, f, d, double)
+    REG_CONVERT(d2f, d, f, float)
+    REG_CONVERT(i2f, i, f, float)
+    REG_CONVERT(f2i, f, i, int64_t)
+
+    uint8_t* addr(RegInstr const& i)
+    {
+        return (uint8_t*) r[i.a].i + i.imm;
+    }
+
+    template <typename T>
+    void ld(RegInstr const& i)
+    {
+        r[i.dst].d = *(T*) addr(i);
+    }
+
+    template <typename T>
+    void st(RegInstr const& i)
+    {
+        *(T*) addr(i) = (T) r[i.b].d;
+    }
+
+    template <typename T>
+    void ild(RegInstr const& i)
+    {
+        r[i.dst].i = *(T*) addr(i);
+    }
+
+    template <typename T>
+    void ist(RegInstr const& i)
+    {
+        *(T*) addr(i) = (T) r[i.b].i;
+    }
+
+    void fld(RegInstr const& i)
+    {
+        r[i.dst].f = *(float*) addr(i);
+    }
+
+    void fst(RegInstr const& i)
+    {
+        *(float*) addr(i) = r[i.b].f;
+    }
+
+    void lea(RegInstr const& i)
+    {
+        r[i.dst].i = (intptr_t) addr(i);
+    }
+
+    void lea_d(RegInstr const& i)
+    {
+        r[i.dst].d = (uintptr_t) addr(i);
+    }
+
+    void d2u(RegInstr const& i)
+    {
+        r[i.dst].i = (intptr_t) (uintptr_t) r[i.a].d;
+    }
+
+    void checkSpLimit()
+    {
+        if ((uint8_t*) r[REG_SP].i > spLimit)
+        {
+            vm.sp = (uint8_t*) r[REG_SP].i;
+            vm.growGpStack();
+            spLimit = vm.gpLimit;
+        }
+    }
+
+    void pushb_const(RegInstr const& i)
+    {
+        r[REG_SP].i += i.imm;
+        checkSpLimit();
+    }
+
+    void pushb(RegInstr const& i)
+    {
+        r[REG_SP].i += (int) r[i.a].d;
+        checkSpLimit();
+    }
+
+    void popb(RegInstr const& i)
+    {
+        r[REG_SP].i -= (int) r[i.a].d;
+    }
+
+    // Opens the callee's frame i.a registers above the caller's, with the
+    // caller's sp, the arguments and the callee's constants. CALL starts a
+    // new gp frame at sp; a leaf keeps running in the caller's.
+    void enter(RegInstr const& i, bool leaf)
+    {
+        RegFunction const& f = functions[i.imm];
+        size_t callerBase = r - regs.data();
+        size_t base = callerBase + i.a;
+
+        if (frames.size() == CALL_STACK_DEPTH)
+            die("Call stack overflow!");
+
+        if (base + f.registerCount() > regs.size())
+        {
+            regs.resize(std::max(2 * regs.size(), base + f.registerCount()));
+            r = regs.data() + callerBase;
+        }
+
+        Slot* callee = regs.data() + base;
+        callee[REG_SP] = r[REG_SP];
+        callee[REG_FP] = leaf ? r[REG_FP] : r[REG_SP];
+        // A few slots each, too few for memmove to pay.
+        for (int n = 0; n < f.arity; ++n)
+            callee[2 + n] = r[i.dst + n];
+
+        for (uint32_t n = 0; n < f.constCount; ++n)
+            callee[f.constBase() + n] = constants[f.constBegin + n];
+
+        Frame frame = {ip, callerBase, i.dst};
+        frames.push_back(frame);
+        r = callee;
+        ip = code + f.entry;
+    }
+
+    // Copies the i.imm result registers back to the caller and resumes it
+    // with sp.
+    void leave(RegInstr const& i, Slot sp)
+    {
+        Frame frame = frames.back();
+        frames.pop_back();
+
+        Slot* caller = regs.data() + frame.base;
+        for (int n = 0; n < i.imm; ++n)
+            caller[frame.results + n] = r[2 + n];
+        caller[REG_SP] = sp;
+        r = caller;
+        ip = frame.ret;
+    }
+
+    void call(RegInstr const& i)
+    {
+        enter(i, false);
+    }
+
+    void call_leaf(RegInstr const& i)
+    {
+        enter(i, true);
+    }
+
+    // RET drops the callee's gp frame along with anything pushed above it.
+    void ret(RegInstr const& i)
+    {
+        leave(i, r[REG_FP]);
+    }
+
+    void ret_leaf(RegInstr const& i)
+    {
+        leave(i, r[REG_SP]);
+    }
+
+    void bulk(RegInstr const& i)
+    {
+        Slot res = bulkOp(i.imm, r + i.a);
+
+        if (OPCODE_PUSHES[i.imm])
+            r[i.dst] = res;
+    }
+};
+
+#endif
@@ -0,0 +1,215 @@
+#ifndef _RUNTIME_HPP_
+#define _RUNTIME_HPP_
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "VMTypes.hpp"
+#include "VM.hpp"
+
+// One script invocation: run the shared code from entry with args pushed
+// on the operand stack, then hand the halted VM to done on the worker
+// thread. done must copy out whatever it needs; the VM is reused for the
+// next invocation. A script must halt on its own: one left waiting on a
+// host call would be dropped by the next reset, so it stops the process
+// instead (run such scripts on an EventLoop).
+struct Invocation {
+    enum {
+        MAX_ARGS = 4,
+    };
+
+    uint32_t entry;
+    int argCount;
+    Slot args[MAX_ARGS];
+    void (*done)(VM& vm, void* user);
+    void* user;
+};
+
+// Runs invocations of one immutable code buffer on a pool of worker
+// threads. Each worker owns a VM for its whole life, so an invocation
+// costs no allocation. Submissions are spread round robin over per-worker
+// queues; a worker takes from the back of its own queue and, when that is
+// empty, steals from the front of the others, so queues are only shared
+// while someone is short of work.
+struct Runtime {
+    struct WorkQueue {
+        std::mutex lock;
+        std::deque<Invocation> items;
+    };
+
+    uint8_t* code;
+    size_t gpStackBytes;
+    std::vector<WorkQueue> queues;
+    std::vector<std::thread> workers;
+    std::atomic<size_t> next;
+    std::atomic<size_t> pending;
+    std::atomic<size_t> outstanding;
+    std::atomic<int> sleeping;
+    std::atomic<bool> stopping;
+    std::mutex sleepLock;
+    std::condition_variable wake;
+    std::mutex doneLock;
+    std::condition_variable allDone;
+
+    // workerCount 0 means one per hardware thread. gpStackBytes bounds each
+    // worker's gp stack; only the pages scripts touch get committed.
+    Runtime(uint8_t* pCode, unsigned workerCount = 0, size_t pGpStackBytes = GP_STACK_BYTES): code(pCode),
+            gpStackBytes(pGpStackBytes), next(0), pending(0), outstanding(0), sleeping(0), stopping(false)
+    {
+        if (workerCount == 0)
+            workerCount = std::max(1u, std::thread::hardware_concurrency());
+
+        queues = std::vector<WorkQueue>(workerCount);
+
+        for (unsigned i = 0; i < workerCount; ++i)
+            workers.push_back(std::thread(&Runtime::work, this, i));
+    }
+
+    // Finishes everything already submitted, then stops the workers.
+    ~Runtime()
+    {
+        {
+            std::lock_guard<std::mutex> guard(sleepLock);
+            stopping = true;
+        }
+
+        wake.notify_all();
+
+        for (std::thread& worker : workers)
+            worker.join();
+    }
+
+    size_t workerCount() const
+    {
+        return workers.size();
+    }
+
+    void submit(Invocation const& inv)
+    {
+        if (inv.argCount < 0 || inv.argCount > Invocation::MAX_ARGS)
+            die("Bad invocation argument count!");
+
+        WorkQueue& queue = queues[next++ % queues.size()];
+        ++outstanding;
+
+        {
+            std::lock_guard<std::mutex> guard(queue.lock);
+            queue.items.push_back(inv);
+        }
+
+        ++pending;
+
+        if (sleeping > 0)
+        {
+            std::lock_guard<std::mutex> guard(sleepLock);
+            wake.notify_one();
+        }
+    }
+
+    // Blocks until every invocation submitted so far has finished.
+    void wait()
+    {
+        std::unique_lock<std::mutex> guard(doneLock);
+        allDone.wait(guard, [this] { return outstanding == 0; });
+    }
+
+    // ***********
+    // * WORKERS *
+    // ***********
+
+    bool popOwn(unsigned self, Invocation& inv)
+    {
+        WorkQueue& queue = queues[self];
+        std::lock_guard<std::mutex> guard(queue.lock);
+
+        if (queue.items.empty())
+            return false;
+
+        inv = queue.items.back();
+        queue.items.pop_back();
+        return true;
+    }
+
+    bool steal(unsigned self, Invocation& inv)
+    {
+        for (size_t i = 1; i < queues.size(); ++i)
+        {
+            WorkQueue& queue = queues[(self + i) % queues.size()];
+            std::unique_lock<std::mutex> guard(queue.lock, std::try_to_lock);
+
+            if (!guard.owns_lock() || queue.items.empty())
+                continue;
+
+            inv = queue.items.front();
+            queue.items.pop_front();
+            return true;
+        }
+
+        return false;
+    }
+
+    // Next invocation for worker self, or false once stopping and drained.
+    // Spins briefly before sleeping, since short scripts tend to arrive in
+    // bursts.
+    bool take(unsigned self, Invocation& inv)
+    {
+        for (int spins = 0; ; ++spins)
+        {
+            if (popOwn(self, inv) || steal(self, inv))
+            {
+                --pending;
+                return true;
+            }
+
+            if (spins < 64)
+            {
+                std::this_thread::yield();
+                continue;
+            }
+
+            std::unique_lock<std::mutex> guard(sleepLock);
+            ++sleeping;
+            wake.wait(guard, [this] { return pending > 0 || stopping; });
+            --sleeping;
+
+            if (stopping && pending == 0)
+                return false;
+
+            spins = 0;
+        }
+    }
+
+    void work(unsigned self)
+    {
+        VM vm(code, OP_STACK_DEPTH, gpStackBytes);
+        Invocation inv;
+
+        while (take(self, inv))
+        {
+            vm.reset(code + inv.entry);
+
+            for (int i = 0; i < inv.argCount; ++i)
+                *vm.opStack.top++ = inv.args[i];
+
+            if (vm.run() != RUN_HALTED)
+                die("Invocation did not halt!");
+
+            if (inv.done)
+                inv.done(vm, inv.user);
+
+            if (--outstanding == 0)
+            {
+                std::lock_guard<std::mutex> guard(doneLock);
+                allDone.notify_all();
+            }
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,220 @@
+#ifndef _SCAN_SKIP_HPP_
+#define _SCAN_SKIP_HPP_
+
+#include <cstddef>
+
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(VM_NO_SIMD)
+#define SCAN_HAS_SIMD
+#include <immintrin.h>
+
+#define SCAN_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+// Fast paths in front of the re2c automaton: whitespace runs and whole
+// names are skipped 16 or 32 bytes at a time, with SSE2 or, if the CPU
+// has it, AVX2. The classes match WS and NAME_CH | DIGIT in Scanner.re2c
+// exactly, so the tokens are the same; anything else is left to the
+// automaton. Kernels never read at or past limit.
+
+inline bool isSpaceChar(char c)
+{
+    return c == ' ' || (c >= '\t' && c <= '\r' && c != '\v');
+}
+
+inline bool isNameChar(char c)
+{
+    switch (c)
+    {
+        case '"': case '#': case '\'': case '(': case ')': case ';':
+        case '[': case '\\': case ']': case '`': case '{': case '|': case '}':
+            return false;
+        default:
+            return c > ' ' && c < 0x7F;
+    }
+}
+
+struct ScanKernels {
+    char const* name;
+    char const* (*skipSpace)(char const* p, char const* limit);
+    char const* (*skipName)(char const* p, char const* limit);
+};
+
+// **********
+// * SCALAR *
+// **********
+
+struct ScalarScan {
+    static char const* skipSpace(char const* p, char const* limit)
+    {
+        while (p < limit && isSpaceChar(*p))
+            ++p;
+
+        return p;
+    }
+
+    static char const* skipName(char const* p, char const* limit)
+    {
+        while (p < limit && isNameChar(*p))
+            ++p;
+
+        return p;
+    }
+};
+
+#ifdef SCAN_HAS_SIMD
+
+// Byte comparisons are signed, so bytes from 0x80 up never fall in a range.
+
+// ********
+// * SSE2 *
+// ********
+
+struct Sse2Scan {
+    static __m128i in(__m128i x, char lo, char hi)
+    {
+        return _mm_and_si128(_mm_cmpgt_epi8(x, _mm_set1_epi8(lo - 1)), _mm_cmplt_epi8(x, _mm_set1_epi8(hi + 1)));
+    }
+
+    static __m128i is(__m128i x, char c)
+    {
+        return _mm_cmpeq_epi8(x, _mm_set1_epi8(c));
+    }
+
+    static __m128i space(__m128i x)
+    {
+        return _mm_or_si128(is(x, ' '), _mm_andnot_si128(is(x, '\v'), in(x, '\t', '\r')));
+    }
+
+    static __m128i name(__m128i x)
+    {
+        __m128i excluded = _mm_or_si128(_mm_or_si128(in(x, '"', '#'), in(x, '\'', ')')),
+                _mm_or_si128(_mm_or_si128(is(x, ';'), in(x, '[', ']')), _mm_or_si128(is(x, '`'), in(x, '{', '}'))));
+        return _mm_andnot_si128(excluded, in(x, '!', '~'));
+    }
+
+    template <__m128i (*CLASS)(__m128i), char const* (*TAIL)(char const*, char const*)>
+    static char const* skip(char const* p, char const* limit)
+    {
+        for (; p + 16 <= limit; p += 16)
+        {
+            int miss = ~_mm_movemask_epi8(CLASS(_mm_loadu_si128((__m128i const*) p))) & 0xFFFF;
+
+            if (miss)
+                return p + __builtin_ctz(miss);
+        }
+
+        return TAIL(p, limit);
+    }
+
+    static char const* skipSpace(char const* p, char const* limit)
+    {
+        return skip<space, ScalarScan::skipSpace>(p, limit);
+    }
+
+    static char const* skipName(char const* p, char const* limit)
+    {
+        return skip<name, ScalarScan::skipName>(p, limit);
+    }
+};
+
+// ********
+// * AVX2 *
+// ********
+
+struct Avx2Scan {
+    SCAN_TARGET_AVX2 static __m256i in(__m256i x, char lo, char hi)
+    {
+        return _mm256_and_si256(_mm256_cmpgt_epi8(x, _mm256_set1_epi8(lo - 1)),
+                _mm256_cmpgt_epi8(_mm256_set1_epi8(hi + 1), x));
+    }
+
+    SCAN_TARGET_AVX2 static __m256i is(__m256i x, char c)
+    {
+        return _mm256_cmpeq_epi8(x, _mm256_set1_epi8(c));
+    }
+
+    SCAN_TARGET_AVX2 static __m256i space(__m256i x)
+    {
+        return _mm256_or_si256(is(x, ' '), _mm256_andnot_si256(is(x, '\v'), in(x, '\t', '\r')));
+    }
+
+    SCAN_TARGET_AVX2 static __m256i name(__m256i x)
+    {
+        __m256i excluded = _mm256_or_si256(_mm256_or_si256(in(x, '"', '#'), in(x, '\'', ')')),
+                _mm256_or_si256(_mm256_or_si256(is(x, ';'), in(x, '[', ']')),
+                _mm256_or_si256(is(x, '`'), in(x, '{', '}'))));
+        return _mm256_andnot_si256(excluded, in(x, '!', '~'));
+    }
+
+    // The last partial block goes through SSE2.
+    template <__m256i (*CLASS)(__m256i), char const* (*TAIL)(char const*, char const*)>
+    SCAN_TARGET_AVX2 static char const* skip(char const* p, char const* limit)
+    {
+        for (; p + 32 <= limit; p += 32)
+        {
+            unsigned miss = ~(unsigned) _mm256_movemask_epi8(CLASS(_mm256_loadu_si256((__m256i const*) p)));
+
+            if (miss)
+                return p + __builtin_ctz(miss);
+        }
+
+        return TAIL(p, limit);
+    }
+
+    SCAN_TARGET_AVX2 static char const* skipSpace(char const* p, char const* limit)
+    {
+        return skip<space, Sse2Scan::skipSpace>(p, limit);
+    }
+
+    SCAN_TARGET_AVX2 static char const* skipName(char const* p, char const* limit)
+    {
+        return skip<name, Sse2Scan::skipName>(p, limit);
+    }
+};
+
+#endif
+
+// ************
+// * DISPATCH *
+// ************
+
+inline ScanKernels const& scanKernels()
+{
+#ifdef SCAN_HAS_SIMD
+    static ScanKernels const sse2 = {"sse2", &Sse2Scan::skipSpace, &Sse2Scan::skipName};
+    static ScanKernels const avx2 = {"avx2", &Avx2Scan::skipSpace, &Avx2Scan::skipName};
+    static ScanKernels const* const best = (__builtin_cpu_init(), __builtin_cpu_supports("avx2")) ? &avx2 : &sse2;
+    return *best;
+#else
+    static ScanKernels const scalar = {"scalar", &ScalarScan::skipSpace, &ScalarScan::skipName};
+    return scalar;
+#endif
+}
+
+// The first non-space at or after p, or limit. A single space, the usual
+// gap between tokens, never reaches the kernels.
+template <typename Char>
+Char* skipSpace(Char* p, char const* limit)
+{
+    if (p >= limit || !isSpaceChar(*p))
+        return p;
+
+    if (p + 1 >= limit || !isSpaceChar(p[1]))
+        return p + 1;
+
+    return p + (scanKernels().skipSpace(p + 2, limit) - p);
+}
+
+// The end of the name starting at p, or null if p does not start one or
+// it may go on at limit.
+template <typename Char>
+Char* scanName(Char* p, char const* limit)
+{
+    if (p >= limit || !isNameChar(*p) || (*p >= '0' && *p <= '9'))
+        return nullptr;
+
+    char const* end = scanKernels().skipName(p + 1, limit);
+    return end < limit ? p + (end - p) : nullptr;
+}
+
+#endif
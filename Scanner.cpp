@@ -1,17 +1,25 @@
-/* Generated by re2c 0.13.5 on Sat May 24 17:37:11 2014 */
+/* Generated by re2c 0.13.5 */
 #line 1 "Scanner.re2c"
 #include "Scanner.hpp"
 #include "Token.hpp"
+#include "ScanSkip.hpp"
 
-Token Scanner::next()
+TokenView Scanner::nextView()
 {
     char const* tokStart;
 
 start:   
+    cursor = skipSpace(cursor, end);
     tokStart = cursor;
+    
+    if(char const* nameEnd = scanName(cursor, end))
+    {
+        cursor = nameEnd;
+        return TokenView(Token::NAME, tokStart, cursor);
+    }
 
     
-#line 15 "Scanner.cpp"
+#line 23 "Scanner.cpp"
 {
 	char yych;
 
@@ -110,45 +118,45 @@ start:
 	}
 yy2:
 	++cursor;
-#line 20 "Scanner.re2c"
-	{ return Token(Token::OBR, tokStart, cursor); }
-#line 116 "Scanner.cpp"
+#line 28 "Scanner.re2c"
+	{ return TokenView(Token::OBR, tokStart, cursor); }
+#line 124 "Scanner.cpp"
 yy4:
 	++cursor;
-#line 21 "Scanner.re2c"
-	{ return Token(Token::CBR, tokStart, cursor); }
-#line 121 "Scanner.cpp"
+#line 29 "Scanner.re2c"
+	{ return TokenView(Token::CBR, tokStart, cursor); }
+#line 129 "Scanner.cpp"
 yy6:
 	++cursor;
 	yych = *cursor;
 	goto yy19;
 yy7:
-#line 22 "Scanner.re2c"
-	{ return Token(Token::NAME, tokStart, cursor); }
-#line 129 "Scanner.cpp"
+#line 30 "Scanner.re2c"
+	{ return TokenView(Token::NAME, tokStart, cursor); }
+#line 137 "Scanner.cpp"
 yy8:
 	++cursor;
 	yych = *cursor;
 	goto yy17;
 yy9:
-#line 23 "Scanner.re2c"
-	{ return Token(Token::INT_LITERAL, tokStart, cursor); }
-#line 137 "Scanner.cpp"
+#line 31 "Scanner.re2c"
+	{ return TokenView(Token::INT_LITERAL, tokStart, cursor); }
+#line 145 "Scanner.cpp"
 yy10:
 	++cursor;
-#line 24 "Scanner.re2c"
+#line 32 "Scanner.re2c"
 	{ goto start; }
-#line 142 "Scanner.cpp"
+#line 150 "Scanner.cpp"
 yy12:
 	++cursor;
-#line 25 "Scanner.re2c"
-	{ return Token(Token::END_OF_INPUT); }
-#line 147 "Scanner.cpp"
+#line 33 "Scanner.re2c"
+	{ return TokenView(Token::END_OF_INPUT); }
+#line 155 "Scanner.cpp"
 yy14:
 	++cursor;
-#line 26 "Scanner.re2c"
-	{ return Token(Token::INVALID, tokStart, cursor); }
-#line 152 "Scanner.cpp"
+#line 34 "Scanner.re2c"
+	{ return TokenView(Token::INVALID, tokStart, cursor); }
+#line 160 "Scanner.cpp"
 yy16:
 	++cursor;
 	yych = *cursor;
@@ -255,6 +263,274 @@ yy19:
 	default:	goto yy7;
 	}
 }
-#line 27 "Scanner.re2c"
+#line 35 "Scanner.re2c"
+
+}
+
+// Same rules as Scanner::nextView, with refills: the automaton calls fill
+// whenever it needs a byte past the end of the buffer.
+TokenView StreamScanner::nextView()
+{
+start:
+    cursor = skipSpace(cursor, limit);
+    tokStart = cursor;
+    
+    if(char* nameEnd = scanName(cursor, limit))
+    {
+        cursor = nameEnd;
+        return TokenView(Token::NAME, tokStart, cursor);
+    }
+
+    
+#line 286 "Scanner.cpp"
+{
+	char yych;
+
+	if (limit <= cursor) fill(1);
+	yych = *cursor;
+	switch (yych) {
+	case 0x00:	goto yy32;
+	case '\t':
+	case '\n':
+	case '\f':
+	case '\r':
+	case ' ':	goto yy30;
+	case '!':
+	case '$':
+	case '%':
+	case '&':
+	case '*':
+	case '+':
+	case ',':
+	case '-':
+	case '.':
+	case '/':
+	case ':':
+	case '<':
+	case '=':
+	case '>':
+	case '?':
+	case '@':
+	case 'A':
+	case 'B':
+	case 'C':
+	case 'D':
+	case 'E':
+	case 'F':
+	case 'G':
+	case 'H':
+	case 'I':
+	case 'J':
+	case 'K':
+	case 'L':
+	case 'M':
+	case 'N':
+	case 'O':
+	case 'P':
+	case 'Q':
+	case 'R':
+	case 'S':
+	case 'T':
+	case 'U':
+	case 'V':
+	case 'W':
+	case 'X':
+	case 'Y':
+	case 'Z':
+	case '^':
+	case '_':
+	case 'a':
+	case 'b':
+	case 'c':
+	case 'd':
+	case 'e':
+	case 'f':
+	case 'g':
+	case 'h':
+	case 'i':
+	case 'j':
+	case 'k':
+	case 'l':
+	case 'm':
+	case 'n':
+	case 'o':
+	case 'p':
+	case 'q':
+	case 'r':
+	case 's':
+	case 't':
+	case 'u':
+	case 'v':
+	case 'w':
+	case 'x':
+	case 'y':
+	case 'z':
+	case '~':	goto yy26;
+	case '(':	goto yy22;
+	case ')':	goto yy24;
+	case '0':
+	case '1':
+	case '2':
+	case '3':
+	case '4':
+	case '5':
+	case '6':
+	case '7':
+	case '8':
+	case '9':	goto yy28;
+	default:	goto yy34;
+	}
+yy22:
+	++cursor;
+#line 58 "Scanner.re2c"
+	{ return TokenView(Token::OBR, tokStart, cursor); }
+#line 388 "Scanner.cpp"
+yy24:
+	++cursor;
+#line 59 "Scanner.re2c"
+	{ return TokenView(Token::CBR, tokStart, cursor); }
+#line 393 "Scanner.cpp"
+yy26:
+	++cursor;
+	if (limit <= cursor) fill(1);
+	yych = *cursor;
+	goto yy39;
+yy27:
+#line 60 "Scanner.re2c"
+	{ return TokenView(Token::NAME, tokStart, cursor); }
+#line 402 "Scanner.cpp"
+yy28:
+	++cursor;
+	if (limit <= cursor) fill(1);
+	yych = *cursor;
+	goto yy37;
+yy29:
+#line 61 "Scanner.re2c"
+	{ return TokenView(Token::INT_LITERAL, tokStart, cursor); }
+#line 411 "Scanner.cpp"
+yy30:
+	++cursor;
+#line 62 "Scanner.re2c"
+	{ goto start; }
+#line 416 "Scanner.cpp"
+yy32:
+	++cursor;
+#line 63 "Scanner.re2c"
+	{ return TokenView(Token::END_OF_INPUT); }
+#line 421 "Scanner.cpp"
+yy34:
+	++cursor;
+#line 64 "Scanner.re2c"
+	{ return TokenView(Token::INVALID, tokStart, cursor); }
+#line 426 "Scanner.cpp"
+yy36:
+	++cursor;
+	if (limit <= cursor) fill(1);
+	yych = *cursor;
+yy37:
+	switch (yych) {
+	case '0':
+	case '1':
+	case '2':
+	case '3':
+	case '4':
+	case '5':
+	case '6':
+	case '7':
+	case '8':
+	case '9':	goto yy36;
+	default:	goto yy29;
+	}
+yy38:
+	++cursor;
+	if (limit <= cursor) fill(1);
+	yych = *cursor;
+yy39:
+	switch (yych) {
+	case '!':
+	case '$':
+	case '%':
+	case '&':
+	case '*':
+	case '+':
+	case ',':
+	case '-':
+	case '.':
+	case '/':
+	case '0':
+	case '1':
+	case '2':
+	case '3':
+	case '4':
+	case '5':
+	case '6':
+	case '7':
+	case '8':
+	case '9':
+	case ':':
+	case '<':
+	case '=':
+	case '>':
+	case '?':
+	case '@':
+	case 'A':
+	case 'B':
+	case 'C':
+	case 'D':
+	case 'E':
+	case 'F':
+	case 'G':
+	case 'H':
+	case 'I':
+	case 'J':
+	case 'K':
+	case 'L':
+	case 'M':
+	case 'N':
+	case 'O':
+	case 'P':
+	case 'Q':
+	case 'R':
+	case 'S':
+	case 'T':
+	case 'U':
+	case 'V':
+	case 'W':
+	case 'X':
+	case 'Y':
+	case 'Z':
+	case '^':
+	case '_':
+	case 'a':
+	case 'b':
+	case 'c':
+	case 'd':
+	case 'e':
+	case 'f':
+	case 'g':
+	case 'h':
+	case 'i':
+	case 'j':
+	case 'k':
+	case 'l':
+	case 'm':
+	case 'n':
+	case 'o':
+	case 'p':
+	case 'q':
+	case 'r':
+	case 's':
+	case 't':
+	case 'u':
+	case 'v':
+	case 'w':
+	case 'x':
+	case 'y':
+	case 'z':
+	case '~':	goto yy38;
+	default:	goto yy27;
+	}
+}
+#line 65 "Scanner.re2c"
 
 }
@@ -8,19 +8,32 @@
 #ifndef SCANNER_HPP
 #define	SCANNER_HPP
 
+#include <cerrno>
+#include <cstring>
 #include <list>
+#include <vector>
+
+#include <unistd.h>
 
 #include "Util.hpp"
 #include "Token.hpp"
 
+#define STREAM_SCANNER_BUFFER (64 * 1024)
+
 struct Scanner {
     char const* cursor;
+    char const* end;
     
-    Scanner(char const* str): cursor(str)
+    Scanner(char const* str): cursor(str), end(str + strlen(str))
     {
     }
     
-    Token next();
+    TokenView nextView();
+    
+    Token next()
+    {
+        return nextView().token();
+    }
     
     std::list<Token> scan()
     {
@@ -38,6 +51,123 @@ struct Scanner {
         
         return tokens;
     }
+    
+    // Tokenizes the rest of the input into views of it, ending with
+    // END_OF_INPUT. Only the vector allocates; room for a token per four
+    // bytes of input is reserved up front, so it seldom grows.
+    std::vector<TokenView> scanViews()
+    {
+        std::vector<TokenView> tokens;
+        scanViews(tokens);
+        return tokens;
+    }
+    
+    // The same, appending to tokens. A caller that scans repeatedly can
+    // clear and pass the same vector to skip the allocation and the page
+    // faults of a fresh one.
+    void scanViews(std::vector<TokenView>& tokens)
+    {
+        tokens.reserve(tokens.size() + (end - cursor) / 4 + 1);
+        TokenView tok(Token::INVALID);
+        
+        do
+        {
+            tok = nextView();
+            tokens.push_back(tok);
+        }
+        while(tok.type != Token::END_OF_INPUT);
+    }
+};
+
+// Scans input pulled in chunks through a reader, so memory stays bounded
+// by the buffer however long the input is. Tokens may span chunks; one
+// token must fit in the buffer. The views it hands out point into the
+// buffer and only last until the next call.
+struct StreamScanner {
+    // Reads at most max bytes into dest and returns how many, 0 at the end
+    // of the input, or -1 on an error, which stops the process rather
+    // than pass a truncated input off as a whole one.
+    typedef long (*Reader)(void* user, char* dest, size_t max);
+    
+    Reader reader;
+    void* user;
+    int fd;
+    std::vector<char> storage;
+    char* buffer;
+    char* limit;
+    char* cursor;
+    char* tokStart;
+    bool eof;
+    
+    StreamScanner(Reader reader_, void* user_, size_t bufferSize = STREAM_SCANNER_BUFFER): reader(reader_),
+            user(user_), fd(-1), storage(bufferSize), buffer(storage.data()), limit(buffer), cursor(buffer),
+            tokStart(buffer), eof(false)
+    {
+    }
+    
+    // Reads fd, which stays open and owned by the caller.
+    StreamScanner(int fd_, size_t bufferSize = STREAM_SCANNER_BUFFER): reader(nullptr), user(nullptr), fd(fd_),
+            storage(bufferSize), buffer(storage.data()), limit(buffer), cursor(buffer), tokStart(buffer),
+            eof(false)
+    {
+    }
+    
+    TokenView nextView();
+    
+    Token next()
+    {
+        return nextView().token();
+    }
+    
+    long readSome(char* dest, size_t max)
+    {
+        long got;
+        
+        if(reader)
+            got = reader(user, dest, max);
+        else
+        {
+            do
+                got = read(fd, dest, max);
+            while(got < 0 && errno == EINTR);
+        }
+        
+        if(got < 0)
+            die("Failed to read the scanner input!");
+        
+        return got;
+    }
+    
+    // Moves the token being scanned to the front of the buffer and reads
+    // behind it until need bytes lie past the cursor. Past the end of the
+    // input it pads with NULs, which the rules take as END_OF_INPUT, so a
+    // refill never fails.
+    void fill(size_t need)
+    {
+        size_t keep = limit - tokStart;
+        
+        if(cursor - tokStart + need > storage.size())
+            die("Token too long for the scanner buffer!");
+        
+        memmove(buffer, tokStart, keep);
+        cursor = buffer + (cursor - tokStart);
+        tokStart = buffer;
+        limit = buffer + keep;
+        
+        while((size_t)(limit - cursor) < need)
+        {
+            size_t room = buffer + storage.size() - limit;
+            long got = eof ? 0 : readSome(limit, room);
+            
+            if(got > 0)
+                limit += got;
+            else
+            {
+                eof = true;
+                *limit++ = 0;
+            }
+        }
+    }
 };
 
 #endif	/* SCANNER_HPP */
@@ -52,6 +52,37 @@ struct Token {
     }
 };
 
+// A token as a span of the source it was scanned from. Views cost no
+// allocation and stay valid as long as the source buffer does.
+struct TokenView {
+    Token::Type type;
+    char const* start;
+    char const* end;
+    
+    TokenView(Token::Type type_): type(type_), start(nullptr), end(nullptr)
+    {
+    }
+    
+    TokenView(Token::Type type_, char const* start_, char const* end_): type(type_), start(start_), end(end_)
+    {
+    }
+    
+    size_t length() const
+    {
+        return end - start;
+    }
+    
+    std::string text() const
+    {
+        return std::string(start, end);
+    }
+    
+    Token token() const
+    {
+        return start ? Token(type, start, end) : Token(type);
+    }
+};
+
 
 #endif	/* TOKEN_HPP */
 
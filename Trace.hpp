@@ -0,0 +1,86 @@
+#ifndef _TRACE_HPP_
+#define _TRACE_HPP_
+
+#include <vector>
+#include <cstdio>
+#include <cstdint>
+
+#include "Opcode.hpp"
+
+// Execution hooks are a template parameter of the VM engines, so a hook
+// that does nothing compiles away entirely. Custom hooks derive from
+// NoHooks and override the calls they care about.
+struct NoHooks {
+    // Hooks that may refuse a back edge set this, so engines without it
+    // pay nothing for the check.
+    static bool const canSuspend = false;
+
+    void step(uint8_t const*)
+    {
+    }
+
+    // Called with the target before a backward jump when canSuspend is
+    // set; false stops the run there.
+    bool backEdge(uint8_t const*)
+    {
+        return true;
+    }
+};
+
+// Records the most recent instructions as packed binary records in a
+// fixed-size ring. Nothing is formatted until dump() is called.
+struct RingTrace: public NoHooks {
+    struct Record {
+        uint32_t offs;
+        uint8_t opcode;
+    };
+
+    uint8_t const* code;
+    std::vector<Record> records;
+    uint64_t mask;
+    uint64_t count;
+
+    RingTrace(uint8_t const* pCode, int capacityLog2 = 16): code(pCode), records(size_t(1) << capacityLog2),
+            mask((uint64_t(1) << capacityLog2) - 1), count(0)
+    {
+    }
+
+    void step(uint8_t const* ip)
+    {
+        Record& rec = records[count & mask];
+        rec.offs = (uint32_t) (ip - code);
+        rec.opcode = *ip;
+        ++count;
+    }
+
+    uint64_t size() const
+    {
+        return count < records.size() ? count : records.size();
+    }
+
+    Record const& at(uint64_t i) const
+    {
+        return records[(count - size() + i) & mask];
+    }
+
+    void clear()
+    {
+        count = 0;
+    }
+
+    // Oldest record first, one "offset opcode" line each.
+    void dump(FILE* out) const
+    {
+        for (uint64_t i = 0; i < size(); ++i)
+            fprintf(out, "%6u %s\n", at(i).offs, OPCODE_NAMES[at(i).opcode]);
+    }
+
+    // Raw records, oldest first, for offline tools.
+    void write(FILE* out) const
+    {
+        for (uint64_t i = 0; i < size(); ++i)
+            fwrite(&at(i), sizeof (Record), 1, out);
+    }
+};
+
+#endif
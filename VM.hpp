@@ -1,227 +1,519 @@
 #ifndef _VM_HPP_
 #define _VM_HPP_
 
-#include <vector>
 #include <cstdio>
 #include <cstdint>
 
 #include "Opcode.hpp"
 #include "VMTypes.hpp"
+#include "Bytecode.hpp"
+#include "Trace.hpp"
+#include "Memory.hpp"
+#include "Host.hpp"
+#include "Bulk.hpp"
 
 #define GP_STACK_BYTES (1024 * 1024 * 2)
+#define OP_STACK_DEPTH 1024
+#define CALL_STACK_DEPTH 1024
+
+// Preallocated operand stack addressed through a raw top pointer. Its size
+// is rounded up to whole pages and it sits between two guard pages, so
+// overflow and underflow fault without any per-push checks. The region
+// comes from a StackPool, so a short-lived VM maps nothing.
+struct OpStack {
+    StackPool& pool;
+    GuardedRegion* region;
+    Slot* base;
+    Slot* top;
+
+    OpStack(int depth, StackPool& pPool): pool(pPool), region(pool.acquireGuarded(depth * sizeof (Slot)))
+    {
+        base = (Slot*) region->base;
+        top = base;
+    }
+
+    ~OpStack()
+    {
+        pool.releaseGuarded(region);
+    }
+
+    int depth() const
+    {
+        return (int) (region->size / sizeof (Slot));
+    }
+
+    int size() const
+    {
+        return (int) (top - base);
+    }
+
+    Slot* begin() const
+    {
+        return base;
+    }
+
+    Slot* end() const
+    {
+        return top;
+    }
+
+    void push(Slot slot)
+    {
+        *top++ = slot;
+    }
+
+    Slot pop()
+    {
+        return *--top;
+    }
+
+private:
+    OpStack(OpStack const&);
+    OpStack& operator=(OpStack const&);
+};
+
+// Return address and caller's frame pointer of one active CALL.
+struct CallFrame {
+    uint8_t* ret;
+    uint8_t* fp;
+};
+
+// The CALL frames, guarded like OpStack: runaway recursion and a RET
+// without a CALL fault instead of costing a check per call.
+struct CallStack {
+    StackPool& pool;
+    GuardedRegion* region;
+    CallFrame* base;
+    CallFrame* top;
+
+    CallStack(int depth, StackPool& pPool): pool(pPool), region(pool.acquireGuarded(depth * sizeof (CallFrame)))
+    {
+        base = (CallFrame*) region->base;
+        top = base;
+    }
+
+    ~CallStack()
+    {
+        pool.releaseGuarded(region);
+    }
+
+    int size() const
+    {
+        return (int) (top - base);
+    }
+
+private:
+    CallStack(CallStack const&);
+    CallStack& operator=(CallStack const&);
+};
+
+// ********************
+// * STACK STRATEGIES *
+// ********************
+
+// Every operand lives in OpStack memory.
+struct MemoryStack {
+    Slot* top;
+
+    void load(OpStack const& stack)
+    {
+        top = stack.top;
+    }
+
+    void save(OpStack& stack)
+    {
+        stack.top = top;
+    }
+
+    void push(Slot slot)
+    {
+        *top++ = slot;
+    }
+
+    Slot pop()
+    {
+        return *--top;
+    }
+
+    Slot peek()
+    {
+        return top[-1];
+    }
+
+    void poke(Slot slot)
+    {
+        top[-1] = slot;
+    }
+};
+
+// The top operand is kept in a local across dispatch, so a binary op
+// touches memory once instead of three times. Only the slots below it
+// live in OpStack memory while the engine runs. The cached slot is held as
+// plain bits rather than as a Slot, since compilers keep a union local in
+// memory but an integer in a register.
+//
+// On an empty stack the cached slot holds nothing and top sits just under
+// base. A push or pop that crosses empty skips the memory access that
+// would hit the guard page; popping past empty or using the top of an
+// empty stack still reaches it.
+struct CachedTosStack {
+    Slot* top;
+    Slot* empty;
+    int64_t tos;
+
+    void load(OpStack const& stack)
+    {
+        top = stack.top - 1;
+        empty = stack.base - 1;
+        tos = top != empty ? top->i : 0;
+    }
+
+    void save(OpStack& stack)
+    {
+        if (top != empty)
+            top->i = tos;
+
+        stack.top = top + 1;
+    }
+
+    void push(Slot slot)
+    {
+        if (top != empty)
+            top->i = tos;
+
+        ++top;
+        tos = slot.i;
+    }
+
+    Slot pop()
+    {
+        Slot slot;
+        slot.i = tos;
+
+        if (--top != empty)
+            tos = top->i;
+
+        return slot;
+    }
+
+    // An empty stack has no top: reading the slot under base faults.
+    Slot peek()
+    {
+        if (top == empty)
+            tos = top->i;
+
+        Slot slot;
+        slot.i = tos;
+        return slot;
+    }
+
+    void poke(Slot slot)
+    {
+        tos = slot.i;
+    }
+};
+
+// The cache is opt-in because it does not pay: the extra live state
+// competes with sp and fp for registers, and across the bench workloads it
+// lands anywhere from 15% faster to 50% slower than MemoryStack, with no
+// workload gaining under both dispatch loops. Measure with `make bench`
+// before turning it on.
+#ifdef VM_TOS_CACHE
+typedef CachedTosStack DefaultStack;
+#else
+typedef MemoryStack DefaultStack;
+#endif
+
+template <typename Stack, typename Hooks>
+struct Interpreter;
+
+// SUSPENDED: the hooks stopped the run at a back edge. WAITING: a host
+// call is pending.
+enum RunStatus {
+    RUN_HALTED, RUN_SUSPENDED, RUN_WAITING,
+};
 
 struct VM {
-    vector<Value> opStack;
+    OpStack opStack;
+    CallStack callStack;
+    StackPool& gpPool;
+    StackRegion* gpRegion;
     uint8_t* gpStack;
+    uint8_t* gpLimit;
     uint8_t* program;
     uint8_t* sp;
     uint8_t* ip;
-
-    VM(uint8_t* program)
+    uint8_t* fp;
+    uint8_t* leafRet;
+    HostTable const* hosts;
+
+    // All three stacks come from pool. The gp stack reserves gpStackBytes,
+    // but only the pages a script pushes into are committed.
+    VM(uint8_t* program, int opStackDepth = OP_STACK_DEPTH, size_t gpStackBytes = GP_STACK_BYTES,
+            StackPool& pool = StackPool::shared()): opStack(opStackDepth, pool), callStack(CALL_STACK_DEPTH, pool),
+            gpPool(pool)
     {
-        gpStack = new uint8_t[GP_STACK_BYTES];
+        gpRegion = gpPool.acquire(gpStackBytes);
+        gpStack = gpRegion->base;
+        gpLimit = gpRegion->committedEnd();
         sp = gpStack;
         ip = program;
+        fp = gpStack;
+        leafRet = nullptr;
+        hosts = nullptr;
+        this->program = program;
     }
 
     ~VM()
     {
-        delete[] gpStack;
+        gpPool.release(gpRegion);
+    }
+
+    // Called by the engines when a push has moved sp past gpLimit.
+    void growGpStack()
+    {
+        if (!gpRegion->commitTo(sp))
+            die("GP stack overflow!");
+
+        gpLimit = gpRegion->committedEnd();
+    }
+
+    // The host sees the VM as a run would leave it, with ip after the call.
+    HostStatus callHost(int32_t index)
+    {
+        if (!hosts || index < 0 || (size_t) index >= hosts->size())
+            die("Unknown host function!");
+
+        HostTable::Entry const& entry = (*hosts)[index];
+        return entry.fn(*this, entry.user);
+    }
+
+    // Readies the VM for another run from entry, keeping its stacks, so one
+    // VM can serve many short invocations without reallocating.
+    void reset(uint8_t* entry)
+    {
+        opStack.top = opStack.base;
+        callStack.top = callStack.base;
+        sp = gpStack;
+        ip = entry;
+        fp = gpStack;
+        leafRet = nullptr;
     }
 
     void printOpStack()
     {
         printf("--------\n");
 
-        for (Value v : opStack)
-            printf("%f\n", v);
+        for (Slot slot : opStack)
+            printf("%f\n", slot.d);
 
         printf("---------\n");
     }
 
-    Value progReadValue()
+    // Engines are picked at build time: define VM_THREADED_DISPATCH to use
+    // computed-goto threading instead of the portable switch loop, and
+    // VM_TOS_CACHE to keep the top operand out of memory (rarely faster;
+    // see DefaultStack).
+    //
+    // A run ends at HALT, or early when the hooks refuse a backward jump
+    // (see Budget) or a host call is pending (see Host.hpp); then ip is
+    // where to go on and calling run again resumes.
+    template <typename Hooks>
+    RunStatus run(Hooks& hooks)
+    {
+#ifdef VM_THREADED_DISPATCH
+        return runThreaded<DefaultStack>(hooks);
+#else
+        return runSwitch<DefaultStack>(hooks);
+#endif
+    }
+
+    RunStatus run()
+    {
+        NoHooks hooks;
+        return run(hooks);
+    }
+
+    template <typename Stack, typename Hooks>
+    RunStatus runSwitch(Hooks& hooks)
+    {
+        return Interpreter<Stack, Hooks>::runSwitch(*this, hooks);
+    }
+
+#ifdef __GNUC__
+#define VM_HAS_THREADED_DISPATCH
+
+    template <typename Stack, typename Hooks>
+    RunStatus runThreaded(Hooks& hooks)
+    {
+        return Interpreter<Stack, Hooks>::runThreaded(*this, hooks);
+    }
+#elif defined(VM_THREADED_DISPATCH)
+#error "VM_THREADED_DISPATCH requires GCC-style computed goto"
+#endif
+};
+
+// Engine state for one run. The engines keep an Interpreter as a local and
+// inline every handler into the dispatch loop, so the compiler can hold ip,
+// sp and the stack top in registers and only write them back to the VM
+// when the run stops.
+template <typename Stack, typename Hooks>
+struct Interpreter {
+    Stack stack;
+    uint8_t* code;
+    uint8_t* sp;
+    uint8_t* ip;
+    uint8_t* resumeAt;
+    int32_t hostCall;
+    uint8_t* fp;
+    CallFrame* calls;
+    uint8_t* leafRet;
+    VM& vm;
+    uint8_t* spLimit;
+    Hooks& hooks;
+
+    Interpreter(VM& pVm, Hooks& pHooks): code(pVm.program), sp(pVm.sp), ip(pVm.ip), resumeAt(nullptr),
+            hostCall(-1), fp(pVm.fp), calls(pVm.callStack.top), leafRet(pVm.leafRet), vm(pVm),
+            spLimit(pVm.gpLimit), hooks(pHooks)
+    {
+        stack.load(vm.opStack);
+    }
+
+    RunStatus save(VM& vm)
+    {
+        stack.save(vm.opStack);
+        vm.sp = sp;
+        vm.fp = fp;
+        vm.callStack.top = calls;
+        vm.leafRet = leafRet;
+        vm.ip = ip ? ip : resumeAt;
+        return vm.ip ? RUN_SUSPENDED : RUN_HALTED;
+    }
+
+    // Every jump goes through here. A backward one asks the hooks whether
+    // to go on; if not, the run stops as if halted and resumes at target.
+    void jumpTo(uint8_t* target)
+    {
+        if (Hooks::canSuspend && target < ip && !hooks.backEdge(target))
+        {
+            resumeAt = target;
+            ip = nullptr;
+            return;
+        }
+
+        ip = target;
+    }
+
+    // Immediates sit at the next address aligned to their size.
+    template <typename T>
+    T progRead()
     {
-        Value v = *(Value*) ip;
-        ip += sizeof (Value);
+        ip = alignUp(ip, sizeof (T));
+        T v = *(T*) ip;
+        ip += sizeof (T);
         return v;
     }
 
-    Addr progReadAddr()
+    Addr progReadLabel()
+    {
+        return code + progRead<uint32_t>();
+    }
+
+#define VM_OPERAND_NONE
+#define VM_OPERAND_VALUE in.template progRead<Value>()
+#define VM_OPERAND_FLOAT in.template progRead<float>()
+#define VM_OPERAND_INT in.template progRead<int64_t>()
+#define VM_OPERAND_I32 in.template progRead<int32_t>()
+#define VM_OPERAND_I8 in.template progRead<int8_t>()
+#define VM_OPERAND_ADDR in.template progRead<Addr>()
+#define VM_OPERAND_LABEL in.progReadLabel()
+
+#define VM_SWITCH_CASE(op, handler, operand, pops, pushes) \
+    case op: ++in.ip; \
+        in.handler(VM_OPERAND_##operand); \
+        break;
+
+    // The engines stop at CALL_HOST and the call happens out here, with
+    // the engine state written back: an opaque call inside the dispatch
+    // loop would have the compiler spill that state around every handler.
+    // After a call that is done, a fresh run goes on behind it.
+    static RunStatus callHosts(VM& vm, Hooks& hooks, RunStatus (*engine)(VM&, Hooks&, int32_t&))
+    {
+        for (;;)
+        {
+            int32_t hostCall = -1;
+            RunStatus status = engine(vm, hooks, hostCall);
+
+            if (hostCall < 0)
+                return status;
+
+            if (vm.callHost(hostCall) == HOST_PENDING)
+                return RUN_WAITING;
+        }
+    }
+
+    static RunStatus runSwitch(VM& vm, Hooks& hooks)
     {
-        return (Addr) (uintptr_t) progReadValue();
+        return callHosts(vm, hooks, &switchLoop);
     }
 
-    void run()
+    static RunStatus switchLoop(VM& vm, Hooks& hooks, int32_t& hostCall)
     {
-        while (ip)
+        Interpreter in(vm, hooks);
+
+        while (in.ip)
         {
-            printf("%s\n", OPCODE_NAMES[*ip]);
+            hooks.step(in.ip);
 
-            switch (*ip)
+            switch (*in.ip)
             {
-                case HALT: ++ip;
-                    halt();
-                    break;
-                case GOTO: ++ip;
-                    goto_(progReadAddr());
-                    break;
-                case JMP: ++ip;
-                    jmp();
-                    break;
-                case JE: ++ip;
-                    je();
-                    break;
-                case JNE: ++ip;
-                    jne();
-                    break;
-                case JGT: ++ip;
-                    jgt();
-                    break;
-                case JLT: ++ip;
-                    jlt();
-                    break;
-                case JGET: ++ip;
-                    jget();
-                    break;
-                case JLET: ++ip;
-                    jlet();
-                    break;
-
-                case BAND: ++ip;
-                    band();
-                    break;
-                case BOR: ++ip;
-                    bor();
-                    break;
-                case BXOR: ++ip;
-                    bxor();
-                    break;
-                case BSL1: ++ip;
-                    bsl1();
-                    break;
-                case BSR1: ++ip;
-                    bsr1();
-                    break;
-                case BSL: ++ip;
-                    bsl();
-                    break;
-                case BSR: ++ip;
-                    bsr();
-                    break;
-
-                case ADD: ++ip;
-                    add();
-                    break;
-                case SUB: ++ip;
-                    sub();
-                    break;
-                case MUL: ++ip;
-                    mul();
-                    break;
-                case DIV: ++ip;
-                    div();
-                    break;
-                case MOD: ++ip;
-                    mod();
-                    break;
-
-                case LOAD_UCHAR: ++ip;
-                    load_uchar();
-                    break;
-                case LOAD_USHORT: ++ip;
-                    load_ushort();
-                    break;
-                case LOAD_ULONG: ++ip;
-                    load_ulong();
-                    break;
-                case LOAD_UINT: ++ip;
-                    load_uint();
-                    break;
-
-                case LOAD_CHAR: ++ip;
-                    load_char();
-                    break;
-                case LOAD_SHORT: ++ip;
-                    load_short();
-                    break;
-                case LOAD_LONG: ++ip;
-                    load_long();
-                    break;
-                case LOAD_INT: ++ip;
-                    load_int();
-                    break;
-
-                case LOAD_FLOAT: ++ip;
-                    load_float();
-                    break;
-                case LOAD_DOUBLE: ++ip;
-                    load_double();
-                    break;
-                case LOAD_ADDR: ++ip;
-                    load_addr();
-                    break;
-
-                case LOAD_STACK_OFFS_CONST: ++ip;
-                    load_stack_offs_const(progReadValue());
-                    break;
-                case LOAD_VAL_CONST: ++ip;
-                    load_val_const(progReadValue());
-                    break;
-                case LOAD_ADDR_CONST: ++ip;
-                    load_addr_const(progReadAddr());
-                    break;
-
-                case STORE_UCHAR: ++ip;
-                    store_uchar();
-                    break;
-                case STORE_USHORT: ++ip;
-                    store_ushort();
-                    break;
-                case STORE_ULONG: ++ip;
-                    store_ulong();
-                    break;
-                case STORE_UINT: ++ip;
-                    store_uint();
-                    break;
-
-                case STORE_CHAR: ++ip;
-                    store_char();
-                    break;
-                case STORE_SHORT: ++ip;
-                    store_short();
-                    break;
-                case STORE_LONG: ++ip;
-                    store_long();
-                    break;
-                case STORE_INT: ++ip;
-                    store_int();
-                    break;
-
-                case STORE_FLOAT: ++ip;
-                    store_float();
-                    break;
-                case STORE_DOUBLE: ++ip;
-                    store_double();
-                    break;
-                case STORE_ADDR: ++ip;
-                    store_addr();
-                    break;
-
-                case PUSHB: ++ip;
-                    pushb();
-                    break;
-                case POPB: ++ip;
-                    popb();
-                    break;
-                case PUSHB_CONST: ++ip;
-                    pushb_const(progReadValue());
-                    break;
-                case POPB_CONST: ++ip;
-                    popb_const(progReadValue());
-                    break;
+                OPCODE_LIST(VM_SWITCH_CASE)
             }
         }
+
+        hostCall = in.hostCall;
+        return in.save(vm);
+    }
+
+#ifdef __GNUC__
+#define VM_THREADED_ADDR(op, handler, operand, pops, pushes) &&L_##op,
+
+#define VM_THREADED_DISPATCH_NEXT() \
+    hooks.step(in.ip); \
+    goto *dispatchTable[*in.ip]
+
+#define VM_THREADED_BODY(op, handler, operand, pops, pushes) \
+    L_##op: ++in.ip; \
+        in.handler(VM_OPERAND_##operand); \
+        if (op == HALT || ((op == CALL_HOST || (Hooks::canSuspend && isJumpOpcode(op))) && !in.ip)) goto done; \
+        VM_THREADED_DISPATCH_NEXT();
+
+    // Every handler ends in its own indirect jump, so the branch predictor
+    // sees one site per opcode instead of the single switch jump.
+    static RunStatus runThreaded(VM& vm, Hooks& hooks)
+    {
+        return callHosts(vm, hooks, &threadedLoop);
+    }
+
+    static RunStatus threadedLoop(VM& vm, Hooks& hooks, int32_t& hostCall)
+    {
+        static void* const dispatchTable[OPCODE_COUNT] = {
+            OPCODE_LIST(VM_THREADED_ADDR)
+        };
+
+        Interpreter in(vm, hooks);
+
+        if (!in.ip)
+            return RUN_HALTED;
+
+        VM_THREADED_DISPATCH_NEXT();
+        OPCODE_LIST(VM_THREADED_BODY)
+
+    done:
+        hostCall = in.hostCall;
+        return in.save(vm);
     }
+#endif
 
     // *****************
     // * STACK HALPERS *
@@ -229,26 +521,101 @@ struct VM {
 
     void pushVal(Value val)
     {
-        opStack.push_back(val);
+        Slot slot;
+        slot.d = val;
+        stack.push(slot);
     }
 
     void pushAddr(Addr addr)
     {
-        opStack.push_back((uintptr_t) addr);
+        pushVal((uintptr_t) addr);
     }
 
     Value popVal()
     {
-        Value val = opStack.back();
-        opStack.pop_back();
-        return val;
+        return stack.pop().d;
     }
 
     Addr popAddr()
     {
-        Addr addr = (Addr) (uintptr_t) opStack.back();
-        opStack.pop_back();
-        return addr;
+        return (Addr) (uintptr_t) popVal();
+    }
+
+    Value topVal()
+    {
+        return stack.peek().d;
+    }
+
+    void setTopVal(Value val)
+    {
+        Slot slot;
+        slot.d = val;
+        stack.poke(slot);
+    }
+
+    Addr topAddr()
+    {
+        return (Addr) (uintptr_t) topVal();
+    }
+
+    // Typed views. Integer slots carry pointers as raw bits.
+
+    void pushInt(int64_t i)
+    {
+        Slot slot;
+        slot.i = i;
+        stack.push(slot);
+    }
+
+    int64_t popInt()
+    {
+        return stack.pop().i;
+    }
+
+    int64_t topInt()
+    {
+        return stack.peek().i;
+    }
+
+    void setTopInt(int64_t i)
+    {
+        Slot slot;
+        slot.i = i;
+        stack.poke(slot);
+    }
+
+    Addr popPtr()
+    {
+        return (Addr) (intptr_t) popInt();
+    }
+
+    Addr topPtr()
+    {
+        return (Addr) (intptr_t) topInt();
+    }
+
+    void pushFloat(float f)
+    {
+        Slot slot;
+        slot.f = f;
+        stack.push(slot);
+    }
+
+    float popFloat()
+    {
+        return stack.pop().f;
+    }
+
+    float topFloat()
+    {
+        return stack.peek().f;
+    }
+
+    void setTopFloat(float f)
+    {
+        Slot slot;
+        slot.f = f;
+        stack.poke(slot);
     }
 
     int popIval()
@@ -260,14 +627,24 @@ struct VM {
     // * STACK *
     // *********
 
-    void pushb_const(Value bytes)
+    void pushb_const(int32_t bytes)
     {
-        sp += (int) bytes;
+        sp += bytes;
+
+        if (sp > spLimit)
+            growGpStack();
+    }
+
+    void growGpStack()
+    {
+        vm.sp = sp;
+        vm.growGpStack();
+        spLimit = vm.gpLimit;
     }
 
-    void popb_const(Value bytes)
+    void popb_const(int32_t bytes)
     {
-        sp -= (int) bytes;
+        sp -= bytes;
     }
 
     void pushb()
@@ -286,18 +663,18 @@ struct VM {
 
     void goto_(Addr addr)
     {
-        ip = (uint8_t*) addr;
+        jumpTo((uint8_t*) addr);
     }
 
     void jmp()
     {
-        ip = (uint8_t*) popAddr();
+        jumpTo((uint8_t*) popAddr());
     }
 
     void je()
     {
         if (popVal() == 0)
-            ip = (uint8_t*) popAddr();
+            jumpTo((uint8_t*) popAddr());
         else
             popAddr();
     }
@@ -305,7 +682,7 @@ struct VM {
     void jne()
     {
         if (popVal() != 0)
-            ip = (uint8_t*) popAddr();
+            jumpTo((uint8_t*) popAddr());
         else
             popAddr();
     }
@@ -313,7 +690,7 @@ struct VM {
     void jgt()
     {
         if (popVal() > 0)
-            ip = (uint8_t*) popAddr();
+            jumpTo((uint8_t*) popAddr());
         else
             popAddr();
     }
@@ -321,7 +698,7 @@ struct VM {
     void jlt()
     {
         if (popVal() < 0)
-            ip = (uint8_t*) popAddr();
+            jumpTo((uint8_t*) popAddr());
         else
             popAddr();
     }
@@ -329,7 +706,7 @@ struct VM {
     void jlet()
     {
         if (popVal() <= 0)
-            ip = (uint8_t*) popAddr();
+            jumpTo((uint8_t*) popAddr());
         else
             popAddr();
     }
@@ -337,7 +714,7 @@ struct VM {
     void jget()
     {
         if (popVal() >= 0)
-            ip = (uint8_t*) popAddr();
+            jumpTo((uint8_t*) popAddr());
         else
             popAddr();
     }
@@ -354,46 +731,41 @@ struct VM {
     void band()
     {
         int b = popIval();
-        int a = popIval();
-        load_val_const(a & b);
+        setTopVal((int) topVal() & b);
     }
 
     void bor()
     {
         int b = popIval();
-        int a = popIval();
-        load_val_const(a | b);
+        setTopVal((int) topVal() | b);
     }
 
     void bxor()
     {
         int b = popIval();
-        int a = popIval();
-        load_val_const(a ^ b);
+        setTopVal((int) topVal() ^ b);
     }
 
     void bsl1()
     {
-        load_val_const(popIval() << 1);
+        setTopVal((int) topVal() << 1);
     }
 
     void bsr1()
     {
-        load_val_const(popIval() >> 1);
+        setTopVal((int) topVal() >> 1);
     }
 
     void bsl()
     {
         int b = popIval();
-        int a = popIval();
-        load_val_const(a << b);
+        setTopVal((int) topVal() << b);
     }
 
     void bsr()
     {
         int b = popIval();
-        int a = popIval();
-        load_val_const(a >> b);
+        setTopVal((int) topVal() >> b);
     }
 
     // **************
@@ -403,36 +775,31 @@ struct VM {
     void add()
     {
         Value b = popVal();
-        Value a = popVal();
-        load_val_const(a + b);
+        setTopVal(topVal() + b);
     }
 
     void sub()
     {
         Value b = popVal();
-        Value a = popVal();
-        load_val_const(a - b);
+        setTopVal(topVal() - b);
     }
 
     void mul()
     {
         Value b = popVal();
-        Value a = popVal();
-        load_val_const(a * b);
+        setTopVal(topVal() * b);
     }
 
     void div()
     {
         Value b = popVal();
-        Value a = popVal();
-        load_val_const(a / b);
+        setTopVal(topVal() / b);
     }
 
     void mod()
     {
         int b = popIval();
-        int a = popIval();
-        load_val_const(a % b);
+        setTopVal((int) topVal() % b);
     }
 
     // ************
@@ -441,62 +808,62 @@ struct VM {
 
     void load_uchar()
     {
-        pushVal(*(unsigned char*) popAddr());
+        setTopVal(*(unsigned char*) topAddr());
     }
 
     void load_ushort()
     {
-        pushVal(*(unsigned short*) popAddr());
+        setTopVal(*(unsigned short*) topAddr());
     }
 
     void load_ulong()
     {
-        pushVal(*(unsigned long*) popAddr());
+        setTopVal(*(unsigned long*) topAddr());
     }
 
     void load_uint()
     {
-        pushVal(*(unsigned int*) popAddr());
+        setTopVal(*(unsigned int*) topAddr());
     }
 
     void load_char()
     {
-        pushVal(*(char*) popAddr());
+        setTopVal(*(char*) topAddr());
     }
 
     void load_short()
     {
-        pushVal(*(short*) popAddr());
+        setTopVal(*(short*) topAddr());
     }
 
     void load_long()
     {
-        pushVal(*(long*) popAddr());
+        setTopVal(*(long*) topAddr());
     }
 
     void load_int()
     {
-        pushVal(*(int*) popAddr());
+        setTopVal(*(int*) topAddr());
     }
 
     void load_float()
     {
-        pushVal(*(float*) popAddr());
+        setTopVal(*(float*) topAddr());
     }
 
     void load_double()
     {
-        pushVal(*(double*) popAddr());
+        setTopVal(*(double*) topAddr());
     }
 
     void load_addr()
     {
-        pushVal((uintptr_t)*(Addr*) popAddr());
+        setTopVal((uintptr_t)*(Addr*) topAddr());
     }
 
-    void load_stack_offs_const(Value offs)
+    void load_stack_offs_const(int32_t offs)
     {
-        pushVal((uintptr_t) sp + offs);
+        pushVal((uintptr_t) (sp + offs));
     }
 
     void load_val_const(Value lit)
@@ -509,6 +876,16 @@ struct VM {
         pushAddr(addr);
     }
 
+    void load_val_const8(int8_t lit)
+    {
+        pushVal(lit);
+    }
+
+    void load_label_const(Addr addr)
+    {
+        pushAddr(addr);
+    }
+
     // *************
     // * STORE OPS *
     // *************
@@ -578,6 +955,660 @@ struct VM {
         Addr* dest = (Addr*) popAddr();
         *dest = (Addr) (uintptr_t) popVal();
     }
+
+    // *********************
+    // * SUPERINSTRUCTIONS *
+    // *********************
+
+    void load_local_int(int32_t offs)
+    {
+        pushVal(*(int*) (sp + offs));
+    }
+
+    void load_local_float(int32_t offs)
+    {
+        pushVal(*(float*) (sp + offs));
+    }
+
+    void load_local_double(int32_t offs)
+    {
+        pushVal(*(double*) (sp + offs));
+    }
+
+    void load_local_addr(int32_t offs)
+    {
+        pushVal((uintptr_t) *(Addr*) (sp + offs));
+    }
+
+    void store_local_int(int32_t offs)
+    {
+        *(int*) (sp + offs) = (int) popVal();
+    }
+
+    void store_local_float(int32_t offs)
+    {
+        *(float*) (sp + offs) = (float) popVal();
+    }
+
+    void store_local_double(int32_t offs)
+    {
+        *(double*) (sp + offs) = popVal();
+    }
+
+    void store_local_addr(int32_t offs)
+    {
+        *(Addr*) (sp + offs) = (Addr) (uintptr_t) popVal();
+    }
+
+    void add_const(Value lit)
+    {
+        setTopVal(topVal() + lit);
+    }
+
+    void sub_const(Value lit)
+    {
+        setTopVal(topVal() - lit);
+    }
+
+    void mul_const(Value lit)
+    {
+        setTopVal(topVal() * lit);
+    }
+
+    void add_const8(int8_t lit)
+    {
+        setTopVal(topVal() + lit);
+    }
+
+    void sub_const8(int8_t lit)
+    {
+        setTopVal(topVal() - lit);
+    }
+
+    void je_const(Addr addr)
+    {
+        if (popVal() == 0)
+            jumpTo((uint8_t*) addr);
+    }
+
+    void jne_const(Addr addr)
+    {
+        if (popVal() != 0)
+            jumpTo((uint8_t*) addr);
+    }
+
+    void jgt_const(Addr addr)
+    {
+        if (popVal() > 0)
+            jumpTo((uint8_t*) addr);
+    }
+
+    void jlt_const(Addr addr)
+    {
+        if (popVal() < 0)
+            jumpTo((uint8_t*) addr);
+    }
+
+    void jget_const(Addr addr)
+    {
+        if (popVal() >= 0)
+            jumpTo((uint8_t*) addr);
+    }
+
+    void jlet_const(Addr addr)
+    {
+        if (popVal() <= 0)
+            jumpTo((uint8_t*) addr);
+    }
+
+    // Compare-and-branch still subtracts, so infinities and NaNs take the
+    // same path as a SUB followed by the plain branch.
+    void sub_je_const(Addr addr)
+    {
+        Value b = popVal();
+
+        if (popVal() - b == 0)
+            jumpTo((uint8_t*) addr);
+    }
+
+    void sub_jne_const(Addr addr)
+    {
+        Value b = popVal();
+
+        if (popVal() - b != 0)
+            jumpTo((uint8_t*) addr);
+    }
+
+    void sub_jgt_const(Addr addr)
+    {
+        Value b = popVal();
+
+        if (popVal() - b > 0)
+            jumpTo((uint8_t*) addr);
+    }
+
+    void sub_jlt_const(Addr addr)
+    {
+        Value b = popVal();
+
+        if (popVal() - b < 0)
+            jumpTo((uint8_t*) addr);
+    }
+
+    void sub_jget_const(Addr addr)
+    {
+        Value b = popVal();
+
+        if (popVal() - b >= 0)
+            jumpTo((uint8_t*) addr);
+    }
+
+    void sub_jlet_const(Addr addr)
+    {
+        Value b = popVal();
+
+        if (popVal() - b <= 0)
+            jumpTo((uint8_t*) addr);
+    }
+
+    // **********************
+    // * TYPED FLOW CONTROL *
+    // **********************
+
+    void ijmp()
+    {
+        jumpTo((uint8_t*) popPtr());
+    }
+
+    void ije_const(Addr addr)
+    {
+        if (popInt() == 0)
+            jumpTo((uint8_t*) addr);
+    }
+
+    void ijne_const(Addr addr)
+    {
+        if (popInt() != 0)
+            jumpTo((uint8_t*) addr);
+    }
+
+    void ijgt_const(Addr addr)
+    {
+        if (popInt() > 0)
+            jumpTo((uint8_t*) addr);
+    }
+
+    void ijlt_const(Addr addr)
+    {
+        if (popInt() < 0)
+            jumpTo((uint8_t*) addr);
+    }
+
+    void ijget_const(Addr addr)
+    {
+        if (popInt() >= 0)
+            jumpTo((uint8_t*) addr);
+    }
+
+    void ijlet_const(Addr addr)
+    {
+        if (popInt() <= 0)
+            jumpTo((uint8_t*) addr);
+    }
+
+    // ****************
+    // * INTEGER MATH *
+    // ****************
+
+    void iadd()
+    {
+        int64_t b = popInt();
+        setTopInt(topInt() + b);
+    }
+
+    void isub()
+    {
+        int64_t b = popInt();
+        setTopInt(topInt() - b);
+    }
+
+    void imul()
+    {
+        int64_t b = popInt();
+        setTopInt(topInt() * b);
+    }
+
+    void idiv()
+    {
+        int64_t b = popInt();
+        setTopInt(topInt() / b);
+    }
+
+    void imod()
+    {
+        int64_t b = popInt();
+        setTopInt(topInt() % b);
+    }
+
+    void iand()
+    {
+        int64_t b = popInt();
+        setTopInt(topInt() & b);
+    }
+
+    void ior()
+    {
+        int64_t b = popInt();
+        setTopInt(topInt() | b);
+    }
+
+    void ixor()
+    {
+        int64_t b = popInt();
+        setTopInt(topInt() ^ b);
+    }
+
+    void ishl()
+    {
+        int64_t b = popInt();
+        setTopInt(topInt() << b);
+    }
+
+    void ishr()
+    {
+        int64_t b = popInt();
+        setTopInt(topInt() >> b);
+    }
+
+    // **************
+    // * FLOAT MATH *
+    // **************
+
+    void fadd()
+    {
+        float b = popFloat();
+        setTopFloat(topFloat() + b);
+    }
+
+    void fsub()
+    {
+        float b = popFloat();
+        setTopFloat(topFloat() - b);
+    }
+
+    void fmul()
+    {
+        float b = popFloat();
+        setTopFloat(topFloat() * b);
+    }
+
+    void fdiv()
+    {
+        float b = popFloat();
+        setTopFloat(topFloat() / b);
+    }
+
+    // ***************
+    // * CONVERSIONS *
+    // ***************
+
+    void i2d()
+    {
+        Slot slot = stack.peek();
+        double v = (double) slot.i;
+        slot.d = v;
+        stack.poke(slot);
+    }
+
+    void d2i()
+    {
+        Slot slot = stack.peek();
+        int64_t v = (int64_t) slot.d;
+        slot.i = v;
+        stack.poke(slot);
+    }
+
+    void f2d()
+    {
+        Slot slot = stack.peek();
+        double v = (double) slot.f;
+        slot.d = v;
+        stack.poke(slot);
+    }
+
+    void d2f()
+    {
+        Slot slot = stack.peek();
+        float v = (float) slot.d;
+        slot.f = v;
+        stack.poke(slot);
+    }
+
+    void i2f()
+    {
+        Slot slot = stack.peek();
+        float v = (float) slot.i;
+        slot.f = v;
+        stack.poke(slot);
+    }
+
+    void f2i()
+    {
+        Slot slot = stack.peek();
+        int64_t v = (int64_t) slot.f;
+        slot.i = v;
+        stack.poke(slot);
+    }
+
+    // ******************
+    // * TYPED LOAD OPS *
+    // ******************
+
+    void iload_uchar()
+    {
+        setTopInt(*(unsigned char*) topPtr());
+    }
+
+    void iload_ushort()
+    {
+        setTopInt(*(unsigned short*) topPtr());
+    }
+
+    void iload_ulong()
+    {
+        setTopInt(*(unsigned long*) topPtr());
+    }
+
+    void iload_uint()
+    {
+        setTopInt(*(unsigned int*) topPtr());
+    }
+
+    void iload_char()
+    {
+        setTopInt(*(char*) topPtr());
+    }
+
+    void iload_short()
+    {
+        setTopInt(*(short*) topPtr());
+    }
+
+    void iload_long()
+    {
+        setTopInt(*(long*) topPtr());
+    }
+
+    void iload_int()
+    {
+        setTopInt(*(int*) topPtr());
+    }
+
+    void iload_addr()
+    {
+        setTopInt((intptr_t) *(Addr*) topPtr());
+    }
+
+    void fload_float()
+    {
+        setTopFloat(*(float*) topPtr());
+    }
+
+    void dload_double()
+    {
+        setTopVal(*(double*) topPtr());
+    }
+
+    void iload_const(int64_t lit)
+    {
+        pushInt(lit);
+    }
+
+    void iload_const32(int32_t lit)
+    {
+        pushInt(lit);
+    }
+
+    void iload_addr_const(Addr addr)
+    {
+        pushInt((intptr_t) addr);
+    }
+
+    void iload_label_const(Addr addr)
+    {
+        pushInt((intptr_t) addr);
+    }
+
+    void iload_stack_offs_const(int32_t offs)
+    {
+        pushInt((intptr_t) (sp + offs));
+    }
+
+    void fload_const(float lit)
+    {
+        pushFloat(lit);
+    }
+
+    // *******************
+    // * TYPED STORE OPS *
+    // *******************
+
+    void istore_uchar()
+    {
+        unsigned char* dest = (unsigned char*) popPtr();
+        *dest = (unsigned char) popInt();
+    }
+
+    void istore_ushort()
+    {
+        unsigned short* dest = (unsigned short*) popPtr();
+        *dest = (unsigned short) popInt();
+    }
+
+    void istore_ulong()
+    {
+        unsigned long* dest = (unsigned long*) popPtr();
+        *dest = (unsigned long) popInt();
+    }
+
+    void istore_uint()
+    {
+        unsigned int* dest = (unsigned int*) popPtr();
+        *dest = (unsigned int) popInt();
+    }
+
+    void istore_char()
+    {
+        char* dest = (char*) popPtr();
+        *dest = (char) popInt();
+    }
+
+    void istore_short()
+    {
+        short* dest = (short*) popPtr();
+        *dest = (short) popInt();
+    }
+
+    void istore_long()
+    {
+        long* dest = (long*) popPtr();
+        *dest = (long) popInt();
+    }
+
+    void istore_int()
+    {
+        int* dest = (int*) popPtr();
+        *dest = (int) popInt();
+    }
+
+    void istore_addr()
+    {
+        Addr* dest = (Addr*) popPtr();
+        *dest = (Addr) (intptr_t) popInt();
+    }
+
+    void fstore_float()
+    {
+        float* dest = (float*) popPtr();
+        *dest = popFloat();
+    }
+
+    void dstore_double()
+    {
+        double* dest = (double*) popPtr();
+        *dest = popVal();
+    }
+
+    // **************
+    // * HOST CALLS *
+    // **************
+
+    // Stops the run for callHosts, which makes the call.
+    void call_host(int32_t index)
+    {
+        hostCall = index;
+        resumeAt = ip;
+        ip = nullptr;
+    }
+
+    // *************
+    // * FUNCTIONS *
+    // *************
+
+    // The callee's frame starts at the sp it was called with: locals it
+    // reserves with PUSHB_CONST sit at fp + 0 and up. RET drops the frame
+    // along with anything still pushed above it.
+    void call(Addr target)
+    {
+        *calls++ = CallFrame{ip, fp};
+        fp = sp;
+        jumpTo((uint8_t*) target);
+    }
+
+    void ret()
+    {
+        CallFrame frame = *--calls;
+        sp = fp;
+        fp = frame.fp;
+        jumpTo(frame.ret);
+    }
+
+    // Leaf fast path: a function that calls no other keeps its return
+    // address in leafRet and runs in the caller's frame, so the call stack
+    // is never touched.
+    void call_leaf(Addr target)
+    {
+        leafRet = ip;
+        jumpTo((uint8_t*) target);
+    }
+
+    void ret_leaf()
+    {
+        jumpTo(leafRet);
+    }
+
+    void iload_frame_offs_const(int32_t offs)
+    {
+        pushInt((intptr_t) (fp + offs));
+    }
+
+    void iload_frame_long(int32_t offs)
+    {
+        pushInt(*(int64_t*) (fp + offs));
+    }
+
+    void istore_frame_long(int32_t offs)
+    {
+        *(int64_t*) (fp + offs) = popInt();
+    }
+
+    // ************
+    // * BULK OPS *
+    // ************
+
+    // One dispatch for a whole array; bulkOp picks the SIMD kernels.
+    void bulk(Opcode op)
+    {
+        Slot args[3];
+
+        for (int i = OPCODE_POPS[op] - 1; i >= 0; --i)
+            args[i] = stack.pop();
+
+        Slot res = bulkOp(op, args);
+
+        if (OPCODE_PUSHES[op])
+            stack.push(res);
+    }
+
+    void block_copy()
+    {
+        bulk(BLOCK_COPY);
+    }
+
+    void block_fill()
+    {
+        bulk(BLOCK_FILL);
+    }
+
+    void isum_int()
+    {
+        bulk(ISUM_INT);
+    }
+
+    void imin_int()
+    {
+        bulk(IMIN_INT);
+    }
+
+    void imax_int()
+    {
+        bulk(IMAX_INT);
+    }
+
+    void idot_int()
+    {
+        bulk(IDOT_INT);
+    }
+
+    void fsum_float()
+    {
+        bulk(FSUM_FLOAT);
+    }
+
+    void fmin_float()
+    {
+        bulk(FMIN_FLOAT);
+    }
+
+    void fmax_float()
+    {
+        bulk(FMAX_FLOAT);
+    }
+
+    void fdot_float()
+    {
+        bulk(FDOT_FLOAT);
+    }
+
+    void dsum_double()
+    {
+        bulk(DSUM_DOUBLE);
+    }
+
+    void dmin_double()
+    {
+        bulk(DMIN_DOUBLE);
+    }
+
+    void dmax_double()
+    {
+        bulk(DMAX_DOUBLE);
+    }
+
+    void ddot_double()
+    {
+        bulk(DDOT_DOUBLE);
+    }
 };
 
 #endif
\ No newline at end of file
@@ -1,7 +1,20 @@
 #ifndef _VMTYPES_HPP_
 #define _VMTYPES_HPP_
 
+#include <cstdint>
+
 typedef double Value;
 typedef void* Addr;
 
+// Untyped 64-bit operand stack slot. The generic instruction set keeps
+// treating slots as doubles; the typed I*/F* instructions use the integer
+// and float views, so integer math and pointers never round-trip through
+// floating point.
+union Slot {
+    int64_t i;
+    double d;
+    float f;
+    Addr a;
+};
+
 #endif
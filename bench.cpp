@@ -0,0 +1,773 @@
+// Dispatch and opcode throughput benchmarks. Built and run by `make bench`;
+// pass a workload name to run only that one and a repeat count after it.
+//
+// Output is one CSV row per workload and engine. Lines starting with '#'
+// describe the build so results from different flags can be told apart.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+#include "VM.hpp"
+#include "Program.hpp"
+#include "Assembler.hpp"
+#include "Jit.hpp"
+#include "RegVM.hpp"
+#include "Runtime.hpp"
+#include "Batch.hpp"
+#include "Scanner.hpp"
+#include "ScanSkip.hpp"
+#include "AST.hpp"
+
+#ifndef BENCH_FLAGS
+#define BENCH_FLAGS "unknown"
+#endif
+
+#define BENCH_REPEAT 7
+#define BENCH_INVOCATIONS 200000
+
+struct CountHooks: public NoHooks {
+    uint64_t count;
+
+    CountHooks(): count(0)
+    {
+    }
+
+    void step(uint8_t const*)
+    {
+        ++count;
+    }
+};
+
+// Runs start at entry, or at offset 0 without one.
+struct Workload {
+    char const* name;
+    vector<AsmToken> (*build)();
+    char const* entry;
+};
+
+static int64_t sink;
+static int32_t memory[4096];
+
+static double nowNs()
+{
+    return chrono::duration<double, nano>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// *************
+// * WORKLOADS *
+// *************
+
+// Integer multiply/add chain with the loop counter in a local.
+vector<AsmToken> arithInt()
+{
+    return {
+        PUSHB_CONST, 8,
+        ILOAD_CONST, 2000000,
+        ILOAD_STACK_OFFS_CONST, -8,
+        ISTORE_LONG,
+        ILOAD_CONST, 1,
+
+        "loop",
+        ILOAD_CONST, 3, IMUL,
+        ILOAD_CONST, 7, IADD,
+        ILOAD_CONST, 0xffff, IAND,
+
+        ILOAD_STACK_OFFS_CONST, -8, ILOAD_LONG,
+        ILOAD_CONST, 1, ISUB,
+        ILOAD_STACK_OFFS_CONST, -8, ISTORE_LONG,
+        ILOAD_STACK_OFFS_CONST, -8, ILOAD_LONG,
+        IJGT_CONST, "loop",
+
+        ILOAD_ADDR_CONST, &sink, ISTORE_LONG,
+        POPB_CONST, 8,
+        HALT,
+    };
+}
+
+// The same chain in the generic double instruction set, written the way
+// a naive front end would so the peephole pass has work to do.
+vector<AsmToken> arithDouble()
+{
+    return {
+        PUSHB_CONST, 8,
+        LOAD_VAL_CONST, 2000000,
+        LOAD_STACK_OFFS_CONST, -8,
+        STORE_DOUBLE,
+        LOAD_VAL_CONST, 1,
+
+        "loop",
+        LOAD_VAL_CONST, 0.5, MUL,
+        LOAD_VAL_CONST, 7, ADD,
+
+        LOAD_STACK_OFFS_CONST, -8, LOAD_DOUBLE,
+        LOAD_VAL_CONST, 1, SUB,
+        LOAD_STACK_OFFS_CONST, -8, STORE_DOUBLE,
+        LOAD_ADDR_CONST, "loop",
+        LOAD_STACK_OFFS_CONST, -8, LOAD_DOUBLE,
+        JGT,
+
+        D2I,
+        ILOAD_ADDR_CONST, &sink, ISTORE_LONG,
+        POPB_CONST, 8,
+        HALT,
+    };
+}
+
+// Read-modify-write over a 16 KB array.
+vector<AsmToken> memoryLoop()
+{
+    return {
+        PUSHB_CONST, 8,
+        ILOAD_CONST, 1000000,
+        ILOAD_STACK_OFFS_CONST, -8,
+        ISTORE_LONG,
+
+        "loop",
+        ILOAD_STACK_OFFS_CONST, -8, ILOAD_LONG,
+        ILOAD_CONST, 2, ISHL,
+        ILOAD_CONST, sizeof memory - 1, IAND,
+        ILOAD_ADDR_CONST, memory, IADD,
+        ILOAD_INT,
+        ILOAD_CONST, 1, IADD,
+
+        ILOAD_STACK_OFFS_CONST, -8, ILOAD_LONG,
+        ILOAD_CONST, 2, ISHL,
+        ILOAD_CONST, sizeof memory - 1, IAND,
+        ILOAD_ADDR_CONST, memory, IADD,
+        ISTORE_INT,
+
+        ILOAD_STACK_OFFS_CONST, -8, ILOAD_LONG,
+        ILOAD_CONST, 1, ISUB,
+        ILOAD_STACK_OFFS_CONST, -8, ISTORE_LONG,
+        ILOAD_STACK_OFFS_CONST, -8, ILOAD_LONG,
+        IJGT_CONST, "loop",
+
+        POPB_CONST, 8,
+        HALT,
+    };
+}
+
+// An inner loop of 1 to 4 iterations depending on the outer counter, so
+// the backward branches are taken in a data-dependent pattern.
+vector<AsmToken> branchy()
+{
+    return {
+        PUSHB_CONST, 16,
+        ILOAD_CONST, 500000,
+        ILOAD_STACK_OFFS_CONST, -8,
+        ISTORE_LONG,
+
+        "outer",
+        ILOAD_STACK_OFFS_CONST, -8, ILOAD_LONG,
+        ILOAD_CONST, 5, IMUL,
+        ILOAD_CONST, 3, IAND,
+        ILOAD_CONST, 1, IADD,
+        ILOAD_STACK_OFFS_CONST, -16, ISTORE_LONG,
+
+        "inner",
+        ILOAD_STACK_OFFS_CONST, -16, ILOAD_LONG,
+        ILOAD_CONST, 1, ISUB,
+        ILOAD_STACK_OFFS_CONST, -16, ISTORE_LONG,
+        ILOAD_STACK_OFFS_CONST, -16, ILOAD_LONG,
+        IJGT_CONST, "inner",
+
+        ILOAD_STACK_OFFS_CONST, -8, ILOAD_LONG,
+        ILOAD_CONST, 1, ISUB,
+        ILOAD_STACK_OFFS_CONST, -8, ISTORE_LONG,
+        ILOAD_STACK_OFFS_CONST, -8, ILOAD_LONG,
+        IJGT_CONST, "outer",
+
+        POPB_CONST, 16,
+        HALT,
+    };
+}
+
+// Allocates a frame, works on its locals and frees it every iteration.
+vector<AsmToken> frames()
+{
+    return {
+        PUSHB_CONST, 8,
+        ILOAD_CONST, 1000000,
+        ILOAD_STACK_OFFS_CONST, -8,
+        ISTORE_LONG,
+
+        "loop",
+        PUSHB_CONST, 32,
+        ILOAD_CONST, 2, ILOAD_STACK_OFFS_CONST, -8, ISTORE_LONG,
+        ILOAD_CONST, 3, ILOAD_STACK_OFFS_CONST, -16, ISTORE_LONG,
+        ILOAD_STACK_OFFS_CONST, -8, ILOAD_LONG,
+        ILOAD_STACK_OFFS_CONST, -16, ILOAD_LONG,
+        IADD,
+        ILOAD_STACK_OFFS_CONST, -24, ISTORE_LONG,
+        POPB_CONST, 32,
+
+        ILOAD_STACK_OFFS_CONST, -8, ILOAD_LONG,
+        ILOAD_CONST, 1, ISUB,
+        ILOAD_STACK_OFFS_CONST, -8, ISTORE_LONG,
+        ILOAD_STACK_OFFS_CONST, -8, ILOAD_LONG,
+        IJGT_CONST, "loop",
+
+        POPB_CONST, 8,
+        HALT,
+    };
+}
+
+// Calls a function with two frame locals every iteration, which in turn
+// calls a leaf function. The assembler needs labels defined before use, so
+// the callees come first.
+vector<AsmToken> calls()
+{
+    return {
+        "twice",
+        ILOAD_CONST, 2, IMUL,
+        RET_LEAF,
+
+        "mix",
+        PUSHB_CONST, 16,
+        ILOAD_FRAME_OFFS_CONST, 0, ISTORE_LONG,
+        ILOAD_FRAME_OFFS_CONST, 8, ISTORE_LONG,
+        ILOAD_FRAME_OFFS_CONST, 0, ILOAD_LONG,
+        CALL_LEAF, "twice",
+        ILOAD_FRAME_OFFS_CONST, 8, ILOAD_LONG,
+        IADD,
+        RET,
+
+        "main",
+        PUSHB_CONST, 8,
+        ILOAD_CONST, 1000000,
+        ILOAD_STACK_OFFS_CONST, -8,
+        ISTORE_LONG,
+
+        "loop",
+        ILOAD_STACK_OFFS_CONST, -8, ILOAD_LONG,
+        ILOAD_CONST, 3,
+        CALL, "mix",
+        ILOAD_ADDR_CONST, &sink, ISTORE_LONG,
+
+        ILOAD_STACK_OFFS_CONST, -8, ILOAD_LONG,
+        ILOAD_CONST, 1, ISUB,
+        ILOAD_STACK_OFFS_CONST, -8, ISTORE_LONG,
+        ILOAD_STACK_OFFS_CONST, -8, ILOAD_LONG,
+        IJGT_CONST, "loop",
+
+        POPB_CONST, 8,
+        HALT,
+    };
+}
+
+// Sums the 16 KB array with one bulk instruction per iteration, against
+// the element-at-a-time "memory" workload.
+vector<AsmToken> bulkSum()
+{
+    return {
+        PUSHB_CONST, 8,
+        ILOAD_CONST, 100000,
+        ILOAD_STACK_OFFS_CONST, -8,
+        ISTORE_LONG,
+
+        "loop",
+        ILOAD_ADDR_CONST, memory, ILOAD_CONST, sizeof memory / sizeof memory[0],
+        ISUM_INT,
+        ILOAD_ADDR_CONST, &sink, ISTORE_LONG,
+
+        ILOAD_STACK_OFFS_CONST, -8, ILOAD_LONG,
+        ILOAD_CONST, 1, ISUB,
+        ILOAD_STACK_OFFS_CONST, -8, ISTORE_LONG,
+        ILOAD_STACK_OFFS_CONST, -8, ILOAD_LONG,
+        IJGT_CONST, "loop",
+
+        POPB_CONST, 8,
+        HALT,
+    };
+}
+
+// Straight-line code with a label every few instructions, for the
+// assembler benchmark.
+vector<AsmToken> largeStream()
+{
+    static vector<string> labels;
+    vector<AsmToken> toks;
+
+    labels.resize(20000);
+
+    for (size_t i = 0; i < labels.size(); ++i)
+    {
+        labels[i] = "l" + to_string(i);
+        toks.insert(toks.end(), {
+            labels[i].c_str(),
+            LOAD_STACK_OFFS_CONST, -8, LOAD_INT,
+            LOAD_VAL_CONST, 1, ADD,
+            LOAD_STACK_OFFS_CONST, -8, STORE_INT,
+            LOAD_ADDR_CONST, labels[i].c_str(),
+            LOAD_STACK_OFFS_CONST, -8, LOAD_INT,
+            JLT,
+        });
+    }
+
+    toks.push_back(HALT);
+    return toks;
+}
+
+Workload const workloads[] = {
+    {"arith_int", arithInt, nullptr},
+    {"arith_double", arithDouble, nullptr},
+    {"memory", memoryLoop, nullptr},
+    {"branch", branchy, nullptr},
+    {"frame", frames, nullptr},
+    {"call", calls, "main"},
+    {"bulk_sum", bulkSum, nullptr},
+};
+
+// *************
+// * REPORTING *
+// *************
+
+static void report(char const* workload, char const* engine, char const* stack, uint64_t instructions,
+        size_t codeBytes, vector<double>& samples)
+{
+    sort(samples.begin(), samples.end());
+    double best = samples.front();
+    double median = samples[samples.size() / 2];
+
+    printf("%s,%s,%s,%lu,%zu,%.0f,%.0f,%.3f,%.1f\n", workload, engine, stack, (unsigned long) instructions, codeBytes,
+            best, median, best / instructions, instructions / best * 1e3);
+}
+
+template <typename Stack, bool threaded>
+static void runEngine(char const* workload, char const* engine, char const* stack, Program& prog,
+        uint8_t* entry, uint64_t instructions, int repeat)
+{
+    vector<double> samples;
+
+    for (int i = 0; i <= repeat; ++i)
+    {
+        VM vm(prog.data);
+        vm.reset(entry);
+        NoHooks hooks;
+        double start = nowNs();
+
+#ifdef VM_HAS_THREADED_DISPATCH
+        if (threaded)
+            vm.runThreaded<Stack>(hooks);
+        else
+#endif
+            vm.runSwitch<Stack>(hooks);
+
+        // The first run only warms caches and page tables.
+        if (i > 0)
+            samples.push_back(nowNs() - start);
+    }
+
+    report(workload, engine, stack, instructions, prog.size(), samples);
+}
+
+// The JIT compiles during the warm-up run, so samples are native only.
+static void runJit(char const* workload, Program& prog, uint8_t* entry, uint64_t instructions, int repeat)
+{
+    vector<double> samples;
+    Jit jit(prog.data, prog.size());
+
+    for (int i = 0; i <= repeat; ++i)
+    {
+        VM vm(prog.data);
+        vm.reset(entry);
+        double start = nowNs();
+        jit.run(vm);
+
+        if (i > 0)
+            samples.push_back(nowNs() - start);
+    }
+
+    report(workload, "jit", "memory", instructions, prog.size(), samples);
+}
+
+// Translation happens once up front; the register engines share the
+// stack engines' instruction count so ns_per_instr compares like with
+// like.
+template <bool threaded>
+static void runRegister(char const* workload, Program& prog, RegProgram const& regProg, uint8_t* entry,
+        uint64_t instructions, int repeat)
+{
+    vector<double> samples;
+
+    for (int i = 0; i <= repeat; ++i)
+    {
+        VM vm(prog.data);
+        vm.reset(entry);
+        double start = nowNs();
+
+#ifdef VM_HAS_THREADED_DISPATCH
+        if (threaded)
+            RegInterpreter::runThreaded(vm, regProg);
+        else
+#endif
+            RegInterpreter::runSwitch(vm, regProg);
+
+        if (i > 0)
+            samples.push_back(nowNs() - start);
+    }
+
+    report(workload, threaded ? "reg_threaded" : "reg_switch", "registers", instructions,
+            regProg.code.size() * sizeof (RegInstr), samples);
+}
+
+static void benchWorkload(Workload const& w, int repeat)
+{
+    Program prog;
+    vector<AsmToken> toks = w.build();
+    Assembler assembler(prog, toks);
+    uint8_t* entry = w.entry ? prog.data + assembler.labMap[w.entry] : prog.data;
+
+    CountHooks counter;
+    VM countVm(prog.data);
+    countVm.reset(entry);
+    countVm.runSwitch<MemoryStack>(counter);
+
+    runEngine<MemoryStack, false>(w.name, "switch", "memory", prog, entry, counter.count, repeat);
+    runEngine<CachedTosStack, false>(w.name, "switch", "tos", prog, entry, counter.count, repeat);
+#ifdef VM_HAS_THREADED_DISPATCH
+    runEngine<MemoryStack, true>(w.name, "threaded", "memory", prog, entry, counter.count, repeat);
+    runEngine<CachedTosStack, true>(w.name, "threaded", "tos", prog, entry, counter.count, repeat);
+#endif
+#ifdef VM_HAS_JIT
+    runJit(w.name, prog, entry, counter.count, repeat);
+#endif
+
+    RegProgram regProg;
+    RegTranslator translator(prog.data, prog.size(), regProg, entry - prog.data);
+
+    if (!translator.translate())
+    {
+        printf("# %s: no register version: %s\n", w.name, translator.error.c_str());
+        return;
+    }
+
+    runRegister<false>(w.name, prog, regProg, entry, counter.count, repeat);
+#ifdef VM_HAS_THREADED_DISPATCH
+    runRegister<true>(w.name, prog, regProg, entry, counter.count, repeat);
+#endif
+}
+
+// Instructions here are assembled instructions, not executed ones.
+static void benchAssembler(int repeat)
+{
+    vector<AsmToken> toks = largeStream();
+    vector<double> samples;
+    uint64_t instructions = 0;
+    size_t codeBytes = 0;
+
+    for (AsmToken const& tok : toks)
+        instructions += tok.type == AsmToken::OPCODE;
+
+    for (int i = 0; i <= repeat; ++i)
+    {
+        double start = nowNs();
+        Program prog;
+        Assembler assembler(prog, toks);
+        codeBytes = prog.size();
+        double elapsed = nowNs() - start;
+
+        if (i > 0)
+            samples.push_back(elapsed);
+    }
+
+    report("assemble", "assembler", "-", instructions, codeBytes, samples);
+}
+
+// Many short invocations of one script through the worker pool, with one
+// worker and with one per hardware thread. Instructions are summed over
+// all invocations.
+static void benchRuntime(int repeat)
+{
+    Program prog;
+    vector<AsmToken> toks = {
+        PUSHB_CONST, 8,
+        ILOAD_STACK_OFFS_CONST, -8, ISTORE_LONG,
+        ILOAD_STACK_OFFS_CONST, -8, ILOAD_LONG,
+        ILOAD_STACK_OFFS_CONST, -8, ILOAD_LONG,
+        IMUL,
+        ILOAD_CONST, 1, IADD,
+        POPB_CONST, 8,
+        HALT,
+    };
+    Assembler assembler(prog, toks);
+
+    CountHooks counter;
+    VM vm(prog.data);
+    vm.opStack.top++->i = 3;
+    vm.runSwitch<MemoryStack>(counter);
+
+    vector<unsigned> counts = {1};
+
+    if (thread::hardware_concurrency() > 1)
+        counts.push_back(thread::hardware_concurrency());
+
+    for (unsigned workers : counts)
+    {
+        vector<double> samples;
+        Runtime runtime(prog.data, workers);
+
+        for (int i = 0; i <= repeat; ++i)
+        {
+            double start = nowNs();
+
+            for (int n = 0; n < BENCH_INVOCATIONS; ++n)
+            {
+                Invocation inv = {0, 1, {}, nullptr, nullptr};
+                inv.args[0].i = n;
+                runtime.submit(inv);
+            }
+
+            runtime.wait();
+
+            if (i > 0)
+                samples.push_back(nowNs() - start);
+        }
+
+        string stack = "workers_" + to_string(workers);
+        report("invoke", "runtime", stack.c_str(), counter.count * BENCH_INVOCATIONS, prog.size(), samples);
+    }
+}
+
+// The same script as benchRuntime over BENCH_INVOCATIONS records of one
+// column, on one thread and on one per hardware thread.
+static void benchBatch(int repeat)
+{
+    Program prog;
+    vector<AsmToken> toks = {
+        ILOAD_LONG,
+        PUSHB_CONST, 8,
+        ILOAD_STACK_OFFS_CONST, -8, ISTORE_LONG,
+        ILOAD_STACK_OFFS_CONST, -8, ILOAD_LONG,
+        ILOAD_STACK_OFFS_CONST, -8, ILOAD_LONG,
+        IMUL,
+        ILOAD_CONST, 1, IADD,
+        POPB_CONST, 8,
+        HALT,
+    };
+    Assembler assembler(prog, toks);
+
+    vector<int64_t> inputs(BENCH_INVOCATIONS);
+    vector<Slot> results(BENCH_INVOCATIONS);
+
+    for (size_t i = 0; i < inputs.size(); ++i)
+        inputs[i] = i;
+
+    CountHooks counter;
+    VM vm(prog.data);
+    vm.opStack.top++->i = (intptr_t) inputs.data();
+    vm.runSwitch<MemoryStack>(counter);
+
+    Batch batch = {inputs.size(), 1, {{(uint8_t*) inputs.data(), sizeof (int64_t)}}, results.data()};
+    vector<unsigned> counts = {1};
+
+    if (thread::hardware_concurrency() > 1)
+        counts.push_back(thread::hardware_concurrency());
+
+    for (unsigned threads : counts)
+    {
+        vector<double> samples;
+        BatchRunner runner(prog.data, 0, threads);
+
+        for (int i = 0; i <= repeat; ++i)
+        {
+            double start = nowNs();
+            runner.run(batch);
+
+            if (i > 0)
+                samples.push_back(nowNs() - start);
+        }
+
+        string stack = "threads_" + to_string(threads);
+        report("batch", "batch", stack.c_str(), counter.count * BENCH_INVOCATIONS, prog.size(), samples);
+    }
+}
+
+// About 4 MB of indented, machine-generated looking S-expressions.
+static string generatedSource()
+{
+    string src;
+
+    for (int i = 0; src.size() < 4 * 1024 * 1024; ++i)
+    {
+        src += "(defun f" + to_string(i) + " (x y)\n";
+
+        for (int depth = 1; depth <= 6; ++depth)
+            src += string(4 * depth, ' ') + "(let ((tmp" + to_string(depth) + " (add x " + to_string(i * depth) + ")))\n";
+
+        src += string(28, ' ') + "(mul tmp6 y)" + string(6, ')') + ")\n\n";
+    }
+
+    return src;
+}
+
+// Tokenizes the same source into a list of owning tokens, into a fresh
+// vector of views, into one vector of views reused across runs, and
+// streamed from a file without keeping the tokens.
+// Instructions here are tokens, code bytes source bytes.
+static void benchScanner(int repeat)
+{
+    string src = generatedSource();
+    char path[] = "/tmp/iceberg-bench-scan-XXXXXX";
+    vector<double> listSamples, viewSamples, reuseSamples, streamSamples;
+    vector<TokenView> reused;
+    uint64_t tokens = 0;
+
+    // Too big for a pipe without a writer thread, so the stream reads a
+    // private temporary file, unlinked as soon as it is open and rewound
+    // for every run.
+    int fd = mkstemp(path);
+
+    if (fd < 0)
+        die("Failed to create the scanner input file!");
+
+    unlink(path);
+
+    for (size_t done = 0; done < src.size();)
+    {
+        ssize_t n = write(fd, src.data() + done, src.size() - done);
+
+        if (n <= 0)
+            die("Failed to write the scanner input file!");
+
+        done += n;
+    }
+
+    for (int i = 0; i <= repeat; ++i)
+    {
+        double start = nowNs();
+        Scanner listScanner(src.c_str());
+        tokens = listScanner.scan().size();
+        double listDone = nowNs();
+        Scanner viewScanner(src.c_str());
+        sink += viewScanner.scanViews().size();
+        double viewDone = nowNs();
+        Scanner reuseScanner(src.c_str());
+        reused.clear();
+        reuseScanner.scanViews(reused);
+        sink += reused.size();
+        double reuseDone = nowNs();
+
+        if (lseek(fd, 0, SEEK_SET) != 0)
+            die("Failed to rewind the scanner input file!");
+
+        StreamScanner stream(fd);
+
+        while (stream.nextView().type != Token::END_OF_INPUT)
+            ++sink;
+
+        double streamDone = nowNs();
+
+        if (i > 0)
+        {
+            listSamples.push_back(listDone - start);
+            viewSamples.push_back(viewDone - listDone);
+            reuseSamples.push_back(reuseDone - viewDone);
+            streamSamples.push_back(streamDone - reuseDone);
+        }
+    }
+
+    close(fd);
+    report("scan", "scanner", "list", tokens, src.size(), listSamples);
+    report("scan", "scanner", "views", tokens, src.size(), viewSamples);
+    report("scan", "scanner", "views_reused", tokens, src.size(), reuseSamples);
+    report("scan", "scanner", "stream", tokens, src.size(), streamSamples);
+}
+
+// About 4 MB of expressions nested 256 deep, each level holding a name,
+// a literal and the next level.
+static string nestedSource()
+{
+    string src;
+
+    while (src.size() < 4 * 1024 * 1024)
+    {
+        for (int depth = 0; depth < 256; ++depth)
+            src += "(op" + to_string(depth) + " " + to_string(depth * 7) + " ";
+
+        src += string(256, ')') + "\n";
+    }
+
+    return src;
+}
+
+// Parses the scanned source into one arena, dropped with a reset after
+// each run. Instructions here are tokens, code bytes source bytes.
+// RecursiveParser is the baseline the iterative parser replaced.
+template <typename P>
+static void benchParse(char const* engine, char const* input, string const& src, int repeat)
+{
+    Scanner scanner(src.c_str());
+    vector<TokenView> toks = scanner.scanViews();
+    ASTArena ast;
+    vector<double> samples;
+
+    for (int i = 0; i <= repeat; ++i)
+    {
+        double start = nowNs();
+        P parser(toks.begin(), ast);
+
+        while (!parser.end())
+            sink += parser.readExpr()->type;
+
+        ast.reset();
+
+        if (i > 0)
+            samples.push_back(nowNs() - start);
+    }
+
+    report("parse", engine, input, toks.size(), src.size(), samples);
+}
+
+int main(int argc, char** argv)
+{
+    char const* only = argc > 1 ? argv[1] : nullptr;
+    int repeat = argc > 2 ? atoi(argv[2]) : BENCH_REPEAT;
+
+    if (repeat < 1)
+        repeat = 1;
+
+    printf("# compiler=%s\n", __VERSION__);
+    printf("# flags=%s\n", BENCH_FLAGS);
+    printf("# bulk=%s\n", bulkKernels().name);
+    printf("# scan=%s\n", scanKernels().name);
+    printf("# repeat=%d\n", repeat);
+    printf("workload,engine,stack,instructions,code_bytes,best_ns,median_ns,ns_per_instr,minstr_per_sec\n");
+
+    for (Workload const& w : workloads)
+        if (!only || w.name == string(only))
+            benchWorkload(w, repeat);
+
+    if (!only || string(only) == "assemble")
+        benchAssembler(repeat);
+
+    if (!only || string(only) == "invoke")
+        benchRuntime(repeat);
+
+    if (!only || string(only) == "batch")
+        benchBatch(repeat);
+
+    if (!only || string(only) == "scan")
+        benchScanner(repeat);
+
+    if (!only || string(only) == "parse")
+    {
+        string generated = generatedSource();
+        string nested = nestedSource();
+
+        benchParse<Parser>("parser", "generated", generated, repeat);
+        benchParse<RecursiveParser>("recursive", "generated", generated, repeat);
+        benchParse<Parser>("parser", "nested", nested, repeat);
+        benchParse<RecursiveParser>("recursive", "nested", nested, repeat);
+    }
+
+    return 0;
+}
@@ -1 +1 @@
-re2c -o Scanner.cpp Scanner.re2c
+re2c --no-generation-date -o Scanner.cpp Scanner.re2c
@@ -53,7 +53,7 @@ FFLAGS=
 ASFLAGS=
 
 # Link Libraries and Options
-LDLIBSOPTIONS=
+LDLIBSOPTIONS=-pthread
 
 # Build Targets
 .build-conf: ${BUILD_SUBPROJECTS}
@@ -66,12 +66,12 @@ ${CND_DISTDIR}/${CND_CONF}/${CND_PLATFORM}/iceberg: ${OBJECTFILES}
 ${OBJECTDIR}/Scanner.o: Scanner.cpp 
 	${MKDIR} -p ${OBJECTDIR}
 	${RM} "$@.d"
-	$(COMPILE.cc) -g -std=c++11 -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/Scanner.o Scanner.cpp
+	$(COMPILE.cc) -g -std=c++11 -pthread -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/Scanner.o Scanner.cpp
 
 ${OBJECTDIR}/vm.o: vm.cpp 
 	${MKDIR} -p ${OBJECTDIR}
 	${RM} "$@.d"
-	$(COMPILE.cc) -g -std=c++11 -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/vm.o vm.cpp
+	$(COMPILE.cc) -g -std=c++11 -pthread -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/vm.o vm.cpp
 
 # Subprojects
 .build-subprojects:
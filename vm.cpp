@@ -6,6 +6,11 @@
 #include <string>
 #include <stdexcept>
 #include <cstring>
+#include <chrono>
+#include <thread>
+
+#include <fcntl.h>
+#include <unistd.h>
 
 using namespace std;
 
@@ -13,7 +18,17 @@ using namespace std;
 #include "VM.hpp"
 #include "Program.hpp"
 #include "Assembler.hpp"
+#include "Image.hpp"
+#include "Profile.hpp"
+#include "Jit.hpp"
+#include "RegVM.hpp"
+#include "Runtime.hpp"
+#include "Batch.hpp"
+#include "Budget.hpp"
+#include "EventLoop.hpp"
 #include "Scanner.hpp"
+#include "ScanSkip.hpp"
+#include "AST.hpp"
 
 struct Var {
 
@@ -204,11 +219,629 @@ void sumTest()
     Assembler assembler(prog, toks);
 
     VM vm(prog.data);
-    vm.run();
+    RingTrace trace(prog.data);
+    vm.run(trace);
+    trace.dump(stdout);
 
     printf("RESULT = %d\n", res);
 }
 
+void typedSumTest()
+{
+    int arr[] = {2, 3, 4, 5};
+    long res;
+
+    Program prog;
+    vector<AsmToken> toks = {
+        PUSHB_CONST, sizeof (int*),
+
+        ILOAD_ADDR_CONST, arr,
+        ILOAD_STACK_OFFS_CONST, -8,
+        ISTORE_ADDR,
+
+        ILOAD_CONST, 0,
+
+        "loop1",
+        ILOAD_STACK_OFFS_CONST, -8,
+        ILOAD_ADDR,
+        ILOAD_INT,
+        IADD,
+
+        ILOAD_STACK_OFFS_CONST, -8,
+        ILOAD_ADDR,
+        ILOAD_CONST, sizeof (int),
+        IADD,
+        ILOAD_STACK_OFFS_CONST, -8,
+        ISTORE_ADDR,
+
+        ILOAD_STACK_OFFS_CONST, -8,
+        ILOAD_ADDR,
+        ILOAD_ADDR_CONST, arr + 4,
+        ISUB,
+        IJLT_CONST, "loop1",
+
+        ILOAD_ADDR_CONST, &res,
+        ISTORE_LONG,
+        HALT,
+    };
+
+    Assembler assembler(prog, toks);
+
+    VM vm(prog.data);
+    Profiler profiler(prog.data, prog.size());
+    vm.run(profiler);
+    profiler.writeOpcodeTable(stdout);
+    profiler.writeBlockTable(stdout, assembler.labelsByOffset());
+
+    printf("TYPED RESULT = %ld\n", res);
+
+    res = 0;
+    Jit jit(prog.data, prog.size());
+    VM jitVm(prog.data);
+    jit.run(jitVm);
+
+    printf("JIT RESULT = %ld\n", res);
+
+    res = 0;
+    RegProgram regProg;
+    RegTranslator translator(prog.data, prog.size(), regProg);
+
+    if (!translator.translate())
+        die(translator.error);
+
+    VM regVm(prog.data);
+    RegInterpreter::run(regVm, regProg);
+
+    printf("REGISTER RESULT = %ld (%zu instructions)\n", res, regProg.code.size());
+}
+
+// Saves a program to an image with its array in the constant pool and
+// its result bound to a host symbol, then maps the image and runs it.
+void imageTest()
+{
+    static int const arr[] = {2, 3, 4, 5};
+    long res = 0;
+    char const* path = "/tmp/iceberg-sum.img";
+    string error;
+
+    {
+        Program prog;
+        vector<AsmToken> toks = {
+            PUSHB_CONST, sizeof (int*),
+
+            ILOAD_ADDR_CONST, (Addr) arr,
+            ILOAD_STACK_OFFS_CONST, -8,
+            ISTORE_ADDR,
+
+            ILOAD_CONST, 0,
+
+            "loop1",
+            ILOAD_STACK_OFFS_CONST, -8,
+            ILOAD_ADDR,
+            ILOAD_INT,
+            IADD,
+
+            ILOAD_STACK_OFFS_CONST, -8,
+            ILOAD_ADDR,
+            ILOAD_CONST, sizeof (int),
+            IADD,
+            ILOAD_STACK_OFFS_CONST, -8,
+            ISTORE_ADDR,
+
+            ILOAD_STACK_OFFS_CONST, -8,
+            ILOAD_ADDR,
+            ILOAD_ADDR_CONST, (Addr) (arr + 4),
+            ISUB,
+            IJLT_CONST, "loop1",
+
+            ILOAD_ADDR_CONST, &res,
+            ISTORE_LONG,
+            HALT,
+        };
+
+        Assembler assembler(prog, toks);
+
+        SymbolTable symbols;
+        symbols.addConstant("arr", arr, sizeof arr);
+        symbols.addHost("res", &res, sizeof res);
+
+        if (!writeImage(prog, symbols, path, error))
+            die(error);
+    }
+
+    SymbolTable host;
+    host.addHost("res", &res);
+
+    Image image;
+
+    if (!image.load(path, host))
+        die(image.error);
+
+    VM vm(image.code());
+    vm.run();
+
+    // A code size that wraps when its HALT byte is counted must still be
+    // caught as corrupt.
+    uint32_t hugeCode = 0xFFFFFFFF;
+    int fd = open(path, O_WRONLY);
+    Image corrupt;
+
+    if (fd < 0 || pwrite(fd, &hugeCode, sizeof hugeCode, offsetof(ImageHeader, codeSize)) != sizeof hugeCode)
+        die("Failed to patch the image!");
+
+    close(fd);
+    bool rejected = !corrupt.load(path, host);
+    unlink(path);
+
+    printf("IMAGE RESULT = %ld (corrupt: %s)\n", res, rejected ? corrupt.error.c_str() : "loaded");
+}
+
+// Runs many short invocations of one shared program on a worker pool.
+// Each takes x on the operand stack and leaves x * x + 1 there.
+void runtimeTest()
+{
+    static int64_t results[10000];
+
+    Program prog;
+    vector<AsmToken> toks = {
+        "square",
+        PUSHB_CONST, 8,
+        ILOAD_STACK_OFFS_CONST, -8, ISTORE_LONG,
+        ILOAD_STACK_OFFS_CONST, -8, ILOAD_LONG,
+        ILOAD_STACK_OFFS_CONST, -8, ILOAD_LONG,
+        IMUL,
+        ILOAD_CONST, 1, IADD,
+        POPB_CONST, 8,
+        HALT,
+    };
+
+    Assembler assembler(prog, toks);
+
+    {
+        Runtime runtime(prog.data, 4);
+
+        for (int i = 0; i < 10000; ++i)
+        {
+            Invocation inv = {assembler.labMap["square"], 1, {}, [](VM& vm, void* user) {
+                results[(intptr_t) user] = vm.opStack.top[-1].i;
+            }, (void*) (intptr_t) i};
+            inv.args[0].i = i;
+            runtime.submit(inv);
+        }
+
+        runtime.wait();
+    }
+
+    int64_t sum = 0;
+
+    for (int64_t r : results)
+        sum += r;
+
+    printf("RUNTIME RESULT = %ld\n", (long) sum);
+}
+
+// Counts a local down from 1000 in slices of at most 500 instructions,
+// resuming the suspended VM until it halts.
+void budgetTest()
+{
+    int64_t res = 0;
+
+    Program prog;
+    vector<AsmToken> toks = {
+        PUSHB_CONST, 8,
+        ILOAD_CONST, 1000,
+        ILOAD_STACK_OFFS_CONST, -8,
+        ISTORE_LONG,
+
+        "loop",
+        ILOAD_STACK_OFFS_CONST, -8, ILOAD_LONG,
+        ILOAD_CONST, 1, ISUB,
+        ILOAD_STACK_OFFS_CONST, -8, ISTORE_LONG,
+        ILOAD_ADDR_CONST, &res, ILOAD_LONG,
+        ILOAD_CONST, 3, IADD,
+        ILOAD_ADDR_CONST, &res, ISTORE_LONG,
+        ILOAD_STACK_OFFS_CONST, -8, ILOAD_LONG,
+        IJGT_CONST, "loop",
+
+        POPB_CONST, 8,
+        HALT,
+    };
+
+    Assembler assembler(prog, toks);
+
+    VM vm(prog.data);
+    Budget budget;
+    int slices = 0;
+
+    do
+    {
+        budget.refill(500);
+        ++slices;
+    } while (vm.run(budget) == RUN_SUSPENDED);
+
+    printf("BUDGET RESULT = %ld in %d slices\n", (long) res, slices);
+}
+
+// Recursive Fibonacci with CALL and RET: n arrives on the operand stack,
+// fib keeps it in a frame local and leaves its result on the stack. A leaf
+// function adds 1 at the end. The assembler only resolves labels it has
+// already seen, so callees come first and the run starts at main. Runs on
+// the interpreter and on the JIT.
+void callTest()
+{
+    int64_t res = 0;
+
+    Program prog;
+    vector<AsmToken> toks = {
+        "inc",
+        ILOAD_CONST, 1, IADD,
+        RET_LEAF,
+
+        "base",
+        ILOAD_FRAME_OFFS_CONST, 0, ILOAD_LONG,
+        RET,
+
+        "fib",
+        PUSHB_CONST, 8,
+        ILOAD_FRAME_OFFS_CONST, 0, ISTORE_LONG,
+        ILOAD_FRAME_OFFS_CONST, 0, ILOAD_LONG,
+        ILOAD_CONST, 2, ISUB,
+        IJLT_CONST, "base",
+
+        ILOAD_FRAME_OFFS_CONST, 0, ILOAD_LONG,
+        ILOAD_CONST, 1, ISUB,
+        CALL, "fib",
+        ILOAD_FRAME_OFFS_CONST, 0, ILOAD_LONG,
+        ILOAD_CONST, 2, ISUB,
+        CALL, "fib",
+        IADD,
+        RET,
+
+        "main",
+        ILOAD_CONST, 20,
+        CALL, "fib",
+        CALL_LEAF, "inc",
+        ILOAD_ADDR_CONST, &res,
+        ISTORE_LONG,
+        HALT,
+
+        // Leaves fib(15) on the operand stack.
+        "shared",
+        ILOAD_CONST, 15,
+        CALL, "fib",
+        HALT,
+    };
+
+    Assembler assembler(prog, toks);
+    uint8_t* main = prog.data + assembler.labMap["main"];
+
+    VM vm(prog.data);
+    vm.reset(main);
+    vm.run();
+
+    int64_t interpreted = res;
+    res = 0;
+    Jit jit(prog.data, prog.size());
+    VM jitVm(prog.data);
+    jitVm.reset(main);
+    jit.run(jitVm);
+
+    int64_t compiled = res;
+    res = 0;
+    RegProgram regProg;
+    RegTranslator translator(prog.data, prog.size(), regProg, main - prog.data);
+
+    if (!translator.translate())
+        die(translator.error);
+
+    VM regVm(prog.data);
+    regVm.reset(main);
+    RegInterpreter::run(regVm, regProg);
+
+    printf("CALL RESULT = %ld (jit %ld, register %ld)\n", (long) interpreted, (long) compiled, (long) res);
+
+    // One Jit run from several threads before it has compiled: they race
+    // to pass the threshold, and exactly one compile must win.
+    Jit shared(prog.data, prog.size(), 2);
+    uint8_t* sharedEntry = prog.data + assembler.labMap["shared"];
+    int64_t sums[4] = {};
+    vector<thread> threads;
+
+    for (int t = 0; t < 4; ++t)
+        threads.emplace_back([&, t]() {
+            VM tvm(prog.data);
+
+            for (int i = 0; i < 8; ++i)
+            {
+                tvm.reset(sharedEntry);
+                shared.run(tvm);
+                sums[t] += tvm.opStack.pop().i;
+            }
+        });
+
+    for (thread& th : threads)
+        th.join();
+
+    printf("SHARED JIT RESULT = %ld %ld %ld %ld (compiled %d)\n", (long) sums[0], (long) sums[1],
+            (long) sums[2], (long) sums[3], (int) shared.compiled());
+}
+
+// Runs several scripts on one event loop. Each looks its key up through a
+// host function that answers from another thread a little later, then adds
+// 1 with a synchronous one; the loop keeps running the others meanwhile.
+// The replying threads are joined after the loop, since they may still be
+// inside complete() when the last script halts.
+void asyncTest()
+{
+    struct Async {
+        EventLoop loop;
+        vector<thread> replies;
+    } async;
+
+    EventLoop& loop = async.loop;
+    HostTable hosts;
+
+    int32_t lookup = hosts.add("lookup", [](VM& vm, void* user) {
+        Async* async = (Async*) user;
+        EventLoop* loop = &async->loop;
+        int64_t key = vm.opStack.pop().i;
+
+        async->replies.push_back(thread([loop, &vm, key] {
+            this_thread::sleep_for(chrono::milliseconds(1));
+            Slot res;
+            res.i = key * 10;
+            loop->complete(vm, &res, 1);
+        }));
+
+        return HOST_PENDING;
+    }, &async);
+
+    int32_t add = hosts.add("add", [](VM& vm, void*) {
+        int64_t b = vm.opStack.pop().i;
+        Slot res;
+        res.i = vm.opStack.pop().i + b;
+        vm.opStack.push(res);
+        return HOST_DONE;
+    });
+
+    Program prog;
+    vector<AsmToken> toks = {
+        CALL_HOST, lookup,
+        ILOAD_CONST, 1,
+        CALL_HOST, add,
+        HALT,
+    };
+
+    Assembler assembler(prog, toks);
+
+    int64_t sum = 0;
+    loop.user = &sum;
+    loop.halted = [](VM& vm, void* user) {
+        *(int64_t*) user += vm.opStack.top[-1].i;
+    };
+
+    vector<unique_ptr<VM>> vms;
+
+    for (int key = 1; key <= 8; ++key)
+    {
+        vms.push_back(unique_ptr<VM>(new VM(prog.data)));
+        VM& vm = *vms.back();
+        vm.hosts = &hosts;
+
+        Slot arg;
+        arg.i = key;
+        vm.opStack.push(arg);
+        loop.spawn(vm);
+    }
+
+    loop.run();
+
+    for (thread& reply : async.replies)
+        reply.join();
+
+    printf("ASYNC RESULT = %ld\n", (long) sum);
+}
+
+// Copies an int array into the gp stack with one instruction and reduces
+// it with a few more, then zeroes it; a double array is summed where it
+// lies. Runs on the interpreter and on the JIT.
+void bulkTest()
+{
+    int arr[1000];
+    double vals[1000];
+    int64_t res[5];
+    double dsum;
+
+    for (int i = 0; i < 1000; ++i)
+    {
+        arr[i] = i + 1;
+        vals[i] = 0.5 * (i + 1);
+    }
+
+    Program prog;
+    vector<AsmToken> toks = {
+        PUSHB_CONST, sizeof arr,
+        ILOAD_STACK_OFFS_CONST, -(int) sizeof arr, ILOAD_ADDR_CONST, arr, ILOAD_CONST, sizeof arr,
+        BLOCK_COPY,
+
+        ILOAD_STACK_OFFS_CONST, -(int) sizeof arr, ILOAD_CONST, 1000, ISUM_INT,
+        ILOAD_ADDR_CONST, &res[0], ISTORE_LONG,
+        ILOAD_STACK_OFFS_CONST, -(int) sizeof arr, ILOAD_CONST, 1000, IMIN_INT,
+        ILOAD_ADDR_CONST, &res[1], ISTORE_LONG,
+        ILOAD_STACK_OFFS_CONST, -(int) sizeof arr, ILOAD_CONST, 1000, IMAX_INT,
+        ILOAD_ADDR_CONST, &res[2], ISTORE_LONG,
+        ILOAD_STACK_OFFS_CONST, -(int) sizeof arr, ILOAD_STACK_OFFS_CONST, -(int) sizeof arr,
+        ILOAD_CONST, 1000, IDOT_INT,
+        ILOAD_ADDR_CONST, &res[3], ISTORE_LONG,
+
+        ILOAD_STACK_OFFS_CONST, -(int) sizeof arr, ILOAD_CONST, 0, ILOAD_CONST, sizeof arr,
+        BLOCK_FILL,
+        ILOAD_STACK_OFFS_CONST, -(int) sizeof arr, ILOAD_CONST, 1000, ISUM_INT,
+        ILOAD_ADDR_CONST, &res[4], ISTORE_LONG,
+
+        ILOAD_ADDR_CONST, vals, ILOAD_CONST, 1000, DSUM_DOUBLE,
+        ILOAD_ADDR_CONST, &dsum, DSTORE_DOUBLE,
+        POPB_CONST, sizeof arr,
+        HALT,
+    };
+
+    Assembler assembler(prog, toks);
+
+    VM vm(prog.data);
+    vm.run();
+
+    printf("BULK RESULT = %ld %ld %ld %ld %ld %.1f (%s)\n", (long) res[0], (long) res[1], (long) res[2],
+            (long) res[3], (long) res[4], dsum, bulkKernels().name);
+
+    memset(res, 0, sizeof res);
+    dsum = 0;
+    Jit jit(prog.data, prog.size());
+    VM jitVm(prog.data);
+    jit.run(jitVm);
+
+    printf("JIT BULK RESULT = %ld %ld %ld %ld %ld %.1f\n", (long) res[0], (long) res[1], (long) res[2],
+            (long) res[3], (long) res[4], dsum);
+
+    memset(res, 0, sizeof res);
+    dsum = 0;
+    RegProgram regProg;
+    RegTranslator translator(prog.data, prog.size(), regProg);
+
+    if (!translator.translate())
+        die(translator.error);
+
+    VM regVm(prog.data);
+    RegInterpreter::run(regVm, regProg);
+
+    printf("REGISTER BULK RESULT = %ld %ld %ld %ld %ld %.1f\n", (long) res[0], (long) res[1], (long) res[2],
+            (long) res[3], (long) res[4], dsum);
+}
+
+// Every kernel level available here against the scalar one, bit for bit,
+// on inputs whose float and double sums round differently in different
+// orders, and on lengths around the vector widths, starting at 0.
+void bulkLevelsTest()
+{
+    static size_t const lengths[] = {0, 1, 3, 15, 16, 17, 31, 32, 33, 47, 64, 100, 1001};
+    int32_t ints[1024];
+    float floats[1024];
+    double doubles[1024];
+    uint32_t seed = 12345;
+
+    for (int i = 0; i < 1024; ++i)
+    {
+        seed = seed * 1103515245 + 12345;
+        ints[i] = (int32_t) (seed >> 1) - (1 << 30);
+        floats[i] = (float) (seed % 100003) / 7919.0f - 6.3f;
+        doubles[i] = (double) (seed % 1000003) / 7919.0 - 63.1;
+    }
+
+    BulkKernels const* scalar = bulkKernelsFor(BULK_SCALAR);
+    BulkLevel const levels[] = {BULK_SSE4, BULK_AVX2};
+    string names = scalar->name;
+    int checks = 0;
+    bool same = true;
+
+    for (BulkLevel level : levels)
+    {
+        BulkKernels const* k = bulkKernelsFor(level);
+
+        if (!k)
+            continue;
+
+        names += string(" ") + k->name;
+
+        for (size_t n : lengths)
+        {
+            // Start one element in, so the loads are unaligned too.
+            int32_t const* i = ints + 1;
+            float const* f = floats + 1;
+            double const* d = doubles + 1;
+            int32_t const* i2 = ints + 7;
+            float const* f2 = floats + 7;
+            double const* d2 = doubles + 7;
+
+            int64_t intResults[2][4] = {
+                {scalar->sumInt(i, n), scalar->minInt(i, n), scalar->maxInt(i, n), scalar->dotInt(i, i2, n)},
+                {k->sumInt(i, n), k->minInt(i, n), k->maxInt(i, n), k->dotInt(i, i2, n)},
+            };
+            float floatResults[2][4] = {
+                {scalar->sumFloat(f, n), scalar->minFloat(f, n), scalar->maxFloat(f, n), scalar->dotFloat(f, f2, n)},
+                {k->sumFloat(f, n), k->minFloat(f, n), k->maxFloat(f, n), k->dotFloat(f, f2, n)},
+            };
+            double doubleResults[2][4] = {
+                {scalar->sumDouble(d, n), scalar->minDouble(d, n), scalar->maxDouble(d, n),
+                    scalar->dotDouble(d, d2, n)},
+                {k->sumDouble(d, n), k->minDouble(d, n), k->maxDouble(d, n), k->dotDouble(d, d2, n)},
+            };
+
+            same = same && memcmp(intResults[0], intResults[1], sizeof intResults[0]) == 0
+                    && memcmp(floatResults[0], floatResults[1], sizeof floatResults[0]) == 0
+                    && memcmp(doubleResults[0], doubleResults[1], sizeof doubleResults[0]) == 0;
+            checks += 12;
+        }
+    }
+
+    printf("BULK LEVELS RESULT = %d checks, %s (%s)\n", checks, same ? "same" : "different", names.c_str());
+}
+
+// Runs one script over an array of structs: each record gets the
+// addresses of its two fields and leaves a * 2 + (int) b. Runs on one
+// thread, then on four with the JIT.
+void batchTest()
+{
+    struct Row {
+        int32_t a;
+        double b;
+    };
+
+    static Row rows[10000];
+    static Slot results[10000];
+
+    for (int i = 0; i < 10000; ++i)
+        rows[i] = Row{i, i * 0.5};
+
+    Program prog;
+    vector<AsmToken> toks = {
+        PUSHB_CONST, 8,
+        DLOAD_DOUBLE, D2I,
+        ILOAD_STACK_OFFS_CONST, -8, ISTORE_LONG,
+        ILOAD_INT,
+        ILOAD_CONST, 2, IMUL,
+        ILOAD_STACK_OFFS_CONST, -8, ILOAD_LONG,
+        IADD,
+        POPB_CONST, 8,
+        HALT,
+    };
+
+    Assembler assembler(prog, toks);
+
+    Batch batch = {10000, 2, {
+        {(uint8_t*) &rows[0].a, sizeof (Row)},
+        {(uint8_t*) &rows[0].b, sizeof (Row)},
+    }, results};
+
+    BatchRunner runner(prog.data);
+    runner.run(batch);
+
+    int64_t sum = 0;
+
+    for (Slot res : results)
+        sum += res.i;
+
+    memset(results, 0, sizeof results);
+    Jit jit(prog.data, prog.size());
+    BatchRunner threaded(prog.data, 0, 4, &jit);
+    threaded.run(batch);
+
+    int64_t threadedSum = 0;
+
+    for (Slot res : results)
+        threadedSum += res.i;
+
+    printf("BATCH RESULT = %ld (4 threads %ld)\n", (long) sum, (long) threadedSum);
+}
+
 void testFrame()
 {
     Program prog;
@@ -264,178 +897,267 @@ void testScanner()
     }
 }
 
-/*
- * expr = (list | atom)
- * list = '(' expr* ')'
- * atom = name | literal
-*/
-
-struct ASTNode {
-    enum Type {
-        LIST, ATOM,
-    };
-    
-    typedef std::shared_ptr<ASTNode> Sptr;
-    
-    Type type;
-    
-    ASTNode(Type type_): type(type_)
+// Runs of whitespace and of name characters, 15 to 33 bytes long around
+// the 16 and 32 byte blocks, ended by every kind of byte that stops them
+// or by the limit, skipped by the selected kernels and by the scalar ones.
+void scanSkipTest()
+{
+    static int const lengths[] = {0, 1, 2, 15, 16, 17, 31, 32, 33, 47, 48, 49, 64, 65};
+    static char const spaceChars[] = " \t\n\r\f";
+    static char const nameChars[] = "az09AZ!$%&*+-./:<=>?@^_~";
+    static char const stops[] = {'a', '(', ')', '"', '#', '\'', ';', '[', '\\', ']', '`', '{', '|', '}', ' ',
+        '\t', '\v', '\0', 0x7F, (char) 0x80, (char) 0xFF};
+    vector<ScanKernels> levels(1, scanKernels());
+    string levelNames = levels[0].name;
+    char buf[128];
+    int checks = 0;
+    bool same = true;
+
+#ifdef SCAN_HAS_SIMD
+    // The SSE2 kernels also run on their own when AVX2 is picked.
+    if (levels[0].skipName != &Sse2Scan::skipName)
     {
+        levels.push_back(ScanKernels{"sse2", &Sse2Scan::skipSpace, &Sse2Scan::skipName});
+        levelNames += " sse2";
     }
-    
-    virtual void print() = 0;
-    virtual ~ASTNode() = default;
-};
+#endif
 
-struct List: public ASTNode {
-    list<ASTNode::Sptr> nodes;
-    
-    List(): ASTNode(ASTNode::LIST)
-    {
-    }
-    
-    void print()
+    for (ScanKernels const& kernels : levels)
     {
-        printf("(");
-        
-        for(auto node : nodes)
+        for (int space = 0; space < 2; ++space)
         {
-            node->print();
-            printf(" ");
+            char const* run = space ? spaceChars : nameChars;
+            size_t runChars = strlen(run);
+
+            for (int length : lengths)
+                for (int offs = 0; offs < 4; ++offs)
+                    for (size_t stop = 0; stop <= sizeof stops; ++stop)
+                    {
+                        char* p = buf + offs;
+
+                        for (int i = 0; i < length; ++i)
+                            p[i] = run[(i * 7 + offs) % runChars];
+
+                        // The last round puts the limit right after the run.
+                        bool atLimit = stop == sizeof stops;
+                        char stopChar = atLimit ? 'a' : stops[stop];
+
+                        if (!atLimit && (space ? isSpaceChar(stopChar) : isNameChar(stopChar)))
+                            continue;
+
+                        p[length] = stopChar;
+                        char const* limit = atLimit ? p + length : p + length + 1;
+                        char const* expected = space ? ScalarScan::skipSpace(p, limit)
+                                : ScalarScan::skipName(p, limit);
+                        char const* got = space ? kernels.skipSpace(p, limit) : kernels.skipName(p, limit);
+
+                        same = same && expected == p + length && got == expected;
+                        ++checks;
+                    }
         }
-        
-        printf(")");
     }
-};
 
-struct Atom: public ASTNode {
-    Token token;
-    
-    Atom(Token token_): ASTNode(ASTNode::ATOM), token(token_)
-    {
-    }
-    
-    void print()
-    {
-        printf("%s", token.text.c_str());
-    }
-};
+    printf("SCAN SKIP RESULT = %d checks, %s (%s)\n", checks, same ? "same" : "different", levelNames.c_str());
+}
 
-struct CompilationError: public std::exception {
-    char msgBuff[512];
-    
-    CompilationError(std::string const& msg)
-    {
-        copyToBuff<512>(msgBuff, msg);
-    }
-    
-    const char* what() const noexcept
+// Streams a pipe through a 16 byte buffer, so most tokens cross a refill,
+// and checks it scans the same as the whole source in memory.
+void testStreamScanner()
+{
+    char const* src = "(defun square (x)\n    (mul x x))\n  (square 12345) ?! (a (b (c (d))))";
+    int fds[2];
+
+    // The source fits in the pipe buffer, so it can all go in up front.
+    if (pipe(fds) != 0 || write(fds[1], src, strlen(src)) != (ssize_t) strlen(src))
+        die("Failed to feed the stream scanner!");
+
+    close(fds[1]);
+    int fd = fds[0];
+    StreamScanner stream(fd, 16);
+    Scanner scanner(src);
+    int count = 0;
+    bool same = true;
+
+    for (;;)
     {
-        return msgBuff;
+        Token expected = scanner.next();
+        Token tok = stream.next();
+        same = same && tok.type == expected.type && tok.text == expected.text;
+        ++count;
+
+        if (expected.type == Token::END_OF_INPUT)
+            break;
     }
-};
 
-struct Parser {
-    typedef std::list<Token>::const_iterator TokenIter;
-    
-    TokenIter cursor;
-    
-    Parser(TokenIter start): cursor(start)
+    close(fd);
+    printf("STREAM SCANNER RESULT = %d tokens, %s\n", count, same ? "same" : "different");
+}
+
+// The tree in print()'s format.
+static void astText(ASTNode const* node, string& out)
+{
+    if (node->type == ASTNode::ATOM)
     {
+        out += static_cast<Atom const*>(node)->text();
+        return;
     }
-    
-    // **********
-    // * Errors *
-    // **********
-    
-    void expectedTokenError(Token::Type tok)
+
+    List const* lst = static_cast<List const*>(node);
+    out += "(";
+
+    for (uint32_t i = 0; i < lst->count; ++i)
     {
-        throw CompilationError("Expected '" + Token::typeName(tok) + "'");
+        astText(lst->nodes[i], out);
+        out += " ";
     }
-    
-    void unexpectedTokenError(Token const& tok)
+
+    out += ")";
+}
+
+// Edge cases of the grammar, with the trees and the errors the recursive
+// parser gave for them.
+void parseCasesTest()
+{
+    static char const* const cases[][2] = {
+        {"()", "()"},
+        {"(tata () zaza (baz (kaka ())))", "(tata () zaza (baz (kaka () ) ) )"},
+        {"(a) b", "(a )"},
+        {"12", "12"},
+        {")", "Unexpected ')'"},
+        {"(", "Unexpected 'end of input'"},
+        {"(a (b", "Unexpected 'end of input'"},
+        {"", "Unexpected 'end of input'"},
+        {"(a [ b)", "Unexpected '['"},
+        {"\"", "Unexpected '\"'"},
+    };
+    int passed = 0;
+    int count = sizeof cases / sizeof cases[0];
+
+    for (int i = 0; i < count; ++i)
     {
-        if(tok.type == Token::INVALID)
-            throw CompilationError("Unexpected '" + tok.text + "'");
+        Scanner scanner(cases[i][0]);
+        auto toks = scanner.scanViews();
+        ASTArena ast;
+        Parser parser(toks.begin(), ast);
+        string got;
+
+        try
+        {
+            astText(parser.readExpr(), got);
+        }
+
+        catch(CompilationError const& e)
+        {
+            got = e.what();
+        }
+
+        if (got == cases[i][1])
+            ++passed;
         else
-            throw CompilationError("Unexpected '" + Token::typeName(tok.type) + "'");
+            printf("PARSE CASE '%s': got %s, expected %s\n", cases[i][0], got.c_str(), cases[i][1]);
     }
-    
-    // ********
-    // * Util *
-    // ********
-    
-    bool end()
-    {
-        return cursor->type == Token::END_OF_INPUT;
-    }
-    
-    Token::Type peek()
-    {
-        return cursor->type;
-    }
-    
-    void readToken(Token::Type tok)
+
+    printf("PARSE CASES RESULT = %d of %d\n", passed, count);
+}
+
+// Every tree P reads from src until the end of input or the first error,
+// one per line, then the error if there was one.
+template <typename P>
+static string parseTranscript(string const& src)
+{
+    Scanner scanner(src.c_str());
+    auto toks = scanner.scanViews();
+    ASTArena ast;
+    P parser(toks.begin(), ast);
+    string out;
+
+    try
     {
-        if(peek() != tok)
-            expectedTokenError(tok);
-        ++cursor;
+        while (!parser.end())
+        {
+            astText(parser.readExpr(), out);
+            out += "\n";
+        }
     }
-    
-    Token::Type readToken()
+
+    catch(CompilationError const& e)
     {
-        return (cursor++)->type;
+        out += e.what();
     }
-    
-    // *********
-    // * Rules *
-    // *********
-    
-    ASTNode::Sptr readList()
+
+    return out;
+}
+
+// Random token sequences, balanced or not, through both parsers; the
+// trees and the errors must match. The seed is fixed so a failure
+// reproduces.
+void parseDifferentialTest()
+{
+    static char const* const pieces[] = {"(", "(", "(", ")", ")", ")", "a", "bc", "12", "[", " "};
+    int const count = 50000;
+    uint32_t seed = 2024;
+    int same = 0;
+
+    for (int i = 0; i < count; ++i)
     {
-        std::shared_ptr<List> lst(new List());
-        
-        readToken(Token::OBR);
-        
-        while(peek() != Token::CBR)
+        seed = seed * 1103515245 + 12345;
+        int length = (seed >> 16) % 24;
+        string src;
+
+        for (int j = 0; j < length; ++j)
         {
-            lst->nodes.push_back(readExpr());
+            seed = seed * 1103515245 + 12345;
+            src += pieces[(seed >> 16) % (sizeof pieces / sizeof pieces[0])];
+            src += " ";
         }
-        
-        readToken(Token::CBR);
-        
-        return lst;
+
+        string expected = parseTranscript<RecursiveParser>(src);
+        string got = parseTranscript<Parser>(src);
+
+        if (got == expected)
+            ++same;
+        else if (i - same < 3)
+            printf("PARSE DIFF '%s': got %s, expected %s\n", src.c_str(), got.c_str(), expected.c_str());
     }
-    
-    static bool isAtom(Token::Type tokType)
+
+    printf("PARSE DIFF RESULT = %d of %d same\n", same, count);
+}
+
+// Nests far deeper than the native stack would allow a recursive parser.
+void deepParseTest()
+{
+    int const depth = 1000000;
+    string src = string(depth, '(') + "leaf" + string(depth, ')');
+    Scanner scanner(src.c_str());
+    auto toks = scanner.scanViews();
+    ASTArena ast;
+    Parser parser(toks.begin(), ast);
+    ASTNode* node = parser.readExpr();
+    int levels = 0;
+
+    while (node->type == ASTNode::LIST && static_cast<List*>(node)->count == 1)
     {
-        return tokType != Token::CBR &&
-                tokType != Token::OBR &&
-                tokType != Token::END_OF_INPUT &&
-                tokType != Token::INVALID;
+        node = static_cast<List*>(node)->nodes[0];
+        ++levels;
     }
-    
-    ASTNode::Sptr readAtom()
+
+    printf("DEEP PARSE RESULT = %d levels, %s\n", levels, static_cast<Atom*>(node)->text());
+
+    src.pop_back();
+    scanner = Scanner(src.c_str());
+    toks = scanner.scanViews();
+    Parser unbalanced(toks.begin(), ast);
+
+    try
     {
-        Token::Type tokType = peek();
-        
-        if(isAtom(tokType))
-            return ASTNode::Sptr(new Atom(*(cursor++)));
-        else
-            unexpectedTokenError(*cursor);
+        unbalanced.readExpr();
     }
-    
-    ASTNode::Sptr readExpr()
+
+    catch(CompilationError const& e)
     {
-        switch(peek())
-        {
-            case Token::OBR:
-                return readList();
-            default:
-                return readAtom();
-        }
+        printf("DEEP PARSE ERROR = %s\n", e.what());
     }
-};
+}
 
 /*
 (declfun zaza (int int (char *)) (int))
@@ -447,12 +1169,13 @@ struct Parser {
 int main()
 {
     Scanner scanner("(tata () zaza (baz (kaka ())))");
-    auto toks = scanner.scan();
-    Parser parser(toks.begin());
+    auto toks = scanner.scanViews();
+    ASTArena ast;
+    Parser parser(toks.begin(), ast);
 
     try
     {
-        ASTNode::Sptr root = parser.readExpr();
+        ASTNode* root = parser.readExpr();
         root->print();
     }
     
@@ -464,6 +1187,20 @@ int main()
     printf("\n");
     
     sumTest();
+    typedSumTest();
+    imageTest();
+    runtimeTest();
+    budgetTest();
+    asyncTest();
+    callTest();
+    bulkTest();
+    bulkLevelsTest();
+    batchTest();
+    scanSkipTest();
+    testStreamScanner();
+    parseCasesTest();
+    parseDifferentialTest();
+    deepParseTest();
     //testFrame();
     
     return 0;